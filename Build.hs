@@ -2,6 +2,7 @@ import Development.Shake
 import Development.Shake.Command
 import Development.Shake.FilePath
 import Development.Shake.Util
+import Data.List (intercalate)
 
 buildBin :: String -- ^ Target.
          -> String -- ^ Main source.
@@ -20,11 +21,44 @@ buildBin target source outputDir flags = do
     unit $ quietly $ cmd "mv -f" (outputDir ++ "/Main.o") (target <.> ".o")
     unit $ quietly $ cmd "mv -f" (outputDir ++ "/Main.hi") (target <.> ".hi")
  
+-- | A C header defining a NUL-terminated char array with the given contents.
+embedSource :: String -- ^ Array name.
+            -> String -- ^ Contents.
+            -> String
+embedSource name contents = unlines $
+    [ "// Generated by Build.hs. Do not edit."
+    , "static char const " ++ name ++ "[] = {"
+    ] ++
+    map (\line -> "    " ++ intercalate ", " (map show line) ++ ",") (chunks (map fromEnum contents ++ [0])) ++
+    [ "};" ]
+  where
+    chunks [] = []
+    chunks xs = take 16 xs : chunks (drop 16 xs)
+
 main :: IO ()
 main = shakeArgs shakeOptions{shakeFiles="_build"} $ do
     phony "run" $ do
+        need ["_build/cfourier_test"]
+        cmd "time _build/cfourier_test"
+
+    phony "run_bench" $ do
+        need ["_build/cfourier"]
+        cmd "_build/cfourier bench"
+
+    phony "run_tune" $ do
         need ["_build/cfourier"]
-        cmd "time _build/cfourier"
+        cmd "_build/cfourier tune"
+
+    phony "run_suite" $ need ["_build/suite.csv", "_build/suite.json"]
+
+    -- Keeps the current suite results to compare later builds against.
+    phony "save_suite_baseline" $ do
+        need ["_build/suite.csv"]
+        copyFile' "_build/suite.csv" "_build/suite_baseline.csv"
+
+    phony "compare_suite" $ do
+        need ["_build/suite.csv", "_build/suite_baseline.csv"]
+        cmd "_build/cfourier compare _build/suite_baseline.csv _build/suite.csv"
 
     phony "run_hs" $ do
         need ["_build/hsfourier"]
@@ -35,8 +69,22 @@ main = shakeArgs shakeOptions{shakeFiles="_build"} $ do
         cmd "firefox _build/benchmark.html"
 
     "_build/cfourier" %> \out -> do
-        need ["cfourier.cc"]
-        cmd "g++ -o _build/cfourier cfourier.cc --std=c++11 -O2 -Wall -lOpenCL"
+        need ["cfourier.cc", "_build/fourier_cl.h"]
+        cmd "g++ -o _build/cfourier cfourier.cc --std=c++11 -O2 -Wall -I_build -DFOURIER_EMBED_SOURCE -lOpenCL"
+
+    -- The tests, with operator new counted.
+    "_build/cfourier_test" %> \out -> do
+        need ["cfourier.cc", "_build/fourier_cl.h"]
+        cmd "g++ -o _build/cfourier_test cfourier.cc --std=c++11 -O2 -Wall -I_build -DFOURIER_EMBED_SOURCE -DFOURIER_COUNT_ALLOCATIONS -lOpenCL"
+
+    ["_build/suite.csv", "_build/suite.json"] &%> \_ -> do
+        need ["_build/cfourier"]
+        cmd "_build/cfourier suite _build/suite"
+
+    "_build/fourier_cl.h" %> \out -> do
+        need ["fourier.cl"]
+        source <- readFile' "fourier.cl"
+        writeFile' out $ embedSource "fourier_cl_source" source
 
     "_build/hsfourier" %> \out -> buildBin "_build/hsfourier" "hsfourier.hs" "_build/" ""
     "_build/Benchmark" %> \out -> buildBin "_build/Benchmark" "Benchmark.hs" "_build/" ""
@@ -10,10 +10,234 @@
 #include <boost/noncopyable.hpp>
 #include <CL/opencl.h>
 #include <iomanip>
+#include <chrono>
+#include <string>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <algorithm>
+#include <limits>
+#include <cstdio>
+#include <iterator>
+#include <list>
+#include <deque>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+#include <new>
+#include <tuple>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#if defined(FOURIER_EMBED_SOURCE)
+#include "fourier_cl.h"
+#endif
 
 typedef float Float;
 typedef std::complex<Float> Complex;
-typedef std::vector<Complex> Signal;
+
+// Per-thread free lists of 64-byte-aligned blocks in power-of-two sizes.
+// Signals allocate from them, so a loop that makes and drops signals of the
+// same sizes stops calling malloc after its first pass. A block freed on
+// another thread than the one that allocated it joins the freeing thread's
+// lists. When a thread exits, its blocks move to shared lists that any
+// thread allocates from before it asks the system.
+class BufferPool
+{
+public:
+    static size_t const alignment = 64;
+    // Bytes each thread, and the shared lists, keep at most. Blocks freed
+    // beyond that go back to the system. Size classes round up to a power of
+    // two, so the lists can hold up to twice the bytes last in use.
+    static size_t const max_cached_bytes = (size_t) 32 << 20;
+
+    static void* allocate(size_t byte_count)
+    {
+        size_t size_class = size_class_of(byte_count);
+        ThreadState& state = thread_state();
+        if (void* block = pop(state, size_class)) return block;
+        if (void* block = allocate_shared(size_class)) return block;
+
+        system_allocations().fetch_add(1, std::memory_order_relaxed);
+        void* block;
+        if (posix_memalign(&block, alignment, block_size(size_class)) != 0) throw std::bad_alloc();
+        return block;
+    }
+
+    static void deallocate(void* block, size_t byte_count)
+    {
+        size_t size_class = size_class_of(byte_count);
+        ThreadState& state = thread_state();
+        if (state.closed || !push(state, size_class, block)) std::free(block);
+    }
+
+    // Gives the calling thread's free blocks back to the system.
+    static void trim()
+    {
+        ThreadState& state = thread_state();
+        for (void*& list : state.free_lists) {
+            while (list != NULL) {
+                void* next = *static_cast<void**>(list);
+                std::free(list);
+                list = next;
+            }
+        }
+        state.cached_bytes = 0;
+    }
+
+    // Blocks taken from the system by every thread so far.
+    static size_t system_allocation_count()
+    {
+        return system_allocations().load(std::memory_order_relaxed);
+    }
+
+private:
+    // Trivially destructible, so that signals destroyed after the thread's
+    // Closer, such as those of statics, can still find it and see closed.
+    struct ThreadState
+    {
+        void* free_lists[64];
+        size_t cached_bytes;
+        bool closed;
+    };
+
+    // Moves the lists to the shared ones when the thread exits.
+    struct Closer
+    {
+        ~Closer()
+        {
+            ThreadState& state = thread_state();
+            {
+                ThreadState& shared = shared_state();
+                std::lock_guard<std::mutex> lock(shared_mutex());
+                for (size_t size_class = 0; size_class != 64; ++size_class) {
+                    while (void* block = pop(state, size_class)) {
+                        if (!push(shared, size_class, block)) std::free(block);
+                    }
+                }
+            }
+            state.closed = true;
+        }
+    };
+
+    static void* pop(ThreadState& state, size_t size_class)
+    {
+        void* block = state.free_lists[size_class];
+        if (block == NULL) return NULL;
+        state.free_lists[size_class] = *static_cast<void**>(block);
+        state.cached_bytes -= block_size(size_class);
+        return block;
+    }
+
+    // False, leaving block to the caller, if it would take state over
+    // max_cached_bytes.
+    static bool push(ThreadState& state, size_t size_class, void* block)
+    {
+        if (state.cached_bytes + block_size(size_class) > max_cached_bytes) return false;
+        *static_cast<void**>(block) = state.free_lists[size_class];
+        state.free_lists[size_class] = block;
+        state.cached_bytes += block_size(size_class);
+        return true;
+    }
+
+    static void* allocate_shared(size_t size_class)
+    {
+        ThreadState& shared = shared_state();
+        std::lock_guard<std::mutex> lock(shared_mutex());
+        return pop(shared, size_class);
+    }
+
+    static ThreadState& thread_state()
+    {
+        static thread_local ThreadState state;
+        static thread_local Closer closer;
+        (void) closer;
+        return state;
+    }
+
+    // Zero-initialized and never destroyed, so threads that exit during
+    // static destruction can still use it.
+    static ThreadState& shared_state()
+    {
+        static ThreadState state;
+        return state;
+    }
+
+    static std::mutex& shared_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::atomic<size_t>& system_allocations()
+    {
+        static std::atomic<size_t> count(0);
+        return count;
+    }
+
+    static size_t size_class_of(size_t byte_count)
+    {
+        size_t size_class = 0;
+        while (block_size(size_class) < byte_count) ++size_class;
+        return size_class;
+    }
+
+    static size_t block_size(size_t size_class)
+    {
+        return (size_t) alignment << size_class;
+    }
+};
+
+// std::allocator over BufferPool.
+template <typename T>
+struct PoolAllocator
+{
+    typedef T value_type;
+
+    PoolAllocator()
+    {
+    }
+
+    template <typename U>
+    PoolAllocator(PoolAllocator<U> const&)
+    {
+    }
+
+    T* allocate(size_t count)
+    {
+        return static_cast<T*>(BufferPool::allocate(count*sizeof(T)));
+    }
+
+    void deallocate(T* data, size_t count)
+    {
+        BufferPool::deallocate(data, count*sizeof(T));
+    }
+};
+
+template <typename T, typename U>
+static bool operator==(PoolAllocator<T> const&, PoolAllocator<U> const&)
+{
+    return true;
+}
+
+template <typename T, typename U>
+static bool operator!=(PoolAllocator<T> const&, PoolAllocator<U> const&)
+{
+    return false;
+}
+
+typedef std::vector<Complex, PoolAllocator<Complex>> Signal;
+typedef std::vector<Float, PoolAllocator<Float>> RealSignal;
 
 static const Float eps = 0.01;
 static const Complex i(0, 1);
@@ -37,16 +261,13 @@ static size_t reverse_bits(size_t n, size_t max)
     return result;
 }
 
-static Signal operator-(Signal const& a, Signal const& b)
+// Complex product without the NaN/infinity recovery of std::complex's
+// operator*, which keeps the butterflies free of library calls.
+static inline Complex mult(Complex a, Complex b)
 {
-    assert(a.size() == b.size());
-    Signal result(a.size());
-
-    for (size_t i = 0; i != result.size(); ++i) {
-        result[i] = a[i] - b[i];
-    }
-
-    return result;
+    return Complex(
+            std::real(a)*std::real(b) - std::imag(a)*std::imag(b),
+            std::real(a)*std::imag(b) + std::imag(a)*std::real(b));
 }
 
 static Complex dot(Complex const& a, Complex const& b)
@@ -54,6 +275,7 @@ static Complex dot(Complex const& a, Complex const& b)
     return a*std::conj(b);
 }
 
+static Complex dot(Signal const& a, Signal const& b) __attribute__((unused));
 static Complex dot(Signal const& a, Signal const& b)
 {
     assert(a.size() == b.size());
@@ -73,7 +295,7 @@ static Signal dft(Signal const& signal)
         Complex c(0, 0);
 
         for (size_t n = 0; n != signal.size(); ++n) {
-            c += signal[n]*exp(-i*(Float) 2.0*(Float) M_PI*(Float) k*(Float) n/(Float) signal.size());
+            c += signal[n]*exp(-i*(Float) 2.0*(Float) M_PI*(Float) ((k*n) % signal.size())/(Float) signal.size());
         }
 
         result[k] = c;
@@ -90,7 +312,7 @@ static Signal idft(Signal const& spectrum)
         Complex c(0, 0);
 
         for (size_t k = 0; k != spectrum.size(); ++k) {
-            c += spectrum[k]*exp(i*(Float) 2.0*(Float) M_PI*(Float) k*(Float) n/(Float) spectrum.size());
+            c += spectrum[k]*exp(i*(Float) 2.0*(Float) M_PI*(Float) ((k*n) % spectrum.size())/(Float) spectrum.size());
         }
 
         result[n] = c/(Float) spectrum.size();
@@ -147,7 +369,7 @@ static void fft_step(Complex* spectrum, size_t transform_count, size_t sample_co
     }
 }
 
-static Signal fft(Signal const& signal)
+static Signal fft_radix2(Signal const& signal)
 {
     size_t const N = signal.size();
     Signal result(N);
@@ -180,7 +402,7 @@ static void ifft_step(Complex* spectrum, size_t spectrumSize)
     }
 }
 
-static Signal ifft(Signal const& spectrum)
+static Signal ifft_radix2(Signal const& spectrum)
 {
     size_t const N = spectrum.size();
     Signal result(N);
@@ -205,669 +427,7982 @@ static Signal ifft(Signal const& spectrum)
     return result;
 }
 
-// RMS of error signal.
-static Float error(Signal const& a, Signal const& b)
-{
-    auto e = a - b;
-    return sqrt(std::real(dot(e, e))/e.size());
-}
+// Radix-4 butterflies k < count over one block of 4L samples. The twiddles
+// for the block are split into real and imaginary arrays, each holding
+// W(k, 4L), W(2k, 4L) and W(3k, 4L) as three runs L values apart. The
+// sub-spectra of sample residues 0, 2, 1 and 3 (in the bit-reversed order they
+// are stored in) are combined into one spectrum of size 4L. Passing count < L
+// with data and twiddles offset by the same k runs a part of the block.
+typedef void (*Radix4Butterflies)(Complex* data, size_t L, size_t count, Float const* w_re, Float const* w_im, bool inverse);
 
-static Float prop_inverse_dft(Signal const& test_signal)
+static void radix4_butterflies_scalar(Complex* data, size_t L, size_t count, Float const* w_re, Float const* w_im, bool inverse)
 {
-    return error(test_signal, idft(dft(test_signal)));
+    Float const sign = inverse ? -1 : 1;
+
+    for (size_t k = 0; k != count; ++k) {
+        Complex w1(w_re[k], sign*w_im[k]);
+        Complex w2(w_re[L + k], sign*w_im[L + k]);
+        Complex w3(w_re[2*L + k], sign*w_im[2*L + k]);
+
+        Complex y0 = data[k];
+        Complex y2 = mult(data[k + L], w2);
+        Complex y1 = mult(data[k + 2*L], w1);
+        Complex y3 = mult(data[k + 3*L], w3);
+
+        Complex t0 = y0 + y2;
+        Complex t1 = y0 - y2;
+        Complex t2 = y1 + y3;
+        Complex d = y1 - y3;
+        // Multiply by -i for the forward transform and by i for the inverse.
+        Complex t3(sign*std::imag(d), -sign*std::real(d));
+
+        data[k] = t0 + t2;
+        data[k + L] = t1 + t3;
+        data[k + 2*L] = t0 - t2;
+        data[k + 3*L] = t1 - t3;
+    }
 }
 
-static Float prop_inverse_fft(Signal const& test_signal)
+#if defined(__x86_64__)
+
+// The vector kernels load interleaved Complex samples, split them into
+// separate real and imaginary registers, do the butterfly arithmetic on those
+// and interleave again on the way out. L must be a multiple of the number of
+// samples per register, and so must count.
+
+static inline void sse_load(float const* p, __m128& re, __m128& im)
 {
-    return error(test_signal, ifft(fft(test_signal)));
+    __m128 v0 = _mm_loadu_ps(p);
+    __m128 v1 = _mm_loadu_ps(p + 4);
+    re = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0));
+    im = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1));
 }
 
-static Float prop_dft_equal_fft(Signal const& test_signal)
+static inline void sse_store(float* p, __m128 re, __m128 im)
 {
-    return error(dft(test_signal), fft(test_signal));
+    _mm_storeu_ps(p, _mm_unpacklo_ps(re, im));
+    _mm_storeu_ps(p + 4, _mm_unpackhi_ps(re, im));
 }
 
-static Float prop_idft_equal_ifft(Signal const& test_signal)
+static inline void sse_mult(__m128 ar, __m128 ai, __m128 br, __m128 bi, __m128& re, __m128& im)
 {
-    return error(idft(test_signal), ifft(test_signal));
+    re = _mm_sub_ps(_mm_mul_ps(ar, br), _mm_mul_ps(ai, bi));
+    im = _mm_add_ps(_mm_mul_ps(ar, bi), _mm_mul_ps(ai, br));
 }
 
-static Float prop_fft_is_decomposed_dft(Signal const& test_signal)
+static void radix4_butterflies_sse(Complex* data, size_t L, size_t count, Float const* w_re, Float const* w_im, bool inverse)
 {
-    Signal even_samples;
-    Signal odd_samples;
-
-    // Partition even and odd samples.
-    for (size_t i = 0; i != test_signal.size()/2; ++i) {
-        even_samples.push_back(test_signal[2*i]);
-        odd_samples.push_back(test_signal[2*i + 1]);
+    float* x = reinterpret_cast<float*>(data);
+    __m128 const sign = _mm_set1_ps(inverse ? -1 : 1);
+
+    for (size_t k = 0; k != count; k += 4) {
+        __m128 y0r, y0i, a1r, a1i, a2r, a2i, a3r, a3i;
+        sse_load(x + 2*k, y0r, y0i);
+        sse_load(x + 2*(k + L), a1r, a1i);
+        sse_load(x + 2*(k + 2*L), a2r, a2i);
+        sse_load(x + 2*(k + 3*L), a3r, a3i);
+
+        __m128 y1r, y1i, y2r, y2i, y3r, y3i;
+        sse_mult(a2r, a2i, _mm_loadu_ps(w_re + k), _mm_mul_ps(sign, _mm_loadu_ps(w_im + k)), y1r, y1i);
+        sse_mult(a1r, a1i, _mm_loadu_ps(w_re + L + k), _mm_mul_ps(sign, _mm_loadu_ps(w_im + L + k)), y2r, y2i);
+        sse_mult(a3r, a3i, _mm_loadu_ps(w_re + 2*L + k), _mm_mul_ps(sign, _mm_loadu_ps(w_im + 2*L + k)), y3r, y3i);
+
+        __m128 t0r = _mm_add_ps(y0r, y2r), t0i = _mm_add_ps(y0i, y2i);
+        __m128 t1r = _mm_sub_ps(y0r, y2r), t1i = _mm_sub_ps(y0i, y2i);
+        __m128 t2r = _mm_add_ps(y1r, y3r), t2i = _mm_add_ps(y1i, y3i);
+        __m128 t3r = _mm_mul_ps(sign, _mm_sub_ps(y1i, y3i));
+        __m128 t3i = _mm_mul_ps(sign, _mm_sub_ps(y3r, y1r));
+
+        sse_store(x + 2*k, _mm_add_ps(t0r, t2r), _mm_add_ps(t0i, t2i));
+        sse_store(x + 2*(k + L), _mm_add_ps(t1r, t3r), _mm_add_ps(t1i, t3i));
+        sse_store(x + 2*(k + 2*L), _mm_sub_ps(t0r, t2r), _mm_sub_ps(t0i, t2i));
+        sse_store(x + 2*(k + 3*L), _mm_sub_ps(t1r, t3r), _mm_sub_ps(t1i, t3i));
     }
+}
 
-    Signal even_spectrum = dft(even_samples);
-    Signal odd_spectrum = dft(odd_samples);
-
-    Signal intermediate_spectrum;
-    intermediate_spectrum.insert(intermediate_spectrum.end(), even_spectrum.begin(), even_spectrum.end());
-    intermediate_spectrum.insert(intermediate_spectrum.end(), odd_spectrum.begin(), odd_spectrum.end());
-
-    fft_step_spectrum(&intermediate_spectrum[0], intermediate_spectrum.size());
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
 
-    return error(dft(test_signal), intermediate_spectrum);
+static inline void avx2_load(float const* p, __m256& re, __m256& im)
+{
+    __m256 v0 = _mm256_loadu_ps(p);
+    __m256 v1 = _mm256_loadu_ps(p + 8);
+    __m256 a = _mm256_permute2f128_ps(v0, v1, 0x20);
+    __m256 b = _mm256_permute2f128_ps(v0, v1, 0x31);
+    re = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    im = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
 }
 
-static bool prop_reverse_bits(size_t n, size_t max, size_t correct)
+static inline void avx2_store(float* p, __m256 re, __m256 im)
 {
-    return reverse_bits(n, max) == correct;
+    __m256 lo = _mm256_unpacklo_ps(re, im);
+    __m256 hi = _mm256_unpackhi_ps(re, im);
+    _mm256_storeu_ps(p, _mm256_permute2f128_ps(lo, hi, 0x20));
+    _mm256_storeu_ps(p + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
 }
 
-#define TEST_RESIDUE(signal) test_residue(#signal, signal)
+static inline void avx2_mult(__m256 ar, __m256 ai, __m256 br, __m256 bi, __m256& re, __m256& im)
+{
+    re = _mm256_fmsub_ps(ar, br, _mm256_mul_ps(ai, bi));
+    im = _mm256_fmadd_ps(ar, bi, _mm256_mul_ps(ai, br));
+}
 
-static void test_residue(const char* test_name, Float residue)
+static void radix4_butterflies_avx2(Complex* data, size_t L, size_t count, Float const* w_re, Float const* w_im, bool inverse)
 {
-    if (residue < eps) {
-        std::cout << test_name << ": PASS: residue=" << residue << std::endl;
-    }
-    else {
-        std::cout << test_name << ": FAIL: residue=" << residue << std::endl;
+    float* x = reinterpret_cast<float*>(data);
+    __m256 const sign = _mm256_set1_ps(inverse ? -1 : 1);
+
+    for (size_t k = 0; k != count; k += 8) {
+        __m256 y0r, y0i, a1r, a1i, a2r, a2i, a3r, a3i;
+        avx2_load(x + 2*k, y0r, y0i);
+        avx2_load(x + 2*(k + L), a1r, a1i);
+        avx2_load(x + 2*(k + 2*L), a2r, a2i);
+        avx2_load(x + 2*(k + 3*L), a3r, a3i);
+
+        __m256 y1r, y1i, y2r, y2i, y3r, y3i;
+        avx2_mult(a2r, a2i, _mm256_loadu_ps(w_re + k), _mm256_mul_ps(sign, _mm256_loadu_ps(w_im + k)), y1r, y1i);
+        avx2_mult(a1r, a1i, _mm256_loadu_ps(w_re + L + k), _mm256_mul_ps(sign, _mm256_loadu_ps(w_im + L + k)), y2r, y2i);
+        avx2_mult(a3r, a3i, _mm256_loadu_ps(w_re + 2*L + k), _mm256_mul_ps(sign, _mm256_loadu_ps(w_im + 2*L + k)), y3r, y3i);
+
+        __m256 t0r = _mm256_add_ps(y0r, y2r), t0i = _mm256_add_ps(y0i, y2i);
+        __m256 t1r = _mm256_sub_ps(y0r, y2r), t1i = _mm256_sub_ps(y0i, y2i);
+        __m256 t2r = _mm256_add_ps(y1r, y3r), t2i = _mm256_add_ps(y1i, y3i);
+        __m256 t3r = _mm256_mul_ps(sign, _mm256_sub_ps(y1i, y3i));
+        __m256 t3i = _mm256_mul_ps(sign, _mm256_sub_ps(y3r, y1r));
+
+        avx2_store(x + 2*k, _mm256_add_ps(t0r, t2r), _mm256_add_ps(t0i, t2i));
+        avx2_store(x + 2*(k + L), _mm256_add_ps(t1r, t3r), _mm256_add_ps(t1i, t3i));
+        avx2_store(x + 2*(k + 2*L), _mm256_sub_ps(t0r, t2r), _mm256_sub_ps(t0i, t2i));
+        avx2_store(x + 2*(k + 3*L), _mm256_sub_ps(t1r, t3r), _mm256_sub_ps(t1i, t3i));
     }
 }
 
-#define TEST(prop) test(#prop, prop)
+#pragma GCC pop_options
 
-static void test(const char* test_name, bool result)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+
+static inline void avx512_load(float const* p, __m512& re, __m512& im)
 {
-    if (result) {
-        std::cout << test_name << ": PASS" << std::endl;
-    }
-    else {
-        std::cout << test_name << ": FAIL" << std::endl;
-    }
+    __m512i const even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+    __m512i const odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+    __m512 v0 = _mm512_loadu_ps(p);
+    __m512 v1 = _mm512_loadu_ps(p + 16);
+    re = _mm512_permutex2var_ps(v0, even, v1);
+    im = _mm512_permutex2var_ps(v0, odd, v1);
 }
 
-static Signal random_signal(size_t size)
+static inline void avx512_store(float* p, __m512 re, __m512 im)
 {
-    static std::default_random_engine generator(0);
-    std::uniform_real_distribution<Float> distribution(0.0, 1.0);
+    __m512i const lo = _mm512_setr_epi32(0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23);
+    __m512i const hi = _mm512_setr_epi32(8, 24, 9, 25, 10, 26, 11, 27, 12, 28, 13, 29, 14, 30, 15, 31);
+    _mm512_storeu_ps(p, _mm512_permutex2var_ps(re, lo, im));
+    _mm512_storeu_ps(p + 16, _mm512_permutex2var_ps(re, hi, im));
+}
 
-    Signal result(size);
-    for (size_t i = 0; i != result.size(); ++i) {
-        result[i] = Complex(distribution(generator), distribution(generator));
-    }
-    return result;
+static inline void avx512_mult(__m512 ar, __m512 ai, __m512 br, __m512 bi, __m512& re, __m512& im)
+{
+    re = _mm512_fmsub_ps(ar, br, _mm512_mul_ps(ai, bi));
+    im = _mm512_fmadd_ps(ar, bi, _mm512_mul_ps(ai, br));
 }
 
-static void notify(char const* errinfo, void const* private_info, size_t cb, void* user_data) __attribute__((unused));
-static void notify(char const* errinfo, void const* private_info, size_t cb, void* user_data)
+static void radix4_butterflies_avx512(Complex* data, size_t L, size_t count, Float const* w_re, Float const* w_im, bool inverse)
 {
-    std::cout << "OpenCL error: " << errinfo << "\n";
+    float* x = reinterpret_cast<float*>(data);
+    __m512 const sign = _mm512_set1_ps(inverse ? -1 : 1);
+
+    for (size_t k = 0; k != count; k += 16) {
+        __m512 y0r, y0i, a1r, a1i, a2r, a2i, a3r, a3i;
+        avx512_load(x + 2*k, y0r, y0i);
+        avx512_load(x + 2*(k + L), a1r, a1i);
+        avx512_load(x + 2*(k + 2*L), a2r, a2i);
+        avx512_load(x + 2*(k + 3*L), a3r, a3i);
+
+        __m512 y1r, y1i, y2r, y2i, y3r, y3i;
+        avx512_mult(a2r, a2i, _mm512_loadu_ps(w_re + k), _mm512_mul_ps(sign, _mm512_loadu_ps(w_im + k)), y1r, y1i);
+        avx512_mult(a1r, a1i, _mm512_loadu_ps(w_re + L + k), _mm512_mul_ps(sign, _mm512_loadu_ps(w_im + L + k)), y2r, y2i);
+        avx512_mult(a3r, a3i, _mm512_loadu_ps(w_re + 2*L + k), _mm512_mul_ps(sign, _mm512_loadu_ps(w_im + 2*L + k)), y3r, y3i);
+
+        __m512 t0r = _mm512_add_ps(y0r, y2r), t0i = _mm512_add_ps(y0i, y2i);
+        __m512 t1r = _mm512_sub_ps(y0r, y2r), t1i = _mm512_sub_ps(y0i, y2i);
+        __m512 t2r = _mm512_add_ps(y1r, y3r), t2i = _mm512_add_ps(y1i, y3i);
+        __m512 t3r = _mm512_mul_ps(sign, _mm512_sub_ps(y1i, y3i));
+        __m512 t3i = _mm512_mul_ps(sign, _mm512_sub_ps(y3r, y1r));
+
+        avx512_store(x + 2*k, _mm512_add_ps(t0r, t2r), _mm512_add_ps(t0i, t2i));
+        avx512_store(x + 2*(k + L), _mm512_add_ps(t1r, t3r), _mm512_add_ps(t1i, t3i));
+        avx512_store(x + 2*(k + 2*L), _mm512_sub_ps(t0r, t2r), _mm512_sub_ps(t0i, t2i));
+        avx512_store(x + 2*(k + 3*L), _mm512_sub_ps(t1r, t3r), _mm512_sub_ps(t1i, t3i));
+    }
 }
 
-static void fatal(std::string const& msg) __attribute__((noreturn));
-static void fatal(std::string const& msg)
+#pragma GCC pop_options
+
+#endif
+
+struct Radix4Kernel
 {
-    std::cout << "ERROR: " << msg << "\n";
-    abort();
+    char const* name;
+    size_t width; // Samples per iteration; L must be a multiple of it.
+    Radix4Butterflies butterflies;
+};
+
+// Kernels the running CPU supports, from narrowest to widest. The choice is
+// made by CPUID at run time so one binary runs on every x86-64 host.
+static std::vector<Radix4Kernel> const& radix4_kernels()
+{
+    static std::vector<Radix4Kernel> const kernels = [] {
+        std::vector<Radix4Kernel> result;
+        result.push_back(Radix4Kernel{"scalar", 1, radix4_butterflies_scalar});
+#if defined(__x86_64__)
+        result.push_back(Radix4Kernel{"sse", 4, radix4_butterflies_sse});
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            result.push_back(Radix4Kernel{"avx2", 8, radix4_butterflies_avx2});
+        }
+        if (__builtin_cpu_supports("avx512f")) {
+            result.push_back(Radix4Kernel{"avx512", 16, radix4_butterflies_avx512});
+        }
+#endif
+        return result;
+    }();
+
+    return kernels;
 }
 
-static std::string error_code_to_string(cl_int ec) __attribute__((unused));
-static std::string error_code_to_string(cl_int ec)
+// Widest supported kernel, unless FOURIER_SIMD names a narrower one.
+static Radix4Kernel const& best_radix4_kernel()
 {
-    switch (ec) {
-        case CL_INVALID_COMMAND_QUEUE: return "CL_INVALID_COMMAND_QUEUE";
-        case CL_INVALID_CONTEXT: return "CL_INVALID_CONTEXT";
-        case CL_INVALID_DEVICE: return "CL_INVALID_DEVICE";
-        case CL_INVALID_EVENT_WAIT_LIST: return "CL_INVALID_EVENT_WAIT_LIST";
-        case CL_INVALID_GLOBAL_OFFSET: return "CL_INVALID_GLOBAL_OFFSET";
-        case CL_INVALID_GLOBAL_WORK_SIZE: return "CL_INVALID_GLOBAL_WORK_SIZE";
-        case CL_INVALID_IMAGE_SIZE: return "CL_INVALID_IMAGE_SIZE";
-        case CL_INVALID_KERNEL_ARGS: return "CL_INVALID_KERNEL_ARGS";
-        case CL_INVALID_KERNEL: return "CL_INVALID_KERNEL";
-        case CL_INVALID_PROGRAM_EXECUTABLE: return "CL_INVALID_PROGRAM_EXECUTABLE";
-        case CL_INVALID_VALUE: return "CL_INVALID_VALUE";
-        case CL_INVALID_WORK_DIMENSION: return "CL_INVALID_WORK_DIMENSION";
-        case CL_INVALID_WORK_GROUP_SIZE: return "CL_INVALID_WORK_GROUP_SIZE";
-        case CL_INVALID_WORK_ITEM_SIZE: return "CL_INVALID_WORK_ITEM_SIZE";
-        case CL_MEM_OBJECT_ALLOCATION_FAILURE: return "CL_MEM_OBJECT_ALLOCATION_FAILURE";
-        case CL_MISALIGNED_SUB_BUFFER_OFFSET: return "CL_MISALIGNED_SUB_BUFFER_OFFSET";
-        case CL_OUT_OF_HOST_MEMORY: return "CL_OUT_OF_HOST_MEMORY";
-        case CL_OUT_OF_RESOURCES: return "CL_OUT_OF_RESOURCES";
-        case CL_SUCCESS: return "CL_SUCCESS";
-        default: return "<UNKNOWN>";
+    std::vector<Radix4Kernel> const& kernels = radix4_kernels();
+
+    char const* requested = getenv("FOURIER_SIMD");
+    if (requested) {
+        for (auto& kernel : kernels) {
+            if (std::string(kernel.name) == requested) return kernel;
+        }
     }
+
+    return kernels.back();
 }
 
-static std::map<cl_platform_id, std::pair<std::string, std::string>> get_platforms()
+// Fixed set of worker threads that share the iterations of a loop with the
+// calling thread. thread_count includes the caller, so a pool of one thread
+// runs everything inline.
+class ThreadPool : private boost::noncopyable
 {
-    std::map<cl_platform_id, std::pair<std::string, std::string>> result;
-
-    std::vector<cl_platform_id> platforms(16);
-    cl_uint platform_count;
-    if (clGetPlatformIDs(platforms.size(), &platforms[0], &platform_count) != CL_SUCCESS) {
-        fatal("Could not get platform IDs.");
+public:
+    explicit ThreadPool(size_t thread_count)
+        : m_job(NULL)
+        , m_job_size(0)
+        , m_next(0)
+        , m_busy(0)
+        , m_generation(0)
+        , m_stop(false)
+    {
+        for (size_t t = 1; t < thread_count; ++t) {
+            m_threads.push_back(std::thread([this] { work(); }));
+        }
     }
-    platforms.resize(platform_count);
 
-    for (auto& platform_id : platforms) {
-        std::vector<char> platformName(64);
-        if (clGetPlatformInfo(
-                    platform_id,
-                    CL_PLATFORM_NAME,
-                    platformName.size(),
-                    &platformName[0],
-                    NULL) != CL_SUCCESS) {
-            fatal("Could not get platform name.");
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
         }
+        m_wake.notify_all();
 
-        std::vector<char> platformVersion(64);
-        if (clGetPlatformInfo(
-                    platform_id,
-                    CL_PLATFORM_VERSION,
-                    platformVersion.size(),
-                    &platformVersion[0],
-                    NULL) != CL_SUCCESS) {
-            fatal("Could not get platform version.");
+        for (auto& thread : m_threads) {
+            thread.join();
         }
+    }
 
-        result[platform_id] = std::make_pair(&platformName[0], &platformVersion[0]);
+    size_t thread_count() const
+    {
+        return m_threads.size() + 1;
     }
 
-    return result;
-}
+    // Calls fn(i) for every i < count and returns when all calls are done.
+    // Calls from several threads are serialised; fn must not call back into
+    // the same pool.
+    void parallel_for(size_t count, std::function<void(size_t)> const& fn)
+    {
+        if (m_threads.empty() || count <= 1) {
+            for (size_t i = 0; i != count; ++i) {
+                fn(i);
+            }
+            return;
+        }
 
-static std::map<cl_device_id, std::string> get_devices(cl_platform_id platform)
-{
-    std::map<cl_device_id, std::string> result;
+        std::lock_guard<std::mutex> call_lock(m_call_mutex);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = &fn;
+            m_job_size = count;
+            m_next = 0;
+            m_busy = m_threads.size();
+            ++m_generation;
+        }
+        m_wake.notify_all();
 
-    std::vector<cl_device_id> devices(16);
-    cl_uint device_count;
-    if (clGetDeviceIDs(
-                platform,
-                CL_DEVICE_TYPE_ALL,
-                devices.size(),
-                &devices[0],
-                &device_count) != CL_SUCCESS) {
-        fatal("Could not get device IDs.");
+        run_job(fn, count);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this] { return m_busy == 0; });
+        m_job = NULL;
     }
-    devices.resize(device_count);
 
-    for (auto& device_id : devices) {
-        std::vector<char> name(64);
-        if (clGetDeviceInfo(
-                device_id,
-                CL_DEVICE_NAME,
-                name.size(),
-                &name[0],
-                NULL) != CL_SUCCESS) {
-            fatal("Could not get device name.");
+private:
+    void run_job(std::function<void(size_t)> const& fn, size_t count)
+    {
+        for (size_t i = m_next++; i < count; i = m_next++) {
+            fn(i);
         }
+    }
 
-        result[device_id] = &name[0];
+    void work()
+    {
+        size_t generation = 0;
+
+        while (true) {
+            std::function<void(size_t)> const* job;
+            size_t job_size;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [&] { return m_stop || m_generation != generation; });
+                if (m_stop) return;
+                generation = m_generation;
+                job = m_job;
+                job_size = m_job_size;
+            }
+
+            run_job(*job, job_size);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (--m_busy == 0) m_done.notify_one();
+        }
     }
 
-    return result;
+    std::vector<std::thread> m_threads;
+    std::mutex m_call_mutex;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::function<void(size_t)> const* m_job;
+    size_t m_job_size;
+    std::atomic<size_t> m_next;
+    size_t m_busy;
+    size_t m_generation;
+    bool m_stop;
+};
+
+// Pool shared by the convenience transforms, sized by FOURIER_THREADS or the
+// number of hardware threads.
+static ThreadPool& default_thread_pool()
+{
+    static ThreadPool pool([] {
+        char const* threads = getenv("FOURIER_THREADS");
+        if (threads && atoi(threads) > 0) return (size_t) atoi(threads);
+        return (size_t) std::max(1u, std::thread::hardware_concurrency());
+    }());
+
+    return pool;
 }
 
-static void print_platforms()
+// Taylor series of sin(x) and cos(x) from the given term on, for
+// |x| <= pi, where 30 terms are exact in double precision. constexpr, so
+// that the codelets' twiddles are constants.
+static constexpr double constexpr_sin(double x, double term = 0, int n = -1)
 {
-    for (auto& platform : get_platforms()) {
-        std::cout
-            << platform.first
-            << ": name='" << platform.second.first
-            << "', version='" << platform.second.second
-            << "'\n";
-
-        for (auto& device : get_devices(platform.first)) {
-            std::cout
-                << "  "
-                << device.first
-                << ": name='" << device.second
-                << "'\n";
-        }
-    }
+    return n == -1 ? constexpr_sin(x, x, 0)
+        : n == 30 ? 0
+        : term + constexpr_sin(x, -term*x*x/((2*n + 2)*(2*n + 3)), n + 1);
 }
 
-static cl_platform_id get_platform(std::string const& name)
+static constexpr double constexpr_cos(double x, double term = 0, int n = -1)
 {
-    for (auto& platform : get_platforms()) {
-        if (platform.second.first == name) return platform.first;
-    }
-
-    fatal("Could not find platform.");
+    return n == -1 ? constexpr_cos(x, 1, 0)
+        : n == 30 ? 0
+        : term + constexpr_cos(x, -term*x*x/((2*n + 1)*(2*n + 2)), n + 1);
 }
 
-static cl_device_id get_device(cl_platform_id platform, std::string const& name)
-{
-    for (auto& device : get_devices(platform)) {
-        if (device.second == name) return device.first;
-    }
+// Four lanes of GCC's generic vector extension: SSE on x86-64, and scalar
+// code on targets without a vector unit. Int4 holds shuffle masks.
+typedef Float Float4 __attribute__((vector_size(4*sizeof(Float))));
+typedef int32_t Int4 __attribute__((vector_size(4*sizeof(int32_t))));
 
-    fatal("Could not find device.");
+// The angle of W(k, N) reduced into [-pi, pi], where the series above are
+// exact; the codelets ask for k up to about 3N/4.
+static constexpr double twiddle_angle(size_t k, size_t N)
+{
+    return 2*(k % N) <= N
+        ? 2*M_PI*(double) (k % N)/N
+        : -2*M_PI*(double) (N - k % N)/N;
 }
 
-static std::vector<char> read_program(std::string const& name)
+// W(k, N), or its conjugate when sign is -1, as constants.
+static constexpr Float twiddle_re(size_t k, size_t N)
 {
-    std::fstream f(name);
-    if (!f) {
-        fatal("Could not read file: " + name);
-    }
+    return (Float) constexpr_cos(twiddle_angle(k, N));
+}
 
-    f.seekg(0, std::ios_base::end);
-    size_t size = f.tellg();
-    f.seekg(0, std::ios_base::beg);
+static constexpr Float twiddle_im(size_t k, size_t N, int sign)
+{
+    return (Float) (-sign*constexpr_sin(twiddle_angle(k, N)));
+}
 
-    std::vector<char> result(size);
+static constexpr size_t constexpr_reverse_bits(size_t n, size_t max, size_t result = 0)
+{
+    return max <= 1 ? result : constexpr_reverse_bits(n >> 1, max >> 1, (result << 1) | (n & 1));
+}
 
-    f.read(&result[0], result.size());
-    result.push_back(0);
-    return result;
+// Samples p[0] to p[3], split into real and imaginary parts.
+static inline __attribute__((always_inline)) void load_split(Complex const* p, Float4& re, Float4& im)
+{
+    Float4 v0;
+    Float4 v1;
+    std::memcpy(&v0, p, sizeof(v0));
+    std::memcpy(&v1, p + 2, sizeof(v1));
+    re = __builtin_shuffle(v0, v1, Int4{0, 2, 4, 6});
+    im = __builtin_shuffle(v0, v1, Int4{1, 3, 5, 7});
 }
 
-void convert(cl_float2* dst, Complex const* src, size_t count)
+static inline __attribute__((always_inline)) void store_interleaved(Complex* p, Float4 re, Float4 im)
 {
-    for (size_t i = 0; i != count; ++i) {
-        dst[i].s[0] = std::real(src[i]);
-        dst[i].s[1] = std::imag(src[i]);
-    }
+    Float4 lo = __builtin_shuffle(re, im, Int4{0, 4, 1, 5});
+    Float4 hi = __builtin_shuffle(re, im, Int4{2, 6, 3, 7});
+    std::memcpy((void*) p, &lo, sizeof(lo));
+    std::memcpy((void*) (p + 2), &hi, sizeof(hi));
 }
 
-void convert(Complex* dst, cl_float2 const* src, size_t count)
+// Transposes the 4 x 4 matrix whose rows are v[0] to v[3].
+static inline __attribute__((always_inline)) void transpose4(Float4* v)
 {
-    for (size_t i = 0; i != count; ++i) {
-        dst[i] = Complex(src[i].s[0], src[i].s[1]);
-    }
+    Float4 t0 = __builtin_shuffle(v[0], v[1], Int4{0, 4, 1, 5});
+    Float4 t1 = __builtin_shuffle(v[0], v[1], Int4{2, 6, 3, 7});
+    Float4 t2 = __builtin_shuffle(v[2], v[3], Int4{0, 4, 1, 5});
+    Float4 t3 = __builtin_shuffle(v[2], v[3], Int4{2, 6, 3, 7});
+    v[0] = __builtin_shuffle(t0, t2, Int4{0, 1, 4, 5});
+    v[1] = __builtin_shuffle(t0, t2, Int4{2, 3, 6, 7});
+    v[2] = __builtin_shuffle(t1, t3, Int4{0, 1, 4, 5});
+    v[3] = __builtin_shuffle(t1, t3, Int4{2, 3, 6, 7});
 }
 
-void convert(Complex* dst, std::vector<cl_float2> const& src)
+// 4-point transforms lane by lane: sample l of lane j is in v[l], and bin b
+// goes to v[b].
+template <int Sign>
+static inline __attribute__((always_inline)) void dft4(Float4* re, Float4* im)
 {
-    convert(dst, &src[0], src.size());
+    Float4 t0_re = re[0] + re[2];
+    Float4 t0_im = im[0] + im[2];
+    Float4 t1_re = re[0] - re[2];
+    Float4 t1_im = im[0] - im[2];
+    Float4 t2_re = re[1] + re[3];
+    Float4 t2_im = im[1] + im[3];
+    // (re[1] - re[3]) times -i for the forward transform and i for the inverse.
+    Float4 t3_re = (Float) Sign*(im[1] - im[3]);
+    Float4 t3_im = (Float) -Sign*(re[1] - re[3]);
+
+    re[0] = t0_re + t2_re;
+    im[0] = t0_im + t2_im;
+    re[1] = t1_re + t3_re;
+    im[1] = t1_im + t3_im;
+    re[2] = t0_re - t2_re;
+    im[2] = t0_im - t2_im;
+    re[3] = t1_re - t3_re;
+    im[3] = t1_im - t3_im;
 }
 
-std::vector<cl_float2> to_float2_vector(Complex const* vec, size_t count)
+// Butterflies K to K + Count - 1 of the radix-2 pass that combines the two
+// halves of a codelet's samples into a spectrum of N, four at a time. The
+// samples are split into vectors of four real and four imaginary parts, and
+// the twiddles are constant vectors.
+template <size_t N, size_t K, size_t Count, int Sign>
+struct CodeletButterflies
 {
-    std::vector<cl_float2> result(count);
+    static inline __attribute__((always_inline)) void run(Float4* re, Float4* im)
+    {
+        constexpr Float4 w_re = {
+            twiddle_re(K, N), twiddle_re(K + 1, N), twiddle_re(K + 2, N), twiddle_re(K + 3, N)};
+        constexpr Float4 w_im = {
+            twiddle_im(K, N, Sign), twiddle_im(K + 1, N, Sign), twiddle_im(K + 2, N, Sign), twiddle_im(K + 3, N, Sign)};
+
+        Float4 even_re = re[K/4];
+        Float4 even_im = im[K/4];
+        Float4 odd_re = re[(K + N/2)/4]*w_re - im[(K + N/2)/4]*w_im;
+        Float4 odd_im = re[(K + N/2)/4]*w_im + im[(K + N/2)/4]*w_re;
+        re[K/4] = even_re + odd_re;
+        im[K/4] = even_im + odd_im;
+        re[(K + N/2)/4] = even_re - odd_re;
+        im[(K + N/2)/4] = even_im - odd_im;
+
+        CodeletButterflies<N, K + 4, Count - 4, Sign>::run(re, im);
+    }
+};
 
-    convert(&result[0], vec, count);
+template <size_t N, size_t K, int Sign>
+struct CodeletButterflies<N, K, 0, Sign>
+{
+    static inline __attribute__((always_inline)) void run(Float4*, Float4*)
+    {
+    }
+};
 
-    return result;
-}
+// Straight-line radix-2 decimation in time of N = 4 or 8 samples into re
+// and im: out = the transform of in[0], in[S], ..., in[(N - 1)*S]. The
+// recursion picks the samples at compile time, so no permutation is left
+// for run time.
+template <size_t N, size_t S, int Sign>
+struct DitCodelet
+{
+    static inline __attribute__((always_inline)) void run(Float4* re, Float4* im, Complex const* in)
+    {
+        DitCodelet<N/2, 2*S, Sign>::run(re, im, in);
+        DitCodelet<N/2, 2*S, Sign>::run(re + N/8, im + N/8, in + S);
+        CodeletButterflies<N, 0, N/2, Sign>::run(re, im);
+    }
+};
 
-std::vector<cl_float2> to_float2_vector(std::vector<Complex> const& vec)
+// The 4-point leaves, whose twiddles are 1 and -i, as scalars gathered into
+// one vector each of real and imaginary parts.
+template <size_t S, int Sign>
+struct DitCodelet<4, S, Sign>
 {
-    return to_float2_vector(&vec[0], vec.size());
-}
+    static inline __attribute__((always_inline)) void run(Float4* re, Float4* im, Complex const* in)
+    {
+        Complex a0 = in[0];
+        Complex a1 = in[S];
+        Complex a2 = in[2*S];
+        Complex a3 = in[3*S];
+
+        Complex t0 = a0 + a2;
+        Complex t1 = a0 - a2;
+        Complex t2 = a1 + a3;
+        Complex d = a1 - a3;
+        // Multiply by -i for the forward transform and by i for the inverse.
+        Complex t3(Sign*std::imag(d), -Sign*std::real(d));
+
+        Complex y0 = t0 + t2;
+        Complex y1 = t1 + t3;
+        Complex y2 = t0 - t2;
+        Complex y3 = t1 - t3;
+        re[0] = Float4{std::real(y0), std::real(y1), std::real(y2), std::real(y3)};
+        im[0] = Float4{std::imag(y0), std::imag(y1), std::imag(y2), std::imag(y3)};
+    }
+};
 
-class Fourier : private boost::noncopyable
+// Butterflies K to K + Count - 1 of a radix-2 pass over N samples that are
+// whole vectors, so that every lane runs its own transform.
+template <size_t N, size_t K, size_t Count, int Sign>
+struct LaneButterflies
 {
-public:
-    explicit Fourier(size_t sample_power)
-        : m_sample_power(sample_power)
+    static inline __attribute__((always_inline)) void run(Float4* re, Float4* im)
     {
-        print_platforms();
+        constexpr Float w_re = twiddle_re(K, N);
+        constexpr Float w_im = twiddle_im(K, N, Sign);
+
+        Float4 odd_re = re[K + N/2];
+        Float4 odd_im = im[K + N/2];
+        if (4*K == N) {
+            odd_re = (Float) Sign*im[K + N/2];
+            odd_im = (Float) -Sign*re[K + N/2];
+        }
+        else if (K != 0) {
+            odd_re = re[K + N/2]*w_re - im[K + N/2]*w_im;
+            odd_im = re[K + N/2]*w_im + im[K + N/2]*w_re;
+        }
+        Float4 even_re = re[K];
+        Float4 even_im = im[K];
+        re[K] = even_re + odd_re;
+        im[K] = even_im + odd_im;
+        re[K + N/2] = even_re - odd_re;
+        im[K + N/2] = even_im - odd_im;
+
+        LaneButterflies<N, K + 1, Count - 1, Sign>::run(re, im);
+    }
+};
 
-        cl_platform_id platform = get_platform("NVIDIA CUDA");
-        cl_device_id device = get_device(platform, "GeForce GTX 970");
+template <size_t N, size_t K, int Sign>
+struct LaneButterflies<N, K, 0, Sign>
+{
+    static inline __attribute__((always_inline)) void run(Float4*, Float4*)
+    {
+    }
+};
 
-        cl_context_properties properties[] = { CL_CONTEXT_PLATFORM, (cl_context_properties) platform, 0 };
-        m_context = clCreateContext(properties, 1, &device, notify, NULL, NULL);
-        if (0 == m_context) fatal("Could not create contex.");
+// Radix-2 decimation in time of N vectors, lane by lane, from in into out.
+// Sample n is in[n*S], or, when BitReversed, sample n of a contiguous block
+// already in bit-reversed order, which out may equal.
+template <size_t N, size_t S, bool BitReversed, int Sign>
+struct LaneDit
+{
+    static inline __attribute__((always_inline)) void run(Float4* re, Float4* im, Float4 const* in_re, Float4 const* in_im)
+    {
+        size_t const second = BitReversed ? N/2 : S;
+        LaneDit<N/2, 2*S, BitReversed, Sign>::run(re, im, in_re, in_im);
+        LaneDit<N/2, 2*S, BitReversed, Sign>::run(re + N/2, im + N/2, in_re + second, in_im + second);
+        LaneButterflies<N, 0, N/2, Sign>::run(re, im);
+    }
+};
 
-        m_queue = clCreateCommandQueue(m_context, device, 0, NULL);
-        if (0 == m_queue) fatal("Could not create command queue.");
+template <size_t S, bool BitReversed, int Sign>
+struct LaneDit<1, S, BitReversed, Sign>
+{
+    static inline __attribute__((always_inline)) void run(Float4* re, Float4* im, Float4 const* in_re, Float4 const* in_im)
+    {
+        re[0] = in_re[0];
+        im[0] = in_im[0];
+    }
+};
 
-        std::vector<std::vector<char>> sources;
-        sources.push_back(read_program("fourier.cl"));
+// Multiplies lane j of vectors Q to Q + Count - 1 by W(m*j, N), where m is
+// the vector's index, or that index bit-reversed among the N/4 vectors when
+// BitReversed.
+template <size_t N, size_t Q, size_t Count, bool BitReversed, int Sign>
+struct LaneTwiddles
+{
+    static inline __attribute__((always_inline)) void run(Float4* re, Float4* im)
+    {
+        constexpr size_t m = BitReversed ? constexpr_reverse_bits(Q, N/4) : Q;
+        constexpr Float4 w_re = {
+            twiddle_re(0, N), twiddle_re(m, N), twiddle_re(2*m, N), twiddle_re(3*m, N)};
+        constexpr Float4 w_im = {
+            twiddle_im(0, N, Sign), twiddle_im(m, N, Sign), twiddle_im(2*m, N, Sign), twiddle_im(3*m, N, Sign)};
 
-        std::vector<char const*> sources_raw;
-        for (auto& source : sources) {
-            sources_raw.push_back(&source[0]);
-        }
+        Float4 x_re = re[Q];
+        re[Q] = x_re*w_re - im[Q]*w_im;
+        im[Q] = x_re*w_im + im[Q]*w_re;
 
-        m_program = clCreateProgramWithSource(
-                m_context,
-                sources_raw.size(),
-                &sources_raw[0],
-                NULL,
-                NULL);
-        if (m_program == NULL) fatal("Could not create program.");
+        LaneTwiddles<N, Q + 1, Count - 1, BitReversed, Sign>::run(re, im);
+    }
+};
 
-        if (clBuildProgram(
-                    m_program,
-                    1,
-                    &device,
-                    "",
-                    NULL,
-                    NULL) != CL_SUCCESS) {
-            std::vector<char> build_log(1024);
-            size_t build_log_size;
-            if (clGetProgramBuildInfo(
-                        m_program,
-                        device,
-                        CL_PROGRAM_BUILD_LOG,
-                        build_log.size(),
-                        &build_log[0],
-                        &build_log_size)
-                    != CL_SUCCESS) {
-                fatal("Could not get program build info.");
-            }
-            build_log.resize(build_log_size);
+template <size_t N, size_t Q, bool BitReversed, int Sign>
+struct LaneTwiddles<N, Q, 0, BitReversed, Sign>
+{
+    static inline __attribute__((always_inline)) void run(Float4*, Float4*)
+    {
+    }
+};
 
-            std::cout << &build_log[0];
+// Transform of N = 4M samples, 16 <= N <= 64, as four transforms of M
+// samples side by side in the lanes. Sample 4m + j goes to lane j of vector
+// m, so loads are contiguous; the lanes run M-point transforms, a twiddle
+// per lane and vector follows, and 4 x 4 transposes bring the lanes
+// together for the last 4-point transforms, whose bins k and k + M*b land
+// four at a time in contiguous stores.
+template <size_t N, int Sign>
+static inline __attribute__((always_inline)) void four_step_codelet(Complex* dst, Complex const* src, Float scale)
+{
+    size_t const M = N/4;
+    Float4 x_re[M];
+    Float4 x_im[M];
+    for (size_t m = 0; m != M; ++m) {
+        load_split(src + 4*m, x_re[m], x_im[m]);
+    }
 
-            fatal("Could not build program.");
+    Float4 re[M];
+    Float4 im[M];
+    LaneDit<M, 1, false, Sign>::run(re, im, x_re, x_im);
+    LaneTwiddles<N, 0, M, false, Sign>::run(re, im);
+
+    for (size_t k = 0; k != M; k += 4) {
+        transpose4(&re[k]);
+        transpose4(&im[k]);
+        dft4<Sign>(&re[k], &im[k]);
+        for (size_t b = 0; b != 4; ++b) {
+            store_interleaved(dst + k + M*b, scale*re[k + b], scale*im[k + b]);
         }
+    }
+}
 
-        m_init_kernel = clCreateKernel(m_program, "fft_init", NULL);
-        if (m_init_kernel == NULL) fatal("Could not create init kernel.");
+// four_step_codelet() in place on samples in bit-reversed order: vector q
+// of contiguous samples holds samples rev(q) + M*rev(j) in lane j, so the
+// 4-point transforms come first, between transposes, with the middle lanes
+// swapped, and the M-point transforms take their vectors in bit-reversed
+// order. Bin 4a + b ends in lane b of vector a. Unscaled.
+template <size_t N, int Sign>
+static inline __attribute__((always_inline)) void four_step_leaf_codelet(Complex* data)
+{
+    size_t const M = N/4;
+    Float4 re[M];
+    Float4 im[M];
+    for (size_t q = 0; q != M; q += 4) {
+        for (size_t r = 0; r != 4; ++r) {
+            load_split(data + 4*(q + r), re[q + r], im[q + r]);
+        }
+        transpose4(&re[q]);
+        transpose4(&im[q]);
+        std::swap(re[q + 1], re[q + 2]);
+        std::swap(im[q + 1], im[q + 2]);
+        dft4<Sign>(&re[q], &im[q]);
+        transpose4(&re[q]);
+        transpose4(&im[q]);
+    }
 
-        m_step_kernel = clCreateKernel(m_program, "fft_step", NULL);
-        if (m_step_kernel == NULL) fatal("Could not create step kernel.");
+    LaneTwiddles<N, 0, M, true, Sign>::run(re, im);
+    LaneDit<M, 1, true, Sign>::run(re, im, re, im);
 
-        m_x_mem = clCreateBuffer(
-                m_context,
-                CL_MEM_READ_ONLY,
-                byte_count(),
-                NULL,
-                NULL);
-        if (m_x_mem == NULL) fatal("Could not create X buffer.");
+    for (size_t a = 0; a != M; ++a) {
+        store_interleaved(data + 4*a, re[a], im[a]);
+    }
+}
 
-        m_y1_mem = clCreateBuffer(
-                m_context,
-                CL_MEM_WRITE_ONLY,
-                byte_count(),
-                NULL,
-                NULL);
-        if (m_y1_mem == NULL) fatal("Could not create Y1 buffer.");
+// Largest transform with a codelet.
+static size_t const max_codelet_size = 64;
 
-        m_y2_mem = clCreateBuffer(
-                m_context,
-                CL_MEM_WRITE_ONLY,
-                byte_count(),
-                NULL,
-                NULL);
-        if (m_y2_mem == NULL) fatal("Could not create Y2 buffer.");
+typedef void (*Codelet)(Complex* dst, Complex const* src);
+typedef void (*LeafCodelet)(Complex* data);
+
+// Forward transform of N = 4 or 8 samples. spectrum may equal signal.
+template <size_t N>
+static void fft_small_codelet(Complex* spectrum, Complex const* signal)
+{
+    Float4 re[N/4];
+    Float4 im[N/4];
+    DitCodelet<N, 1, 1>::run(re, im, signal);
+    for (size_t k = 0; k != N/4; ++k) {
+        store_interleaved(spectrum + 4*k, re[k], im[k]);
     }
+}
 
-    ~Fourier()
-    {
-        if (clReleaseMemObject(m_y2_mem) != CL_SUCCESS) fatal("Could not release Y2 buffer.");
-        if (clReleaseMemObject(m_y1_mem) != CL_SUCCESS) fatal("Could not release Y1 buffer.");
-        if (clReleaseMemObject(m_x_mem) != CL_SUCCESS) fatal("Could not release X buffer.");
-        if (clReleaseKernel(m_step_kernel) != CL_SUCCESS) fatal("Could not release step kernel.");
-        if (clReleaseKernel(m_init_kernel) != CL_SUCCESS) fatal("Could not release init kernel.");
-        if (clReleaseProgram(m_program) != CL_SUCCESS) fatal("Could not release program");
-        if (clUnloadCompiler() != CL_SUCCESS) fatal("Could not unload compiler.");
-        if (clReleaseCommandQueue(m_queue) != CL_SUCCESS) fatal("Could not release command queue.");
-        if (clReleaseContext(m_context) != CL_SUCCESS) fatal("Could not release context.");
+// Inverse transform of N = 4 or 8 samples, scaled by 1/N. signal may equal
+// spectrum.
+template <size_t N>
+static void ifft_small_codelet(Complex* signal, Complex const* spectrum)
+{
+    Float4 re[N/4];
+    Float4 im[N/4];
+    DitCodelet<N, 1, -1>::run(re, im, spectrum);
+    for (size_t k = 0; k != N/4; ++k) {
+        store_interleaved(signal + 4*k, (Float) (1.0/N)*re[k], (Float) (1.0/N)*im[k]);
     }
+}
 
-    void init(cl_mem x, cl_uint sample_power, cl_mem y)
-    {
-        set_arg(m_init_kernel, 0, x);
-        set_arg(m_init_kernel, 1, sample_power);
-        set_arg(m_init_kernel, 2, y);
+// Forward transform of N samples, 16 <= N <= 64. spectrum may equal signal.
+template <size_t N>
+static void fft_codelet(Complex* spectrum, Complex const* signal)
+{
+    four_step_codelet<N, 1>(spectrum, signal, 1);
+}
 
-        run_kernel(m_init_kernel);
-    }
+// Inverse transform of N samples, 16 <= N <= 64, scaled by 1/N. signal may
+// equal spectrum.
+template <size_t N>
+static void ifft_codelet(Complex* signal, Complex const* spectrum)
+{
+    four_step_codelet<N, -1>(signal, spectrum, (Float) 1.0/N);
+}
 
-    void init(Complex* dst, Complex const* src)
-    {
-        std::vector<cl_float2> x_buffer = to_float2_vector(src, sample_count());
+// Forward transform in place of N samples in bit-reversed order, 16 <= N <=
+// 64.
+template <size_t N>
+static void fft_leaf_codelet(Complex* data)
+{
+    four_step_leaf_codelet<N, 1>(data);
+}
 
-        load(m_x_mem, x_buffer);
+// The same for the inverse transform, unscaled.
+template <size_t N>
+static void ifft_leaf_codelet(Complex* data)
+{
+    four_step_leaf_codelet<N, -1>(data);
+}
 
-        init(m_x_mem, m_sample_power, m_y1_mem);
+static void fft1_codelet(Complex* spectrum, Complex const* signal)
+{
+    spectrum[0] = signal[0];
+}
 
-        std::vector<cl_float2> y1_buffer(sample_count());
-        store(&y1_buffer[0], m_y1_mem);
+static void fft2_codelet(Complex* spectrum, Complex const* signal)
+{
+    Complex even = signal[0];
+    Complex odd = signal[1];
+    spectrum[0] = even + odd;
+    spectrum[1] = even - odd;
+}
 
-        finish();
+static void ifft2_codelet(Complex* signal, Complex const* spectrum)
+{
+    Complex even = spectrum[0];
+    Complex odd = spectrum[1];
+    signal[0] = (Float) 0.5*(even + odd);
+    signal[1] = (Float) 0.5*(even - odd);
+}
 
-        convert(dst, y1_buffer);
+// The codelet for a power of two N <= max_codelet_size.
+static Codelet codelet(size_t N, bool inverse)
+{
+    switch (N) {
+    case 1: return fft1_codelet;
+    case 2: return inverse ? ifft2_codelet : fft2_codelet;
+    case 4: return inverse ? ifft_small_codelet<4> : fft_small_codelet<4>;
+    case 8: return inverse ? ifft_small_codelet<8> : fft_small_codelet<8>;
+    case 16: return inverse ? ifft_codelet<16> : fft_codelet<16>;
+    case 32: return inverse ? ifft_codelet<32> : fft_codelet<32>;
+    case 64: return inverse ? ifft_codelet<64> : fft_codelet<64>;
     }
+    assert(false);
+    return NULL;
+}
 
-    void step(cl_mem y, cl_uint B, cl_mem y_)
-    {
-        set_arg(m_step_kernel, 0, y);
-        set_arg(m_step_kernel, 1, B);
-        set_arg(m_step_kernel, 2, y_);
-
-        run_kernel(m_step_kernel);
+// The in-place codelet FftPlan uses for its 32- or 64-sample leaves.
+static LeafCodelet leaf_codelet(size_t N, bool inverse)
+{
+    switch (N) {
+    case 32: return inverse ? ifft_leaf_codelet<32> : fft_leaf_codelet<32>;
+    case 64: return inverse ? ifft_leaf_codelet<64> : fft_leaf_codelet<64>;
     }
+    assert(false);
+    return NULL;
+}
 
-    void step(Complex* dst, Complex const* src, size_t B)
+// Twiddle factors and bit-reversal permutation for one transform size, built
+// once so that repeated transforms of that size do no transcendental math and
+// no allocation. The engine is radix-4 decimation in time with one leading
+// radix-2 pass when log2(N) is odd, so it makes ceil(log2(N)/2) passes over
+// memory and 3 complex multiplies per radix-4 butterfly. Each pass uses the
+// widest butterfly kernel, up to max_kernel, whose width divides its L.
+//
+// With codelets, sizes up to max_codelet_size run a codelet alone, and
+// larger sizes replace the passes within each block of 64 samples (32 when
+// log2(N) is odd, to end on a pass boundary) with a leaf codelet.
+//
+// Given a ThreadPool the transform is split into chunks: every pass whose
+// blocks fit inside a chunk runs chunk by chunk, and the remaining late passes
+// are split into equal butterfly ranges, one pass at a time.
+class FftPlan : private boost::noncopyable
+{
+public:
+    explicit FftPlan(size_t N, Radix4Kernel const& max_kernel = best_radix4_kernel(), bool codelets = true)
+        : m_size(N)
+        , m_reversed(N)
+        , m_twiddle_re(N)
+        , m_twiddle_im(N)
+        , m_forward_codelet(NULL)
+        , m_inverse_codelet(NULL)
+        , m_leaf_size(0)
+        , m_forward_leaf(NULL)
+        , m_inverse_leaf(NULL)
     {
-        std::vector<cl_float2> y1_buffer = to_float2_vector(src, sample_count());
+        assert(N >= 1 && (N & (N - 1)) == 0);
 
-        load(m_y1_mem, y1_buffer);
+        if (codelets && N <= max_codelet_size) {
+            m_forward_codelet = codelet(N, false);
+            m_inverse_codelet = codelet(N, true);
+        }
+        else if (codelets) {
+            m_leaf_size = first_radix4_size() == 1 ? 64 : 32;
+            m_forward_leaf = leaf_codelet(m_leaf_size, false);
+            m_inverse_leaf = leaf_codelet(m_leaf_size, true);
+        }
 
-        step(m_y1_mem, B, m_y2_mem);
+        for (size_t i = 0; i != N; ++i) {
+            m_reversed[i] = reverse_bits(i, N);
+        }
 
-        std::vector<cl_float2> y2_buffer(sample_count());
-        store(&y2_buffer[0], m_y2_mem);
+        // The radix-4 pass combining four sub-spectra of size L stores
+        // W(k, 4L), W(2k, 4L) and W(3k, 4L) for k < L as three consecutive
+        // blocks of L twiddles.
+        size_t offset = 0;
+        for (size_t L = first_radix4_size(); 4*L <= N; L *= 4) {
+            for (size_t k = 0; k != L; ++k) {
+                for (size_t r = 1; r != 4; ++r) {
+                    double angle = -2.0*M_PI*r*k/(4*L);
+                    m_twiddle_re[offset + (r - 1)*L + k] = cos(angle);
+                    m_twiddle_im[offset + (r - 1)*L + k] = sin(angle);
+                }
+            }
 
-        finish();
+            Pass pass = {L, offset, radix4_butterflies_scalar};
+            for (auto& kernel : radix4_kernels()) {
+                if (kernel.width <= L && kernel.width <= max_kernel.width) pass.butterflies = kernel.butterflies;
+            }
+            m_passes.push_back(pass);
 
-        convert(dst, y2_buffer);
+            offset += 3*L;
+        }
     }
 
-    void fft(Complex* spectrum, Complex const* signal)
+    // Forward transform. spectrum may equal signal.
+    void fft(Complex* spectrum, Complex const* signal) const
     {
-        std::vector<cl_float2> x_buffer = to_float2_vector(signal, sample_count());
-        load(m_x_mem, x_buffer);
-
-        init(m_x_mem, m_sample_power, m_y1_mem);
-
-        cl_mem y = m_y1_mem;
-        cl_mem y_ = m_y2_mem;
-        cl_uint B = 1;
-        while (B != sample_count()) {
-            step(y, B, y_);
-            std::swap(y, y_);
-            B <<= 1;
+        if (m_forward_codelet) {
+            m_forward_codelet(spectrum, signal);
+            return;
         }
 
-        std::vector<cl_float2> y_buffer(sample_count());
-        store(&y_buffer[0], y);
-        finish();
-
-        convert(spectrum, y_buffer);
+        permute(spectrum, signal, 1, 0, m_size);
+        transform_block(spectrum, m_size, false);
     }
 
-    void flush()
+    void fft(Complex* spectrum, Complex const* signal, ThreadPool& pool) const
     {
-        if (clFlush(m_queue) != CL_SUCCESS) fatal("Could not flush.");
+        if (m_forward_codelet) {
+            m_forward_codelet(spectrum, signal);
+            return;
+        }
+
+        transform(spectrum, signal, 1, false, pool);
     }
 
-    void finish()
+    void fft(Complex* data) const
     {
-        if (clFinish(m_queue) != CL_SUCCESS) fatal("Could not finish.");
+        fft(data, data);
     }
 
-    void run_kernel(cl_kernel kernel)
+    // Forward transform of N complex values given as 2N interleaved floats,
+    // which need not be aligned or typed as Complex. Out of line, since GCC
+    // schedules the passes worse when it inlines them into RealFftPlan.
+    __attribute__((noinline)) void fft_interleaved(Complex* spectrum, Float const* signal) const
     {
-        cl_int ec;
+        if (m_forward_codelet) {
+            std::memcpy((void*) spectrum, signal, m_size*sizeof(Complex));
+            m_forward_codelet(spectrum, spectrum);
+            return;
+        }
 
-        size_t global_work_size = sample_count();
-        ec = clEnqueueNDRangeKernel(
-                m_queue,
-                kernel,
-                1,
-                NULL,
-                &global_work_size,
-                NULL,
-                0,
-                NULL,
-                NULL);
-        if (ec != CL_SUCCESS) {
-            std::cout << error_code_to_string(ec) << "\n";
-            fatal("Could not enqueue kernel.");
+        size_t const size = m_size;
+        auto const reversed = &m_reversed[0];
+        for (size_t i = 0; i != size; ++i) {
+            spectrum[i] = Complex(signal[2*reversed[i]], signal[2*reversed[i] + 1]);
         }
+        transform_block(spectrum, m_size, false);
     }
 
-    void set_arg(cl_kernel kernel, cl_uint arg_index, cl_uint arg)
+    // Inverse transform, scaled by 1/N. signal may equal spectrum.
+    void ifft(Complex* signal, Complex const* spectrum) const
     {
-        if (clSetKernelArg(
-                    kernel,
-                    arg_index,
-                    sizeof(arg),
-                    &arg
-                    ) != CL_SUCCESS) {
-            fatal("Could not set kernel argument.");
+        if (m_inverse_codelet) {
+            m_inverse_codelet(signal, spectrum);
+            return;
         }
+
+        permute(signal, spectrum, (Float) 1.0/m_size, 0, m_size);
+        transform_block(signal, m_size, true);
     }
 
-    void set_arg(cl_kernel kernel, cl_uint arg_index, cl_mem arg)
+    void ifft(Complex* signal, Complex const* spectrum, ThreadPool& pool) const
     {
-        if (clSetKernelArg(
-                    kernel,
-                    arg_index,
-                    sizeof(arg),
-                    &arg
-                    ) != CL_SUCCESS) {
-            fatal("Could not set kernel argument.");
+        if (m_inverse_codelet) {
+            m_inverse_codelet(signal, spectrum);
+            return;
         }
+
+        transform(signal, spectrum, (Float) 1.0/m_size, true, pool);
     }
 
-    void load(cl_mem mem, std::vector<cl_float2> const& buffer)
+    void ifft(Complex* data) const
     {
-        assert(buffer.size() == sample_count());
+        ifft(data, data);
+    }
 
-        if (clEnqueueWriteBuffer(
-                    m_queue,
-                    mem,
-                    CL_TRUE,
-                    0,
-                    byte_count(),
-                    &buffer[0],
-                    0,
-                    NULL,
-                    NULL) != CL_SUCCESS) {
-            fatal("Coule not write to buffer.");
+    // batch_count forward transforms. Signal b starts at
+    // signals + b*signal_stride and its spectrum at spectra + b*spectrum_stride.
+    void fft_batch(
+            Complex* spectra,
+            Complex const* signals,
+            size_t batch_count,
+            size_t signal_stride,
+            size_t spectrum_stride) const
+    {
+        for (size_t b = 0; b != batch_count; ++b) {
+            fft(&spectra[b*spectrum_stride], &signals[b*signal_stride]);
         }
     }
 
-    void store(cl_float2* buffer, cl_mem mem)
+    // Spreads the batch over the pool, or each transform over it when the
+    // batch is too small to keep every thread busy.
+    void fft_batch(
+            Complex* spectra,
+            Complex const* signals,
+            size_t batch_count,
+            size_t signal_stride,
+            size_t spectrum_stride,
+            ThreadPool& pool) const
     {
-        cl_int ec;
+        if (batch_count < pool.thread_count()) {
+            for (size_t b = 0; b != batch_count; ++b) {
+                fft(&spectra[b*spectrum_stride], &signals[b*signal_stride], pool);
+            }
+            return;
+        }
 
-        ec = clEnqueueReadBuffer(
-                m_queue,
-                mem,
-                CL_TRUE,
-                0,
-                byte_count(),
-                buffer,
-                0,
+        pool.parallel_for(batch_count, [&](size_t b) {
+            fft(&spectra[b*spectrum_stride], &signals[b*signal_stride]);
+        });
+    }
+
+    void ifft_batch(
+            Complex* signals,
+            Complex const* spectra,
+            size_t batch_count,
+            size_t spectrum_stride,
+            size_t signal_stride) const
+    {
+        for (size_t b = 0; b != batch_count; ++b) {
+            ifft(&signals[b*signal_stride], &spectra[b*spectrum_stride]);
+        }
+    }
+
+    void ifft_batch(
+            Complex* signals,
+            Complex const* spectra,
+            size_t batch_count,
+            size_t spectrum_stride,
+            size_t signal_stride,
+            ThreadPool& pool) const
+    {
+        if (batch_count < pool.thread_count()) {
+            for (size_t b = 0; b != batch_count; ++b) {
+                ifft(&signals[b*signal_stride], &spectra[b*spectrum_stride], pool);
+            }
+            return;
+        }
+
+        pool.parallel_for(batch_count, [&](size_t b) {
+            ifft(&signals[b*signal_stride], &spectra[b*spectrum_stride]);
+        });
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    struct Pass
+    {
+        size_t L;
+        size_t twiddle_offset;
+        Radix4Butterflies butterflies;
+    };
+
+    size_t first_radix4_size() const
+    {
+        size_t log2_size = 0;
+        while (((size_t) 1 << log2_size) < m_size) ++log2_size;
+
+        return log2_size % 2 == 0 ? 1 : 2;
+    }
+
+    // Bit-reversal permutation of [begin, end) of dst, scaled. Ranges are
+    // independent, also in place, since each swapped pair belongs to the range
+    // holding its smaller index.
+    void permute(Complex* dst, Complex const* src, Float scale, size_t begin, size_t end) const
+    {
+        if (dst == src) {
+            for (size_t i = begin; i != end; ++i) {
+                size_t j = m_reversed[i];
+                if (i < j) {
+                    std::swap(dst[i], dst[j]);
+                    dst[i] *= scale;
+                    dst[j] *= scale;
+                }
+                else if (i == j) {
+                    dst[i] *= scale;
+                }
+            }
+        }
+        else {
+            for (size_t i = begin; i != end; ++i) {
+                dst[i] = scale*src[m_reversed[i]];
+            }
+        }
+    }
+
+    // All passes whose blocks fit in block_size, applied to the block_size
+    // samples at data.
+    void transform_block(Complex* data, size_t block_size, bool inverse) const
+    {
+        size_t done_size = 1;
+        if (m_leaf_size != 0 && block_size >= m_leaf_size) {
+            LeafCodelet leaf = inverse ? m_inverse_leaf : m_forward_leaf;
+            for (size_t block = 0; block != block_size; block += m_leaf_size) {
+                leaf(&data[block]);
+            }
+            done_size = m_leaf_size;
+        }
+        else if (first_radix4_size() == 2 && block_size >= 2) {
+            radix2_pass(data, block_size);
+        }
+
+        for (auto& pass : m_passes) {
+            if (4*pass.L <= done_size) continue;
+            if (4*pass.L > block_size) break;
+
+            for (size_t block = 0; block != block_size; block += 4*pass.L) {
+                pass.butterflies(
+                        &data[block],
+                        pass.L,
+                        pass.L,
+                        &m_twiddle_re[pass.twiddle_offset],
+                        &m_twiddle_im[pass.twiddle_offset],
+                        inverse);
+            }
+        }
+    }
+
+    void transform(Complex* dst, Complex const* src, Float scale, bool inverse, ThreadPool& pool) const
+    {
+        // Chunks of at least 64 samples keep every butterfly range in the
+        // late passes a multiple of the widest kernel.
+        size_t chunk_count = 1;
+        while (chunk_count < 4*pool.thread_count() && m_size/chunk_count >= 128) {
+            chunk_count <<= 1;
+        }
+        size_t const chunk_size = m_size/chunk_count;
+
+        pool.parallel_for(chunk_count, [&](size_t chunk) {
+            permute(dst, src, scale, chunk*chunk_size, (chunk + 1)*chunk_size);
+        });
+
+        pool.parallel_for(chunk_count, [&](size_t chunk) {
+            transform_block(&dst[chunk*chunk_size], chunk_size, inverse);
+        });
+
+        for (auto& pass : m_passes) {
+            if (4*pass.L <= chunk_size) continue;
+
+            // chunk_count tasks of chunk_size/4 butterflies each.
+            size_t const parts = chunk_count/(m_size/(4*pass.L));
+            size_t const count = pass.L/parts;
+
+            pool.parallel_for(chunk_count, [&](size_t task) {
+                size_t block = task/parts*4*pass.L;
+                size_t k = task%parts*count;
+
+                pass.butterflies(
+                        &dst[block + k],
+                        pass.L,
+                        count,
+                        &m_twiddle_re[pass.twiddle_offset + k],
+                        &m_twiddle_im[pass.twiddle_offset + k],
+                        inverse);
+            });
+        }
+    }
+
+    void radix2_pass(Complex* data, size_t size) const
+    {
+        for (size_t offset = 0; offset != size; offset += 2) {
+            Complex even = data[offset];
+            Complex odd = data[offset + 1];
+
+            data[offset] = even + odd;
+            data[offset + 1] = even - odd;
+        }
+    }
+
+    size_t m_size;
+    std::vector<size_t> m_reversed;
+    RealSignal m_twiddle_re;
+    RealSignal m_twiddle_im;
+    std::vector<Pass> m_passes;
+    Codelet m_forward_codelet;
+    Codelet m_inverse_codelet;
+    size_t m_leaf_size;
+    LeafCodelet m_forward_leaf;
+    LeafCodelet m_inverse_leaf;
+};
+
+// Smallest size for which the convenience transforms use default_thread_pool().
+static const size_t parallel_fft_min_size = 1 << 18;
+
+// Plan for size N, built on first use and kept for the lifetime of the
+// process.
+static FftPlan const& fft_plan(size_t N)
+{
+    static std::map<size_t, std::unique_ptr<FftPlan>> plans;
+    static std::mutex mutex;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<FftPlan>& plan = plans[N];
+    if (!plan) plan.reset(new FftPlan(N));
+    return *plan;
+}
+
+// Transforms of any length. Lengths whose prime factors are all 2, 3, 5 or 7
+// run a mixed-radix Stockham engine (radix 4 first, then 2, 3, 5 and 7) that
+// writes every stage in natural order, so no permutation is needed. Other
+// lengths use Bluestein's chirp-z algorithm: the transform becomes a
+// convolution with a chirp, computed with power-of-two FftPlans of at least
+// 2N - 1 samples. The work buffers live in the plan, so one plan must not be
+// used from several threads at once.
+class GeneralFftPlan : private boost::noncopyable
+{
+public:
+    explicit GeneralFftPlan(size_t N)
+        : m_size(N)
+    {
+        assert(N >= 1);
+
+        size_t remaining = N;
+        std::vector<size_t> radices;
+        for (size_t radix : {4, 2, 3, 5, 7}) {
+            while (remaining % radix == 0) {
+                radices.push_back(radix);
+                remaining /= radix;
+            }
+        }
+
+        if (remaining == 1) {
+            init_mixed_radix(radices);
+        }
+        else {
+            init_bluestein();
+        }
+    }
+
+    // Forward transform. spectrum may equal signal.
+    void fft(Complex* spectrum, Complex const* signal) const
+    {
+        if (m_bluestein_plan) {
+            bluestein(spectrum, signal, false);
+        }
+        else {
+            mixed_radix(spectrum, signal, false);
+        }
+    }
+
+    // Inverse transform, scaled by 1/N. signal may equal spectrum.
+    void ifft(Complex* signal, Complex const* spectrum) const
+    {
+        if (m_bluestein_plan) {
+            bluestein(signal, spectrum, true);
+        }
+        else {
+            mixed_radix(signal, spectrum, true);
+        }
+
+        Float const scale = (Float) 1.0/m_size;
+        for (size_t i = 0; i != m_size; ++i) {
+            signal[i] *= scale;
+        }
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    bool uses_bluestein() const
+    {
+        return m_bluestein_plan != nullptr;
+    }
+
+private:
+    struct Stage
+    {
+        size_t radix;
+        size_t n;              // Length of the sub-transforms entering the stage.
+        size_t stride;         // Number of interleaved sub-transforms.
+        size_t twiddle_offset; // W(p*u, n) for p < n/radix, u < radix.
+        size_t root_offset;    // W(j*u, radix) for j, u < radix.
+    };
+
+    void init_mixed_radix(std::vector<size_t> const& radices)
+    {
+        size_t n = m_size;
+        size_t stride = 1;
+        for (size_t radix : radices) {
+            Stage stage = {radix, n, stride, m_twiddles[0].size(), m_roots[0].size()};
+
+            // Tables for both directions, so the butterflies need no branches.
+            for (size_t p = 0; p != n/radix; ++p) {
+                for (size_t u = 0; u != radix; ++u) {
+                    Complex w(std::polar(1.0, -2.0*M_PI*((p*u) % n)/n));
+                    m_twiddles[0].push_back(w);
+                    m_twiddles[1].push_back(std::conj(w));
+                }
+            }
+
+            for (size_t j = 0; j != radix; ++j) {
+                for (size_t u = 0; u != radix; ++u) {
+                    Complex w(std::polar(1.0, -2.0*M_PI*((j*u) % radix)/radix));
+                    m_roots[0].push_back(w);
+                    m_roots[1].push_back(std::conj(w));
+                }
+            }
+
+            m_stages.push_back(stage);
+            n /= radix;
+            stride *= radix;
+        }
+
+        m_work.resize(m_size);
+    }
+
+    void init_bluestein()
+    {
+        size_t M = 1;
+        while (M < 2*m_size - 1) M <<= 1;
+
+        m_bluestein_plan.reset(new FftPlan(M));
+
+        // chirp[n] = exp(-i*pi*n^2/N), with n^2 reduced modulo 2N to keep the
+        // angle small.
+        m_chirp.resize(m_size);
+        for (size_t n = 0; n != m_size; ++n) {
+            size_t n2 = (n*n) % (2*m_size);
+            m_chirp[n] = std::polar(1.0, -M_PI*n2/m_size);
+        }
+
+        m_kernel_spectrum.assign(M, 0);
+        m_kernel_spectrum[0] = std::conj(m_chirp[0]);
+        for (size_t n = 1; n != m_size; ++n) {
+            m_kernel_spectrum[n] = std::conj(m_chirp[n]);
+            m_kernel_spectrum[M - n] = std::conj(m_chirp[n]);
+        }
+        m_bluestein_plan->fft(&m_kernel_spectrum[0]);
+
+        m_work.resize(M);
+    }
+
+    void mixed_radix(Complex* dst, Complex const* src, bool inverse) const
+    {
+        // Alternate between dst and m_work so that the last stage writes dst,
+        // unless that would make the first stage overwrite its own input.
+        Complex const* in = src;
+        Complex* work = &m_work[0];
+        Complex* out = m_stages.size() % 2 == 1 && dst != src ? dst : work;
+
+        for (auto& stage : m_stages) {
+            run_stage(stage, out, in, inverse);
+            in = out;
+            out = out == dst ? work : dst;
+        }
+
+        if (in != dst) {
+            std::copy(in, in + m_size, dst);
+        }
+    }
+
+    // y[q + s*(r*p + u)] = W(p*u, n) * sum_j x[q + s*(p + j*m)]*W(j*u, r)
+    // for m = n/r, p < m, q < s and u < r.
+    void run_stage(Stage const& stage, Complex* y, Complex const* x, bool inverse) const
+    {
+        size_t const r = stage.radix;
+        size_t const s = stage.stride;
+        size_t const m = stage.n/r;
+        Complex const* twiddles = &m_twiddles[inverse][stage.twiddle_offset];
+        Complex const* roots = &m_roots[inverse][stage.root_offset];
+
+        Complex a[7];
+        Complex b[7];
+
+        for (size_t p = 0; p != m; ++p) {
+            for (size_t q = 0; q != s; ++q) {
+                for (size_t j = 0; j != r; ++j) {
+                    a[j] = x[q + s*(p + j*m)];
+                }
+
+                small_dft(b, a, r, roots, inverse);
+
+                y[q + s*r*p] = b[0];
+                for (size_t u = 1; u != r; ++u) {
+                    y[q + s*(r*p + u)] = mult(b[u], twiddles[p*r + u]);
+                }
+            }
+        }
+    }
+
+    static void small_dft(Complex* b, Complex const* a, size_t r, Complex const* roots, bool inverse)
+    {
+        if (r == 2) {
+            b[0] = a[0] + a[1];
+            b[1] = a[0] - a[1];
+        }
+        else if (r == 4) {
+            Complex t0 = a[0] + a[2];
+            Complex t1 = a[0] - a[2];
+            Complex t2 = a[1] + a[3];
+            Complex d = a[1] - a[3];
+            // Multiply by -i for the forward transform and by i for the inverse.
+            Complex t3 = inverse ? Complex(-std::imag(d), std::real(d)) : Complex(std::imag(d), -std::real(d));
+
+            b[0] = t0 + t2;
+            b[1] = t1 + t3;
+            b[2] = t0 - t2;
+            b[3] = t1 - t3;
+        }
+        else if (r == 3) {
+            // W(1, 3) = -1/2 -+ i*sqrt(3)/2 for the forward and inverse transforms.
+            Float const sin60 = inverse ? 0.866025403784438647f : -0.866025403784438647f;
+            Complex t0 = a[1] + a[2];
+            Complex t1 = a[0] - (Float) 0.5*t0;
+            Complex d = sin60*(a[1] - a[2]);
+            Complex t2(-std::imag(d), std::real(d));
+
+            b[0] = a[0] + t0;
+            b[1] = t1 + t2;
+            b[2] = t1 - t2;
+        }
+        else {
+            // Radix 5 and 7: a small matrix-vector product.
+            for (size_t u = 0; u != r; ++u) {
+                Complex sum = a[0];
+                for (size_t j = 1; j != r; ++j) {
+                    sum += mult(a[j], roots[j*r + u]);
+                }
+                b[u] = sum;
+            }
+        }
+    }
+
+    // X[k] = chirp[k] * sum_n (x[n]*chirp[n]) * conj(chirp[k - n]). The
+    // inverse uses ifft(x) = conj(fft(conj(x))), with the caller scaling.
+    void bluestein(Complex* dst, Complex const* src, bool inverse) const
+    {
+        size_t const M = m_bluestein_plan->size();
+        Complex* work = &m_work[0];
+
+        for (size_t n = 0; n != m_size; ++n) {
+            Complex x = inverse ? std::conj(src[n]) : src[n];
+            work[n] = mult(x, m_chirp[n]);
+        }
+        std::fill(work + m_size, work + M, Complex(0));
+
+        m_bluestein_plan->fft(work);
+        for (size_t k = 0; k != M; ++k) {
+            work[k] = mult(work[k], m_kernel_spectrum[k]);
+        }
+        m_bluestein_plan->ifft(work);
+
+        for (size_t k = 0; k != m_size; ++k) {
+            Complex X = mult(work[k], m_chirp[k]);
+            dst[k] = inverse ? std::conj(X) : X;
+        }
+    }
+
+    size_t m_size;
+    std::vector<Stage> m_stages;
+    Signal m_twiddles[2]; // Forward and inverse.
+    Signal m_roots[2];
+    std::unique_ptr<FftPlan> m_bluestein_plan;
+    Signal m_chirp;
+    Signal m_kernel_spectrum;
+    mutable Signal m_work;
+};
+
+// Per-thread plan for size N, since GeneralFftPlan keeps work buffers.
+static GeneralFftPlan const& general_fft_plan(size_t N)
+{
+    static thread_local std::map<size_t, std::unique_ptr<GeneralFftPlan>> plans;
+
+    std::unique_ptr<GeneralFftPlan>& plan = plans[N];
+    if (!plan) plan.reset(new GeneralFftPlan(N));
+    return *plan;
+}
+
+static bool is_power_of_two(size_t N)
+{
+    return N != 0 && (N & (N - 1)) == 0;
+}
+
+// Forward transform of N samples of any length into a caller-provided buffer.
+static void fft(Complex* spectrum, Complex const* signal, size_t N)
+{
+    if (!is_power_of_two(N)) {
+        general_fft_plan(N).fft(spectrum, signal);
+    }
+    else if (N <= max_codelet_size) {
+        codelet(N, false)(spectrum, signal);
+    }
+    else if (N >= parallel_fft_min_size) {
+        fft_plan(N).fft(spectrum, signal, default_thread_pool());
+    }
+    else {
+        fft_plan(N).fft(spectrum, signal);
+    }
+}
+
+// Forward transform of N samples of any length in place.
+static void fft(Complex* data, size_t N)
+{
+    fft(data, data, N);
+}
+
+// Inverse transform of N samples of any length into a caller-provided buffer.
+static void ifft(Complex* signal, Complex const* spectrum, size_t N)
+{
+    if (!is_power_of_two(N)) {
+        general_fft_plan(N).ifft(signal, spectrum);
+    }
+    else if (N <= max_codelet_size) {
+        codelet(N, true)(signal, spectrum);
+    }
+    else if (N >= parallel_fft_min_size) {
+        fft_plan(N).ifft(signal, spectrum, default_thread_pool());
+    }
+    else {
+        fft_plan(N).ifft(signal, spectrum);
+    }
+}
+
+// Inverse transform of N samples of any length in place.
+static void ifft(Complex* data, size_t N)
+{
+    ifft(data, data, N);
+}
+
+static Signal fft(Signal const& signal)
+{
+    Signal result(signal.size());
+    fft(&result[0], &signal[0], signal.size());
+    return result;
+}
+
+static Signal ifft(Signal const& spectrum)
+{
+    Signal result(spectrum.size());
+    ifft(&result[0], &spectrum[0], spectrum.size());
+    return result;
+}
+
+// Transforms of N real samples through one complex transform of N/2 samples
+// z[m] = x[2m] + i*x[2m+1] and a twiddle pass that separates the spectra of
+// the even and odd samples. Only the N/2 + 1 non-redundant bins are produced;
+// the others are their complex conjugates.
+class RealFftPlan : private boost::noncopyable
+{
+public:
+    explicit RealFftPlan(size_t N)
+        : m_size(N)
+        , m_half(N/2)
+        , m_twiddles(N/4 + 1)
+    {
+        assert(N >= 2 && (N & (N - 1)) == 0);
+
+        for (size_t k = 0; k != m_twiddles.size(); ++k) {
+            m_twiddles[k] = std::polar(1.0, -2.0*M_PI*k/N);
+        }
+    }
+
+    // N real samples to N/2 + 1 bins.
+    void fft(Complex* spectrum, Float const* signal) const
+    {
+        size_t const half_size = m_size/2;
+
+        m_half.fft_interleaved(spectrum, signal);
+
+        // Bins 0 and N/2 come from Z[0] alone.
+        Complex z0 = spectrum[0];
+        spectrum[0] = std::real(z0) + std::imag(z0);
+        spectrum[half_size] = std::real(z0) - std::imag(z0);
+
+        // Bins k and N/2 - k both depend on Z[k] and Z[N/2 - k].
+        for (size_t k = 1; k <= half_size/2; ++k) {
+            Complex a = spectrum[k];
+            Complex b = std::conj(spectrum[half_size - k]);
+
+            Complex even = (Float) 0.5*(a + b);
+            Complex d = (Float) 0.5*(a - b);
+            Complex odd(std::imag(d), -std::real(d));
+            Complex t = mult(m_twiddles[k], odd);
+
+            spectrum[k] = even + t;
+            spectrum[half_size - k] = std::conj(even - t);
+        }
+    }
+
+    // N/2 + 1 bins to N real samples, scaled by 1/N. signal need not be
+    // aligned or typed as Complex, so the half-length transform runs in a
+    // pooled Signal and is copied out.
+    void ifft(Float* signal, Complex const* spectrum) const
+    {
+        size_t const half_size = m_size/2;
+        Signal z(half_size);
+
+        for (size_t k = 0; k <= half_size/2; ++k) {
+            Complex a = spectrum[k];
+            Complex b = std::conj(spectrum[half_size - k]);
+
+            Complex even = (Float) 0.5*(a + b);
+            Complex odd = mult((Float) 0.5*(a - b), std::conj(m_twiddles[k]));
+            Complex i_odd(-std::imag(odd), std::real(odd));
+
+            z[k] = even + i_odd;
+            if (k != 0) {
+                z[half_size - k] = std::conj(even - i_odd);
+            }
+        }
+
+        m_half.ifft(&z[0], &z[0]);
+        std::memcpy(signal, (void const*) &z[0], m_size*sizeof(Float));
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    size_t m_size;
+    FftPlan m_half;
+    Signal m_twiddles;
+};
+
+static RealFftPlan const& real_fft_plan(size_t N)
+{
+    static std::map<size_t, std::unique_ptr<RealFftPlan>> plans;
+    static std::mutex mutex;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<RealFftPlan>& plan = plans[N];
+    if (!plan) plan.reset(new RealFftPlan(N));
+    return *plan;
+}
+
+// N real samples to the N/2 + 1 non-redundant bins.
+static void rfft(Complex* spectrum, Float const* signal, size_t N)
+{
+    real_fft_plan(N).fft(spectrum, signal);
+}
+
+// N/2 + 1 bins back to N real samples.
+static void irfft(Float* signal, Complex const* spectrum, size_t N)
+{
+    real_fft_plan(N).ifft(signal, spectrum);
+}
+
+// batch_count forward transforms of N samples, stored back to back.
+static void fft_batch(Complex* spectra, Complex const* signals, size_t N, size_t batch_count)
+{
+    if (!is_power_of_two(N)) {
+        for (size_t b = 0; b != batch_count; ++b) {
+            general_fft_plan(N).fft(&spectra[b*N], &signals[b*N]);
+        }
+    }
+    else if (N*batch_count >= parallel_fft_min_size) {
+        fft_plan(N).fft_batch(spectra, signals, batch_count, N, N, default_thread_pool());
+    }
+    else {
+        fft_plan(N).fft_batch(spectra, signals, batch_count, N, N);
+    }
+}
+
+// batch_count inverse transforms of N samples, stored back to back.
+static void ifft_batch(Complex* signals, Complex const* spectra, size_t N, size_t batch_count)
+{
+    if (!is_power_of_two(N)) {
+        for (size_t b = 0; b != batch_count; ++b) {
+            general_fft_plan(N).ifft(&signals[b*N], &spectra[b*N]);
+        }
+    }
+    else if (N*batch_count >= parallel_fft_min_size) {
+        fft_plan(N).ifft_batch(signals, spectra, batch_count, N, N, default_thread_pool());
+    }
+    else {
+        fft_plan(N).ifft_batch(signals, spectra, batch_count, N, N);
+    }
+}
+
+// Real frames are transformed two at a time: frame 2j as the real part and
+// frame 2j + 1 as the imaginary part of one complex signal, which halves the
+// work of any complex batch transform. Writes sample n of real frame f of
+// the batch into packed, which holds (f + 2)/2 signals of N samples. Even
+// frames must be written first, since they clear the imaginary part.
+static void pack_real_sample(Complex* packed, size_t N, size_t f, size_t n, Float x)
+{
+    Complex& z = packed[f/2*N + n];
+    if (f % 2 == 0) z = Complex(x, 0);
+    else z.imag(x);
+}
+
+// The N/2 + 1 bins of each of frame_count real frames, from the spectra of
+// the signals they were packed into: with Z the spectrum of x + iy,
+// X[k] = (Z[k] + conj(Z[N - k]))/2 and Y[k] = (Z[k] - conj(Z[N - k]))/2i.
+static void unpack_real_spectra(Complex* bins, Complex const* spectra, size_t N, size_t frame_count)
+{
+    size_t const bin_count = N/2 + 1;
+    for (size_t f = 0; f < frame_count; f += 2) {
+        Complex const* z = &spectra[f/2*N];
+        Complex* x = &bins[f*bin_count];
+        Complex* y = x + bin_count;
+        // A last frame without a partner was transformed alone.
+        if (f + 1 == frame_count) {
+            std::copy(z, z + bin_count, x);
+            break;
+        }
+        for (size_t k = 0; k != bin_count; ++k) {
+            Complex a = z[k];
+            Complex b = z[k == 0 ? 0 : N - k];
+            // Spelled out, since std::complex products check for NaNs.
+            x[k] = Complex((Float) 0.5*(a.real() + b.real()), (Float) 0.5*(a.imag() - b.imag()));
+            y[k] = Complex((Float) 0.5*(a.imag() + b.imag()), (Float) 0.5*(b.real() - a.real()));
+        }
+    }
+}
+
+// Linear convolution by definition, accumulated in double precision, as a
+// reference for the FFT-based convolution.
+static Signal direct_convolve(Signal const& signal, Signal const& filter)
+{
+    assert(!signal.empty() && !filter.empty());
+
+    Signal result(signal.size() + filter.size() - 1);
+    for (size_t n = 0; n != result.size(); ++n) {
+        std::complex<double> sum = 0;
+        size_t first = n + 1 >= filter.size() ? n + 1 - filter.size() : 0;
+        size_t last = std::min(n, signal.size() - 1);
+        for (size_t m = first; m <= last; ++m) {
+            sum += std::complex<double>(signal[m])*std::complex<double>(filter[n - m]);
+        }
+        result[n] = Complex(sum);
+    }
+    return result;
+}
+
+// The filter whose convolution with a signal is the cross-correlation of
+// the signal with pattern: pattern conjugated and reversed.
+static Signal correlation_filter(Signal const& pattern)
+{
+    Signal result(pattern.rbegin(), pattern.rend());
+    for (auto& x : result) {
+        x = std::conj(x);
+    }
+    return result;
+}
+
+// Transform size for a filter of M taps: the power of two at least 4*M,
+// so that each block yields at least three quarters of a transform of new
+// output.
+static size_t convolution_fft_size(size_t M)
+{
+    size_t N = 16;
+    while (N < 4*M) N <<= 1;
+    return N;
+}
+
+enum class BlockMethod
+{
+    // Blocks overlap by M - 1 input samples, and the first M - 1 outputs of
+    // each block, which wrap around, are dropped.
+    OverlapSave,
+    // Blocks are disjoint and zero-padded, and their outputs overlap by
+    // M - 1 samples, which are added.
+    OverlapAdd,
+};
+
+// Convolution of long signals with one filter of M taps, block by block
+// with transforms of fft_size() samples. The filter's spectrum is computed
+// once, blocks are transformed in batches, and each block costs one
+// multiplication per bin instead of M per sample. Not thread-safe, since
+// the batches are staged in member buffers.
+class FftConvolver : private boost::noncopyable
+{
+public:
+    // fft_size defaults to convolution_fft_size(filter.size()).
+    explicit FftConvolver(Signal const& filter, BlockMethod method = BlockMethod::OverlapSave, size_t fft_size = 0)
+        : m_filter_size(filter.size())
+        , m_fft_size(fft_size != 0 ? fft_size : convolution_fft_size(filter.size()))
+        , m_method(method)
+        , m_spectrum(m_fft_size)
+        , m_blocks(batch_size*m_fft_size)
+        , m_spectra(batch_size*m_fft_size)
+    {
+        assert(!filter.empty() && is_power_of_two(m_fft_size) && m_fft_size >= filter.size());
+
+        Signal padded(m_fft_size);
+        std::copy(filter.begin(), filter.end(), padded.begin());
+        fft(&m_spectrum[0], &padded[0], m_fft_size);
+    }
+
+    // Full linear convolution: signal.size() + filter_size() - 1 samples.
+    Signal convolve(Signal const& signal) const
+    {
+        Signal result(signal.size() + m_filter_size - 1);
+        convolve(&result[0], &signal[0], signal.size());
+        return result;
+    }
+
+    // Writes the count + filter_size() - 1 samples of the convolution of
+    // the count samples at signal.
+    void convolve(Complex* output, Complex const* signal, size_t count) const
+    {
+        size_t const N = m_fft_size;
+        size_t const L = step();
+        size_t const output_count = count + m_filter_size - 1;
+        size_t const history = m_filter_size - 1;
+
+        // Overlap-save needs a block for every L outputs, overlap-add one
+        // for every L inputs.
+        size_t const block_count = m_method == BlockMethod::OverlapSave
+            ? (output_count + L - 1)/L
+            : (count + L - 1)/L;
+
+        if (m_method == BlockMethod::OverlapAdd) {
+            std::fill(output, output + output_count, Complex(0));
+        }
+
+        for (size_t first = 0; first < block_count; first += batch_size) {
+            size_t const batch_count = std::min((size_t) batch_size, block_count - first);
+
+            // Block b reads signal samples from start(b) on, where negative
+            // indices and those past the end are zeros.
+            for (size_t b = 0; b != batch_count; ++b) {
+                Complex* block = &m_blocks[b*N];
+                ptrdiff_t start = (ptrdiff_t) ((first + b)*L) - (m_method == BlockMethod::OverlapSave ? (ptrdiff_t) history : 0);
+                size_t length = m_method == BlockMethod::OverlapSave ? N : L;
+                for (size_t n = 0; n != N; ++n) {
+                    ptrdiff_t i = start + (ptrdiff_t) n;
+                    block[n] = n < length && i >= 0 && i < (ptrdiff_t) count ? signal[i] : Complex(0);
+                }
+            }
+
+            fft_batch(&m_spectra[0], &m_blocks[0], N, batch_count);
+            for (size_t b = 0; b != batch_count; ++b) {
+                for (size_t k = 0; k != N; ++k) {
+                    m_spectra[b*N + k] = mult(m_spectra[b*N + k], m_spectrum[k]);
+                }
+            }
+            ifft_batch(&m_blocks[0], &m_spectra[0], N, batch_count);
+
+            for (size_t b = 0; b != batch_count; ++b) {
+                Complex const* block = &m_blocks[b*N];
+                size_t offset = (first + b)*L;
+                if (m_method == BlockMethod::OverlapSave) {
+                    size_t valid = std::min(L, output_count - offset);
+                    std::copy(block + history, block + history + valid, output + offset);
+                }
+                else {
+                    size_t valid = std::min(N, output_count - offset);
+                    for (size_t n = 0; n != valid; ++n) {
+                        output[offset + n] += block[n];
+                    }
+                }
+            }
+        }
+    }
+
+    size_t filter_size() const
+    {
+        return m_filter_size;
+    }
+
+    size_t fft_size() const
+    {
+        return m_fft_size;
+    }
+
+    // New samples per block: the transform size less the M - 1 that the
+    // filter spreads each block over.
+    size_t step() const
+    {
+        return m_fft_size - m_filter_size + 1;
+    }
+
+private:
+    // Blocks per fft_batch() call.
+    static size_t const batch_size = 16;
+
+    size_t m_filter_size;
+    size_t m_fft_size;
+    BlockMethod m_method;
+    Signal m_spectrum;
+    mutable Signal m_blocks;
+    mutable Signal m_spectra;
+};
+
+// Linear convolution of signal with filter.
+static Signal fft_convolve(Signal const& signal, Signal const& filter)
+{
+    return FftConvolver(filter).convolve(signal);
+}
+
+// Cross-correlation of signal with pattern, for lags from
+// -(pattern.size() - 1) to signal.size() - 1: element j is the sum over n of
+// signal[n + j - (pattern.size() - 1)]*conj(pattern[n]).
+static Signal fft_correlate(Signal const& signal, Signal const& pattern)
+{
+    return FftConvolver(correlation_filter(pattern)).convolve(signal);
+}
+
+// Side of the square tiles transpose() moves at a time: two 32 x 32 tiles
+// of Complex are 16 KB, which fits in L1 with room to spare.
+static size_t const transpose_tile = 32;
+
+// Tile rows [first_row, last_row) of transpose().
+static void transpose_rows(
+        Complex* dst,
+        size_t dst_stride,
+        Complex const* src,
+        size_t src_stride,
+        size_t cols,
+        size_t first_row,
+        size_t last_row)
+{
+    for (size_t r0 = first_row; r0 < last_row; r0 += transpose_tile) {
+        size_t r1 = std::min(r0 + transpose_tile, last_row);
+        for (size_t c0 = 0; c0 < cols; c0 += transpose_tile) {
+            size_t c1 = std::min(c0 + transpose_tile, cols);
+            for (size_t c = c0; c != c1; ++c) {
+                for (size_t r = r0; r != r1; ++r) {
+                    dst[c*dst_stride + r] = src[r*src_stride + c];
+                }
+            }
+        }
+    }
+}
+
+// dst = the transpose of the rows x cols matrix src, a tile at a time so
+// that both the reads and the strided writes stay in cache. Row r of src
+// starts at src + r*src_stride and row c of dst at dst + c*dst_stride. dst
+// must not overlap src.
+static void transpose(Complex* dst, size_t dst_stride, Complex const* src, size_t src_stride, size_t rows, size_t cols)
+{
+    transpose_rows(dst, dst_stride, src, src_stride, cols, 0, rows);
+}
+
+// transpose() of a dense row-major matrix.
+static void transpose(Complex* dst, Complex const* src, size_t rows, size_t cols)
+{
+    transpose(dst, rows, src, cols, rows, cols);
+}
+
+// transpose() of a dense row-major matrix with the tile rows spread over
+// pool.
+static void transpose(Complex* dst, Complex const* src, size_t rows, size_t cols, ThreadPool& pool)
+{
+    size_t const tile_rows = (rows + transpose_tile - 1)/transpose_tile;
+    pool.parallel_for(tile_rows, [&](size_t t) {
+        transpose_rows(dst, rows, src, cols, cols, t*transpose_tile, std::min((t + 1)*transpose_tile, rows));
+    });
+}
+
+// Transforms along every axis of a row-major array of shape[0] x shape[1]
+// x ..., the last axis contiguous. The last axis is a batch of contiguous
+// transforms in place. Along any other axis the transforms are the columns
+// of n x inner matrices, which go panel_width columns at a time through a
+// work buffer: a blocked transpose gathers the panel into rows, a strided
+// batch transforms them while they are in cache, and a second transpose
+// puts them back. The rows of the work buffer are padded so that
+// power-of-two lengths do not map every row to the same cache sets. The
+// inverse is scaled by 1/size(). Not thread-safe, since the panels go
+// through a member buffer.
+class FftPlanNd : private boost::noncopyable
+{
+public:
+    explicit FftPlanNd(std::vector<size_t> const& shape)
+        : m_shape(shape)
+        , m_size(1)
+    {
+        assert(!shape.empty());
+        size_t longest = 0;
+        for (size_t n : shape) {
+            assert(n != 0);
+            m_size *= n;
+            longest = std::max(longest, n);
+        }
+        m_work.resize(panel_width*(longest + row_padding));
+    }
+
+    void fft(Complex* spectrum, Complex const* signal) const
+    {
+        if (spectrum != signal) std::copy(signal, signal + m_size, spectrum);
+        transform(spectrum, false);
+    }
+
+    void ifft(Complex* signal, Complex const* spectrum) const
+    {
+        if (signal != spectrum) std::copy(spectrum, spectrum + m_size, signal);
+        transform(signal, true);
+    }
+
+    std::vector<size_t> const& shape() const
+    {
+        return m_shape;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    static size_t const panel_width = 16;
+    static size_t const row_padding = 4;
+
+    void transform(Complex* data, bool inverse) const
+    {
+        bool const parallel = m_size >= parallel_fft_min_size;
+        size_t inner = 1;
+        for (size_t axis = m_shape.size(); axis-- != 0; ) {
+            size_t const n = m_shape[axis];
+            size_t const outer = m_size/(n*inner);
+
+            if (n != 1 && inner == 1) {
+                if (inverse) ifft_batch(data, data, n, outer);
+                else fft_batch(data, data, n, outer);
+            }
+            else if (n != 1) {
+                size_t const panel_count = outer*((inner + panel_width - 1)/panel_width);
+                if (parallel) {
+                    ThreadPool& pool = default_thread_pool();
+                    size_t const chunk_count = std::min(pool.thread_count(), panel_count);
+                    pool.parallel_for(chunk_count, [&](size_t t) {
+                        Signal work(m_work.size());
+                        transform_panels(data, n, inner, t*panel_count/chunk_count, (t + 1)*panel_count/chunk_count, &work[0], inverse);
+                    });
+                }
+                else {
+                    transform_panels(data, n, inner, 0, panel_count, &m_work[0], inverse);
+                }
+            }
+            inner *= n;
+        }
+    }
+
+    // Transforms the columns of panels [first, last), counting panel_width
+    // columns of one n x inner block after another.
+    static void transform_panels(Complex* data, size_t n, size_t inner, size_t first, size_t last, Complex* work, bool inverse)
+    {
+        size_t const panels_per_block = (inner + panel_width - 1)/panel_width;
+        size_t const stride = n + row_padding;
+        for (size_t p = first; p != last; ++p) {
+            size_t const column = p%panels_per_block*panel_width;
+            size_t const width = std::min((size_t) panel_width, inner - column);
+            Complex* panel = data + p/panels_per_block*n*inner + column;
+
+            transpose(work, stride, panel, inner, n, width);
+            if (is_power_of_two(n) && inverse) fft_plan(n).ifft_batch(work, work, width, stride, stride);
+            else if (is_power_of_two(n)) fft_plan(n).fft_batch(work, work, width, stride, stride);
+            else {
+                GeneralFftPlan const& plan = general_fft_plan(n);
+                for (size_t b = 0; b != width; ++b) {
+                    if (inverse) plan.ifft(&work[b*stride], &work[b*stride]);
+                    else plan.fft(&work[b*stride], &work[b*stride]);
+                }
+            }
+            transpose(panel, inner, work, stride, width, n);
+        }
+    }
+
+    std::vector<size_t> m_shape;
+    size_t m_size;
+    mutable Signal m_work;
+};
+
+// Forward transform of a rows x cols row-major image.
+static void fft_2d(Complex* spectrum, Complex const* signal, size_t rows, size_t cols)
+{
+    FftPlanNd({rows, cols}).fft(spectrum, signal);
+}
+
+// Inverse of fft_2d(), scaled by 1/(rows*cols).
+static void ifft_2d(Complex* signal, Complex const* spectrum, size_t rows, size_t cols)
+{
+    FftPlanNd({rows, cols}).ifft(signal, spectrum);
+}
+
+// Forward transform of a d0 x d1 x d2 row-major volume.
+static void fft_3d(Complex* spectrum, Complex const* signal, size_t d0, size_t d1, size_t d2)
+{
+    FftPlanNd({d0, d1, d2}).fft(spectrum, signal);
+}
+
+// Inverse of fft_3d(), scaled by 1/(d0*d1*d2).
+static void ifft_3d(Complex* signal, Complex const* spectrum, size_t d0, size_t d1, size_t d2)
+{
+    FftPlanNd({d0, d1, d2}).ifft(signal, spectrum);
+}
+
+// Row-column transform along every axis that gathers each strided line into
+// a buffer, transforms it and scatters it back: the straightforward way,
+// and the baseline FftPlanNd is measured and tested against.
+static void strided_fft_nd(Complex* data, std::vector<size_t> const& shape)
+{
+    size_t size = 1;
+    for (size_t n : shape) {
+        size *= n;
+    }
+
+    size_t inner = 1;
+    for (size_t axis = shape.size(); axis-- != 0; ) {
+        size_t const n = shape[axis];
+        Signal line(n);
+        for (size_t o = 0; o != size/(n*inner); ++o) {
+            for (size_t i = 0; i != inner; ++i) {
+                Complex* first = data + o*n*inner + i;
+                for (size_t k = 0; k != n; ++k) {
+                    line[k] = first[k*inner];
+                }
+                fft(&line[0], n);
+                for (size_t k = 0; k != n; ++k) {
+                    first[k*inner] = line[k];
+                }
+            }
+        }
+        inner *= n;
+    }
+}
+
+// Single-producer, single-consumer queue. The producer only advances m_head
+// and the consumer only m_tail, so neither side takes a lock. Both count
+// items since construction; the capacity is a power of two so that they
+// wrap by masking.
+template <typename T>
+class RingBuffer : private boost::noncopyable
+{
+public:
+    explicit RingBuffer(size_t capacity)
+        : m_head(0)
+        , m_tail(0)
+    {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        m_data.resize(size);
+        m_mask = size - 1;
+    }
+
+    // Producer: appends up to count items and returns how many fitted.
+    size_t write(T const* data, size_t count)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        count = std::min(count, m_data.size() - (head - tail));
+
+        for (size_t i = 0; i != count; ++i) {
+            m_data[(head + i) & m_mask] = data[i];
+        }
+        m_head.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer: items written and not yet consumed.
+    size_t available() const
+    {
+        return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_relaxed);
+    }
+
+    // Consumer: the item offset places past the oldest one, which must be
+    // available.
+    T const& peek(size_t offset) const
+    {
+        return m_data[(m_tail.load(std::memory_order_relaxed) + offset) & m_mask];
+    }
+
+    // Consumer: drops the count oldest items.
+    void consume(size_t count)
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+    }
+
+    size_t capacity() const
+    {
+        return m_data.size();
+    }
+
+private:
+    std::vector<T> m_data;
+    size_t m_mask;
+    std::atomic<size_t> m_head;
+    std::atomic<size_t> m_tail;
+};
+
+enum class Window
+{
+    Rectangular,
+    Hann,
+    Hamming,
+    Blackman,
+};
+
+// The periodic form of window over N samples, which is what overlapping
+// frames are meant to sum under.
+static RealSignal make_window(Window window, size_t N)
+{
+    RealSignal result(N);
+    for (size_t n = 0; n != N; ++n) {
+        double x = 2*M_PI*n/N;
+        switch (window) {
+        case Window::Rectangular: result[n] = 1; break;
+        case Window::Hann: result[n] = 0.5 - 0.5*cos(x); break;
+        case Window::Hamming: result[n] = 0.54 - 0.46*cos(x); break;
+        case Window::Blackman: result[n] = 0.42 - 0.5*cos(x) + 0.08*cos(2*x); break;
+        }
+    }
+    return result;
+}
+
+// One frame of a StftStream, valid during the callback only.
+struct StftFrame
+{
+    // Frames since the start of the stream, and the input sample the frame
+    // starts at.
+    size_t index;
+    size_t first_sample;
+    // The frame_size/2 + 1 non-redundant bins of the windowed frame.
+    Complex const* spectrum;
+    size_t bin_count;
+    // From writing the frame's last sample to the callback.
+    double latency_ns;
+    // The frame's share of the time of the batch transform it was part of.
+    double transform_ns;
+};
+
+// Short-time Fourier transform of a stream of real samples. write() appends
+// chunks of any size to a lock-free ring buffer, and a worker thread cuts
+// frames of frame_size samples every hop_size samples, windows them and
+// transforms up to max_batch of them at a time with transform. Each frame
+// is passed to callback, on the worker thread, in stream order. Samples and
+// stamps cross without locks; m_mutex only orders the sleeps and wake-ups
+// of the two threads.
+class StftStream : private boost::noncopyable
+{
+public:
+    typedef std::function<void(StftFrame const&)> FrameCallback;
+
+    // batch_count transforms of N samples, stored back to back, like
+    // fft_batch() or a lambda around Fourier::fft_batch.
+    typedef std::function<void(Complex* spectra, Complex const* signals, size_t N, size_t batch_count)> BatchTransform;
+
+    struct Stats
+    {
+        size_t frame_count;
+        double mean_latency_ns;
+        double max_latency_ns;
+        double mean_transform_ns;
+    };
+
+    StftStream(
+            size_t frame_size,
+            size_t hop_size,
+            Window window,
+            FrameCallback callback,
+            size_t max_batch = 16,
+            BatchTransform transform = fft_batch)
+        : m_frame_size(frame_size)
+        , m_hop_size(hop_size)
+        , m_max_batch(max_batch)
+        , m_window(make_window(window, frame_size))
+        , m_callback(callback)
+        , m_transform(transform)
+        , m_samples(2*(frame_size + max_batch*hop_size))
+        , m_stamps(1024)
+        , m_written(0)
+        , m_consumed(0)
+        , m_skip(0)
+        , m_frame_count(0)
+        , m_latency_sum_ns(0)
+        , m_max_latency_ns(0)
+        , m_transform_sum_ns(0)
+        , m_closing(false)
+        , m_producer_waiting(false)
+        , m_frames((max_batch + 1)/2*frame_size)
+        , m_spectra((max_batch + 1)/2*frame_size)
+        , m_bins(max_batch*bin_count())
+    {
+        assert(frame_size >= 1 && hop_size >= 1 && max_batch >= 1);
+        m_worker = std::thread([this] { run(); });
+    }
+
+    ~StftStream()
+    {
+        close();
+    }
+
+    // Appends count samples, waiting while the ring buffer is full. Only one
+    // thread may write.
+    void write(Float const* samples, size_t count)
+    {
+        while (count != 0) {
+            Stamp stamp{m_written + count, Clock::now()};
+            if (m_stamps.write(&stamp, 1) == 0) {
+                wait_for_room([&] { return m_stamps.write(&stamp, 1) != 0; });
+            }
+
+            size_t written = m_samples.write(samples, count);
+            if (written == 0) {
+                wait_for_room([&] {
+                    written = m_samples.write(samples, count);
+                    return written != 0;
+                });
+            }
+
+            samples += written;
+            count -= written;
+            m_written += written;
+
+            // The worker checks for work under the lock, so taking it here
+            // means the worker either sees these samples or is already
+            // waiting for the notification.
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+            }
+            m_wake.notify_one();
+        }
+    }
+
+    // Emits every frame that the written samples complete and stops the
+    // worker. Samples after the last complete frame are dropped.
+    void close()
+    {
+        if (!m_worker.joinable()) return;
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_closing = true;
+        }
+        m_wake.notify_one();
+        m_worker.join();
+    }
+
+    Stats stats() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return Stats{
+            m_frame_count,
+            m_frame_count != 0 ? m_latency_sum_ns/m_frame_count : 0,
+            m_max_latency_ns,
+            m_frame_count != 0 ? m_transform_sum_ns/m_frame_count : 0,
+        };
+    }
+
+    size_t bin_count() const
+    {
+        return m_frame_size/2 + 1;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    // Written by the producer before the samples it describes, so that the
+    // consumer always finds the stamp of a sample it can see.
+    struct Stamp
+    {
+        // Samples written once the chunk is in.
+        size_t end;
+        Clock::time_point time;
+    };
+
+    // Complete frames in the ring buffer, up to m_max_batch.
+    size_t ready_frame_count() const
+    {
+        size_t available = m_samples.available();
+        if (m_skip != 0 || available < m_frame_size) return 0;
+        return std::min(m_max_batch, (available - m_frame_size)/m_hop_size + 1);
+    }
+
+    // Whether the worker can make progress on the samples it sees.
+    bool has_work() const
+    {
+        return m_skip != 0 ? m_samples.available() != 0 : ready_frame_count() != 0;
+    }
+
+    // Producer: sleeps until fits() manages to write, waking the worker to
+    // make room each time it does not.
+    template <typename Fits>
+    void wait_for_room(Fits fits)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!fits()) {
+            m_producer_waiting = true;
+            m_wake.notify_one();
+            m_room.wait(lock);
+        }
+    }
+
+    // Worker: wakes the producer if it waits for room, once the samples
+    // ring is half empty, so that each wake-up lets it write a good share
+    // rather than a hop at a time. Must be called with m_mutex held.
+    void announce_room(bool force)
+    {
+        if (!m_producer_waiting) return;
+        if (!force && m_samples.available() > m_samples.capacity()/2) return;
+        m_producer_waiting = false;
+        m_room.notify_one();
+    }
+
+    void run()
+    {
+        while (true) {
+            drain_stamps();
+
+            if (m_skip != 0) {
+                size_t count = std::min(m_skip, m_samples.available());
+                m_samples.consume(count);
+                m_consumed += count;
+                m_skip -= count;
+            }
+
+            size_t frame_count = ready_frame_count();
+            if (frame_count != 0) {
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    announce_room(false);
+                }
+                process(frame_count);
+                continue;
+            }
+
+            // Checked under the lock, which write() takes before notifying,
+            // so that no notification falls between the check and the wait.
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (has_work()) continue;
+            announce_room(true);
+            m_wake.wait(lock, [this] { return m_closing || m_producer_waiting || has_work(); });
+            if (m_closing && !m_producer_waiting && !has_work()) return;
+        }
+    }
+
+    // Moves stamps out of the ring so that the producer never waits on them
+    // for long.
+    void drain_stamps()
+    {
+        for (size_t count = m_stamps.available(); count != 0; --count) {
+            m_pending_stamps.push_back(m_stamps.peek(0));
+            m_stamps.consume(1);
+        }
+    }
+
+    // When the sample that makes the stream end samples long was written.
+    Clock::time_point written_time(size_t end)
+    {
+        if (m_pending_stamps.empty() || m_pending_stamps.back().end < end) drain_stamps();
+        while (m_pending_stamps.front().end < end) {
+            m_pending_stamps.pop_front();
+        }
+        return m_pending_stamps.front().time;
+    }
+
+    void process(size_t frame_count)
+    {
+        size_t const N = m_frame_size;
+
+        for (size_t f = 0; f != frame_count; ++f) {
+            for (size_t n = 0; n != N; ++n) {
+                pack_real_sample(&m_frames[0], N, f, n, m_samples.peek(f*m_hop_size + n)*m_window[n]);
+            }
+        }
+
+        Clock::time_point start = Clock::now();
+        m_transform(&m_spectra[0], &m_frames[0], N, (frame_count + 1)/2);
+        unpack_real_spectra(&m_bins[0], &m_spectra[0], N, frame_count);
+        double transform_ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count()/frame_count;
+
+        for (size_t f = 0; f != frame_count; ++f) {
+            size_t first_sample = m_consumed + f*m_hop_size;
+            double latency_ns = std::chrono::duration<double, std::nano>(Clock::now() - written_time(first_sample + N)).count();
+
+            StftFrame frame{m_frame_count, first_sample, &m_bins[f*bin_count()], bin_count(), latency_ns, transform_ns};
+            m_callback(frame);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_frame_count;
+            m_latency_sum_ns += latency_ns;
+            m_max_latency_ns = std::max(m_max_latency_ns, latency_ns);
+            m_transform_sum_ns += transform_ns;
+        }
+
+        m_skip = frame_count*m_hop_size;
+    }
+
+    size_t m_frame_size;
+    size_t m_hop_size;
+    size_t m_max_batch;
+    RealSignal m_window;
+    FrameCallback m_callback;
+    BatchTransform m_transform;
+    RingBuffer<Float> m_samples;
+    RingBuffer<Stamp> m_stamps;
+    // Producer only.
+    size_t m_written;
+    // Worker only.
+    size_t m_consumed;
+    size_t m_skip;
+    std::deque<Stamp> m_pending_stamps;
+    // Guarded by m_mutex.
+    size_t m_frame_count;
+    double m_latency_sum_ns;
+    double m_max_latency_ns;
+    double m_transform_sum_ns;
+    bool m_closing;
+    bool m_producer_waiting;
+    mutable std::mutex m_mutex;
+    // Worker waits for samples, producer for room.
+    std::condition_variable m_wake;
+    std::condition_variable m_room;
+    // Frames packed in pairs, see pack_real_sample().
+    Signal m_frames;
+    Signal m_spectra;
+    Signal m_bins;
+    std::thread m_worker;
+};
+
+static void fatal(std::string const& msg) __attribute__((noreturn));
+
+// A file mapped into memory: read-only, or read-write and resized to
+// byte_count bytes, creating it if needed.
+class MappedFile : private boost::noncopyable
+{
+public:
+    explicit MappedFile(std::string const& path)
+        : m_path(path)
+    {
+        m_fd = open(path.c_str(), O_RDONLY);
+        if (m_fd < 0) fatal("Could not open " + path + ".");
+
+        struct stat st;
+        if (fstat(m_fd, &st) != 0) fatal("Could not stat " + path + ".");
+        map((size_t) st.st_size, PROT_READ);
+    }
+
+    MappedFile(std::string const& path, size_t byte_count)
+        : m_path(path)
+    {
+        m_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (m_fd < 0) fatal("Could not open " + path + ".");
+        if (ftruncate(m_fd, (off_t) byte_count) != 0) fatal("Could not resize " + path + ".");
+        map(byte_count, PROT_READ | PROT_WRITE);
+    }
+
+    ~MappedFile()
+    {
+        if (m_data != NULL && munmap(m_data, m_byte_count) != 0) fatal("Could not unmap " + m_path + ".");
+        if (close(m_fd) != 0) fatal("Could not close " + m_path + ".");
+    }
+
+    char* data() const
+    {
+        return static_cast<char*>(m_data);
+    }
+
+    size_t byte_count() const
+    {
+        return m_byte_count;
+    }
+
+    // Tells the kernel the file will be read in order, for more readahead.
+    void advise_sequential()
+    {
+        if (m_data != NULL) madvise(m_data, m_byte_count, MADV_SEQUENTIAL);
+    }
+
+    // Writes the modified pages back to the file.
+    void sync()
+    {
+        if (m_data != NULL && msync(m_data, m_byte_count, MS_SYNC) != 0) fatal("Could not sync " + m_path + ".");
+    }
+
+    // Starts writing back bytes [offset, offset + count) and unmaps their
+    // pages, which stay in the page cache until the kernel needs the memory.
+    void release(size_t offset, size_t count)
+    {
+        size_t const page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t first = offset/page*page;
+        size_t last = std::min(m_byte_count, offset + count);
+        if (m_data == NULL || last <= first) return;
+        if (msync(data() + first, last - first, MS_ASYNC) != 0) fatal("Could not sync " + m_path + ".");
+        madvise(data() + first, last - first, MADV_DONTNEED);
+    }
+
+private:
+    void map(size_t byte_count, int protection)
+    {
+        m_byte_count = byte_count;
+        m_data = NULL;
+        if (byte_count == 0) return;
+
+        m_data = mmap(NULL, byte_count, protection, MAP_SHARED, m_fd, 0);
+        if (m_data == MAP_FAILED) fatal("Could not map " + m_path + ".");
+    }
+
+    std::string m_path;
+    int m_fd;
+    void* m_data;
+    size_t m_byte_count;
+};
+
+// Four-step transform of a file of N = 2^k complex samples into another,
+// for signals larger than memory. The samples are an R x C row-major matrix,
+// R*C = N with R and C within a factor of two of each other.
+//
+// The first pass transforms the columns, a panel of adjacent columns at a
+// time: it gathers the panel, runs R-point transforms, multiplies by the
+// twiddles W(c*k1, N) and writes the panel as rows of a C x R matrix in the
+// output file. The second pass transforms the columns of that matrix in
+// place, after which sample k1 + R*k2 of the spectrum is at k2*R + k1, in
+// order.
+//
+// Panels are as wide as memory_budget allows for their two host buffers, so
+// the allocated working set stays within the budget whatever the file size;
+// the mapped files only take page cache, which the kernel reclaims as
+// needed. Panels of 512 or more columns read whole pages from the strided
+// columns. The sub-transforms go through transform, which may run them on a
+// device: it sees batches of at most panel_width() transforms of R or C
+// samples.
+class OutOfCoreFft : private boost::noncopyable
+{
+public:
+    // batch_count transforms of N samples, stored back to back, like
+    // fft_batch() or a lambda around Fourier::fft_batch.
+    typedef std::function<void(Complex* spectra, Complex const* signals, size_t N, size_t batch_count)> BatchTransform;
+
+    explicit OutOfCoreFft(size_t memory_budget, BatchTransform transform = fft_batch)
+        : m_memory_budget(memory_budget)
+        , m_transform(transform)
+    {
+    }
+
+    // Writes the spectrum of the samples in signal_path to spectrum_path,
+    // which must be a different file.
+    void fft(std::string const& signal_path, std::string const& spectrum_path)
+    {
+        transform(signal_path, spectrum_path, false);
+    }
+
+    // Writes the signal of the spectrum in spectrum_path, scaled by 1/N, to
+    // signal_path: the conjugate of the forward transform of the conjugate.
+    void ifft(std::string const& spectrum_path, std::string const& signal_path)
+    {
+        transform(spectrum_path, signal_path, true);
+    }
+
+    // Columns per panel for a transform of N samples.
+    size_t panel_width(size_t N) const
+    {
+        size_t const R = row_count(N);
+        size_t const C = N/R;
+        size_t const longest = std::max(R, C);
+
+        size_t width = 1;
+        while (2*width <= std::min(R, C) && 2*(2*width)*longest*sizeof(Complex) <= m_memory_budget) {
+            width *= 2;
+        }
+        return width;
+    }
+
+private:
+    static size_t row_count(size_t N)
+    {
+        size_t R = 1;
+        while (R*R < N) R *= 2;
+        return R;
+    }
+
+    void transform(std::string const& in_path, std::string const& out_path, bool inverse)
+    {
+        MappedFile in(in_path);
+        if (in.byte_count() % sizeof(Complex) != 0) fatal(in_path + " is not a whole number of complex samples.");
+        size_t const N = in.byte_count()/sizeof(Complex);
+        if (!is_power_of_two(N)) fatal(in_path + " does not hold a power of two samples.");
+
+        MappedFile out(out_path, in.byte_count());
+        Complex const* x = reinterpret_cast<Complex const*>(in.data());
+        Complex* y = reinterpret_cast<Complex*>(out.data());
+
+        size_t const R = row_count(N);
+        size_t const C = N/R;
+        size_t const width = panel_width(N);
+        Signal panel(width*std::max(R, C));
+        Signal spectra(panel.size());
+        Twiddles twiddles(N);
+
+        // Columns c0 to c0 + width of x, R points each, twiddled into rows c0
+        // to c0 + width of y.
+        for (size_t c0 = 0; c0 != C; c0 += width) {
+            transpose(&panel[0], R, x + c0, C, R, width);
+            if (inverse) conjugate(&panel[0], width*R);
+            m_transform(&spectra[0], &panel[0], R, width);
+
+            for (size_t p = 0; p != width; ++p) {
+                Complex* row = &spectra[p*R];
+                for (size_t k1 = 0; k1 != R; ++k1) {
+                    row[k1] *= twiddles((c0 + p)*k1);
+                }
+            }
+            std::copy(&spectra[0], &spectra[width*R], y + c0*R);
+            out.release(c0*R*sizeof(Complex), width*R*sizeof(Complex));
+        }
+
+        // Columns k0 to k0 + width of y, C points each, in place.
+        Float const scale = inverse ? (Float) 1.0/N : 1;
+        for (size_t k0 = 0; k0 != R; k0 += width) {
+            transpose(&panel[0], C, y + k0, R, C, width);
+            m_transform(&spectra[0], &panel[0], C, width);
+            if (inverse) {
+                conjugate(&spectra[0], width*C);
+                for (size_t i = 0; i != width*C; ++i) {
+                    spectra[i] *= scale;
+                }
+            }
+            transpose(y + k0, R, &spectra[0], C, width, C);
+        }
+
+        out.sync();
+    }
+
+    static void conjugate(Complex* data, size_t count)
+    {
+        for (size_t i = 0; i != count; ++i) {
+            data[i] = std::conj(data[i]);
+        }
+    }
+
+    // W(m, N) for 0 <= m < N, as the product of two tables of about sqrt(N)
+    // entries each, computed in double so that it stays accurate for 2^32
+    // samples.
+    class Twiddles
+    {
+    public:
+        explicit Twiddles(size_t N)
+            : m_low_bits(0)
+        {
+            while (((size_t) 1 << (2*m_low_bits)) < N) ++m_low_bits;
+            m_low.resize((size_t) 1 << m_low_bits);
+            m_high.resize(N >> m_low_bits);
+            for (size_t m = 0; m != m_low.size(); ++m) {
+                m_low[m] = std::polar(1.0, -2*M_PI*m/N);
+            }
+            for (size_t m = 0; m != m_high.size(); ++m) {
+                m_high[m] = std::polar(1.0, -2*M_PI*(m << m_low_bits)/N);
+            }
+        }
+
+        Complex operator()(size_t m) const
+        {
+            std::complex<double> w = m_high[m >> m_low_bits]*m_low[m & (m_low.size() - 1)];
+            return Complex((Float) w.real(), (Float) w.imag());
+        }
+
+    private:
+        size_t m_low_bits;
+        std::vector<std::complex<double>> m_low;
+        std::vector<std::complex<double>> m_high;
+    };
+
+    size_t m_memory_budget;
+    BatchTransform m_transform;
+};
+
+// Layouts of raw sample files: interleaved I/Q pairs or real samples, as
+// float32 or full-scale int16 in host byte order.
+enum class SampleFormat
+{
+    ComplexFloat32,
+    ComplexInt16,
+    RealFloat32,
+    RealInt16,
+};
+
+static bool is_complex(SampleFormat format)
+{
+    return format == SampleFormat::ComplexFloat32 || format == SampleFormat::ComplexInt16;
+}
+
+static size_t sample_byte_count(SampleFormat format)
+{
+    switch (format) {
+    case SampleFormat::ComplexFloat32: return 2*sizeof(float);
+    case SampleFormat::ComplexInt16: return 2*sizeof(int16_t);
+    case SampleFormat::RealFloat32: return sizeof(float);
+    case SampleFormat::RealInt16: return sizeof(int16_t);
+    }
+    return 0;
+}
+
+// Reads count samples of format from raw into out.
+static void convert_samples(Complex* out, char const* raw, size_t count, SampleFormat format)
+{
+    Float const int16_scale = (Float) 1.0/32768;
+    switch (format) {
+    case SampleFormat::ComplexFloat32:
+        std::memcpy((void*) out, raw, count*sizeof(Complex));
+        break;
+    case SampleFormat::ComplexInt16:
+        for (size_t i = 0; i != count; ++i) {
+            int16_t iq[2];
+            std::memcpy(iq, raw + 4*i, sizeof(iq));
+            out[i] = Complex(int16_scale*iq[0], int16_scale*iq[1]);
+        }
+        break;
+    case SampleFormat::RealFloat32:
+        for (size_t i = 0; i != count; ++i) {
+            float x;
+            std::memcpy(&x, raw + 4*i, sizeof(x));
+            out[i] = x;
+        }
+        break;
+    case SampleFormat::RealInt16:
+        for (size_t i = 0; i != count; ++i) {
+            int16_t x;
+            std::memcpy(&x, raw + 2*i, sizeof(x));
+            out[i] = int16_scale*x;
+        }
+        break;
+    }
+}
+
+struct SampleFileOptions
+{
+    SampleFormat format;
+    size_t frame_size;
+    size_t hop_size;
+    // Frames per call of the transform.
+    size_t batch_size;
+    Window window;
+    // Whether to write |X| rather than X.
+    bool magnitude;
+};
+
+struct SampleFileStats
+{
+    size_t frame_count;
+    size_t bytes_read;
+    size_t bytes_written;
+    double seconds;
+};
+
+// Transforms the frames of frame_size samples every hop_size samples of a
+// raw sample file, windowed, into a raw stream of their bins: interleaved
+// float32 pairs, or float32 magnitudes. Complex input gives frame_size bins
+// per frame and real input the frame_size/2 + 1 non-redundant ones. Samples
+// after the last whole frame are dropped.
+//
+// The input is memory-mapped. A reader thread converts batches of frames
+// into one of a few buffer slots, the calling thread transforms them with
+// transform, and a writer thread formats and writes them, with the slots
+// passed between the three through blocking queues so that reading,
+// computing and writing overlap. Real frames are packed in pairs, as in
+// StftStream.
+static SampleFileStats process_sample_file(
+        SampleFileOptions const& options,
+        std::string const& in_path,
+        std::string const& out_path,
+        StftStream::BatchTransform transform = fft_batch)
+{
+    size_t const N = options.frame_size;
+    size_t const hop = options.hop_size;
+    size_t const batch_size = options.batch_size;
+    size_t const sample_bytes = sample_byte_count(options.format);
+    bool const real = !is_complex(options.format);
+    size_t const bin_count = real ? N/2 + 1 : N;
+    // Complex signals per batch.
+    size_t const signal_count = real ? (batch_size + 1)/2 : batch_size;
+    assert(N >= 1 && hop >= 1 && batch_size >= 1);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    MappedFile in(in_path);
+    in.advise_sequential();
+    size_t const sample_count = in.byte_count()/sample_bytes;
+    size_t const frame_count = sample_count < N ? 0 : 1 + (sample_count - N)/hop;
+
+    std::FILE* out = std::fopen(out_path.c_str(), "wb");
+    if (out == NULL) fatal("Could not open " + out_path + ".");
+
+    struct Slot
+    {
+        Signal frames;
+        Signal spectra;
+        // The bins of real frames, unpacked from spectra.
+        Signal bins;
+        RealSignal output;
+        size_t frame_count;
+    };
+    size_t const slot_count = 4;
+    // Marks the end of the stream in place of a slot index.
+    size_t const end = slot_count;
+    std::vector<Slot> slots(slot_count);
+    for (Slot& slot : slots) {
+        slot.frames.resize(signal_count*N);
+        slot.spectra.resize(signal_count*N);
+        if (real) slot.bins.resize(batch_size*bin_count);
+    }
+
+    // Only a few slots cross per batch, so the threads that wait for one
+    // sleep rather than spin, leaving the core to the ones with work.
+    struct SlotQueue
+    {
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<size_t> slots;
+    };
+    SlotQueue free_slots;
+    SlotQueue read_slots;
+    SlotQueue transformed_slots;
+    auto push = [](SlotQueue& queue, size_t slot) {
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.slots.push_back(slot);
+        }
+        queue.ready.notify_one();
+    };
+    auto pop = [](SlotQueue& queue) {
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        queue.ready.wait(lock, [&] { return !queue.slots.empty(); });
+        size_t slot = queue.slots.front();
+        queue.slots.pop_front();
+        return slot;
+    };
+    for (size_t s = 0; s != slot_count; ++s) {
+        push(free_slots, s);
+    }
+
+    RealSignal window = make_window(options.window, N);
+    std::thread reader([&] {
+        size_t released = 0;
+        Signal real_frame(real ? N : 0);
+        for (size_t first = 0; first < frame_count; first += batch_size) {
+            Slot& slot = slots[pop(free_slots)];
+            slot.frame_count = std::min(batch_size, frame_count - first);
+            for (size_t f = 0; f != slot.frame_count; ++f) {
+                Complex* frame = real ? &real_frame[0] : &slot.frames[f*N];
+                convert_samples(frame, in.data() + (first + f)*hop*sample_bytes, N, options.format);
+                if (options.window != Window::Rectangular) {
+                    for (size_t n = 0; n != N; ++n) {
+                        frame[n] *= window[n];
+                    }
+                }
+                if (real) {
+                    for (size_t n = 0; n != N; ++n) {
+                        pack_real_sample(&slot.frames[0], N, f, n, frame[n].real());
+                    }
+                }
+            }
+            push(read_slots, &slot - &slots[0]);
+
+            // Input before the next batch is not read again.
+            size_t next = std::min(first + batch_size, frame_count)*hop*sample_bytes;
+            if (next > released) {
+                in.release(released, next - released);
+                released = next;
+            }
+        }
+        push(read_slots, end);
+    });
+
+    size_t bytes_written = 0;
+    std::thread writer([&] {
+        for (size_t s = pop(transformed_slots); s != end; s = pop(transformed_slots)) {
+            Slot& slot = slots[s];
+            size_t const values_per_bin = options.magnitude ? 1 : 2;
+            slot.output.resize(slot.frame_count*bin_count*values_per_bin);
+            float* output = &slot.output[0];
+            for (size_t f = 0; f != slot.frame_count; ++f) {
+                Complex const* bins = real ? &slot.bins[f*bin_count] : &slot.spectra[f*N];
+                for (size_t k = 0; k != bin_count; ++k) {
+                    if (options.magnitude) {
+                        // std::abs() guards against overflow with hypot(),
+                        // which is several times slower.
+                        *output++ = std::sqrt(std::norm(bins[k]));
+                    }
+                    else {
+                        *output++ = bins[k].real();
+                        *output++ = bins[k].imag();
+                    }
+                }
+            }
+
+            size_t const byte_count = slot.output.size()*sizeof(float);
+            if (std::fwrite(&slot.output[0], 1, byte_count, out) != byte_count) fatal("Could not write " + out_path + ".");
+            bytes_written += byte_count;
+            push(free_slots, s);
+        }
+    });
+
+    for (size_t s = pop(read_slots); s != end; s = pop(read_slots)) {
+        Slot& slot = slots[s];
+        if (real) {
+            transform(&slot.spectra[0], &slot.frames[0], N, (slot.frame_count + 1)/2);
+            unpack_real_spectra(&slot.bins[0], &slot.spectra[0], N, slot.frame_count);
+        }
+        else {
+            transform(&slot.spectra[0], &slot.frames[0], N, slot.frame_count);
+        }
+        push(transformed_slots, s);
+    }
+    push(transformed_slots, end);
+
+    reader.join();
+    writer.join();
+    if (std::fclose(out) != 0) fatal("Could not close " + out_path + ".");
+
+    return SampleFileStats{
+        frame_count,
+        frame_count == 0 ? 0 : ((frame_count - 1)*hop + N)*sample_bytes,
+        bytes_written,
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()};
+}
+
+// RMS of error signal.
+static Float error(Signal const& a, Signal const& b)
+{
+    assert(a.size() == b.size());
+
+    Float sum = 0;
+    for (size_t i = 0; i != a.size(); ++i) {
+        Complex e = a[i] - b[i];
+        sum += std::real(dot(e, e));
+    }
+    return sqrt(sum/a.size());
+}
+
+static Float prop_inverse_dft(Signal const& test_signal)
+{
+    return error(test_signal, idft(dft(test_signal)));
+}
+
+static Float prop_inverse_fft(Signal const& test_signal)
+{
+    return error(test_signal, ifft(fft(test_signal)));
+}
+
+static Float prop_dft_equal_fft(Signal const& test_signal)
+{
+    return error(dft(test_signal), fft(test_signal));
+}
+
+static Float prop_idft_equal_ifft(Signal const& test_signal)
+{
+    return error(idft(test_signal), ifft(test_signal));
+}
+
+static Float prop_plan_equal_fft(Signal const& test_signal)
+{
+    FftPlan plan(test_signal.size());
+
+    Signal spectrum(test_signal.size());
+    plan.fft(&spectrum[0], &test_signal[0]);
+
+    return error(fft_radix2(test_signal), spectrum);
+}
+
+static Float prop_plan_equal_ifft(Signal const& test_signal)
+{
+    FftPlan plan(test_signal.size());
+
+    Signal signal(test_signal.size());
+    plan.ifft(&signal[0], &test_signal[0]);
+
+    return error(ifft_radix2(test_signal), signal);
+}
+
+static Float prop_inplace_fft_equal_fft(Signal const& test_signal)
+{
+    Signal spectrum = test_signal;
+    fft(&spectrum[0], spectrum.size());
+
+    return error(fft(test_signal), spectrum);
+}
+
+static Float prop_inplace_inverse_fft(Signal const& test_signal)
+{
+    Signal signal = test_signal;
+    fft(&signal[0], signal.size());
+    ifft(&signal[0], signal.size());
+
+    return error(test_signal, signal);
+}
+
+static Float prop_parallel_fft_equal_fft(ThreadPool& pool, Signal const& test_signal)
+{
+    FftPlan plan(test_signal.size());
+
+    Signal expected(test_signal.size());
+    plan.fft(&expected[0], &test_signal[0]);
+
+    Signal actual(test_signal.size());
+    plan.fft(&actual[0], &test_signal[0], pool);
+
+    return error(expected, actual);
+}
+
+static Float prop_parallel_inplace_inverse_fft(ThreadPool& pool, Signal const& test_signal)
+{
+    FftPlan plan(test_signal.size());
+
+    Signal signal = test_signal;
+    plan.fft(&signal[0], &signal[0], pool);
+    plan.ifft(&signal[0], &signal[0], pool);
+
+    return error(test_signal, signal);
+}
+
+static Float prop_kernel_fft_equal_scalar_fft(Radix4Kernel const& kernel, Signal const& test_signal)
+{
+    FftPlan scalar_plan(test_signal.size(), radix4_kernels().front());
+    FftPlan plan(test_signal.size(), kernel);
+
+    Signal expected(test_signal.size());
+    scalar_plan.fft(&expected[0], &test_signal[0]);
+
+    Signal actual(test_signal.size());
+    plan.fft(&actual[0], &test_signal[0]);
+
+    return error(expected, actual);
+}
+
+static Float prop_kernel_ifft_equal_scalar_ifft(Radix4Kernel const& kernel, Signal const& test_signal)
+{
+    FftPlan scalar_plan(test_signal.size(), radix4_kernels().front());
+    FftPlan plan(test_signal.size(), kernel);
+
+    Signal expected(test_signal.size());
+    scalar_plan.ifft(&expected[0], &test_signal[0]);
+
+    Signal actual(test_signal.size());
+    plan.ifft(&actual[0], &test_signal[0]);
+
+    return error(expected, actual);
+}
+
+static Float prop_codelet_equal_dft(Signal const& test_signal)
+{
+    Signal spectrum = test_signal;
+    codelet(test_signal.size(), false)(&spectrum[0], &spectrum[0]);
+
+    return error(dft(test_signal), spectrum);
+}
+
+static Float prop_codelet_equal_idft(Signal const& test_signal)
+{
+    Signal signal(test_signal.size());
+    codelet(test_signal.size(), true)(&signal[0], &test_signal[0]);
+
+    return error(idft(test_signal), signal);
+}
+
+static Float prop_codelet_plan_equal_plan(Signal const& test_signal)
+{
+    FftPlan plan(test_signal.size(), best_radix4_kernel(), false);
+    FftPlan codelet_plan(test_signal.size());
+
+    Signal expected(test_signal.size());
+    plan.fft(&expected[0], &test_signal[0]);
+    plan.ifft(&expected[0], &expected[0]);
+    plan.fft(&expected[0], &expected[0]);
+
+    Signal actual(test_signal.size());
+    codelet_plan.fft(&actual[0], &test_signal[0]);
+    codelet_plan.ifft(&actual[0], &actual[0]);
+    codelet_plan.fft(&actual[0], &actual[0]);
+
+    return error(expected, actual);
+}
+
+static Float prop_fft_is_decomposed_dft(Signal const& test_signal)
+{
+    Signal even_samples;
+    Signal odd_samples;
+
+    // Partition even and odd samples.
+    for (size_t i = 0; i != test_signal.size()/2; ++i) {
+        even_samples.push_back(test_signal[2*i]);
+        odd_samples.push_back(test_signal[2*i + 1]);
+    }
+
+    Signal even_spectrum = dft(even_samples);
+    Signal odd_spectrum = dft(odd_samples);
+
+    Signal intermediate_spectrum;
+    intermediate_spectrum.insert(intermediate_spectrum.end(), even_spectrum.begin(), even_spectrum.end());
+    intermediate_spectrum.insert(intermediate_spectrum.end(), odd_spectrum.begin(), odd_spectrum.end());
+
+    fft_step_spectrum(&intermediate_spectrum[0], intermediate_spectrum.size());
+
+    return error(dft(test_signal), intermediate_spectrum);
+}
+
+static bool prop_reverse_bits(size_t n, size_t max, size_t correct)
+{
+    return reverse_bits(n, max) == correct;
+}
+
+#define TEST_RESIDUE(signal) test_residue(#signal, signal)
+
+static void test_residue(const char* test_name, Float residue)
+{
+    if (residue < eps) {
+        std::cout << test_name << ": PASS: residue=" << residue << std::endl;
+    }
+    else {
+        std::cout << test_name << ": FAIL: residue=" << residue << std::endl;
+    }
+}
+
+#define TEST(prop) test(#prop, prop)
+
+static void test(const char* test_name, bool result)
+{
+    if (result) {
+        std::cout << test_name << ": PASS" << std::endl;
+    }
+    else {
+        std::cout << test_name << ": FAIL" << std::endl;
+    }
+}
+
+static Signal random_signal(size_t size)
+{
+    static std::default_random_engine generator(0);
+    std::uniform_real_distribution<Float> distribution(0.0, 1.0);
+
+    Signal result(size);
+    for (size_t i = 0; i != result.size(); ++i) {
+        result[i] = Complex(distribution(generator), distribution(generator));
+    }
+    return result;
+}
+
+static RealSignal random_real_signal(size_t size)
+{
+    static std::default_random_engine generator(0);
+    std::uniform_real_distribution<Float> distribution(0.0, 1.0);
+
+    RealSignal result(size);
+    for (size_t i = 0; i != result.size(); ++i) {
+        result[i] = distribution(generator);
+    }
+    return result;
+}
+
+#if defined(FOURIER_COUNT_ALLOCATIONS)
+// Calls of operator new, counted by the replacements below so that
+// prop_steady_state_does_not_allocate() can see every heap allocation
+// besides BufferPool's. Test builds only, since they replace the global
+// allocator. They stay out of line, where GCC cannot mistake the free() for
+// one of memory from new.
+static std::atomic<size_t> operator_new_count(0);
+
+static size_t operator_new_calls()
+{
+    return operator_new_count.load();
+}
+
+__attribute__((noinline)) void* operator new(size_t byte_count)
+{
+    operator_new_count.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(byte_count != 0 ? byte_count : 1)) return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+#else
+// Without the replacements only BufferPool's allocations are seen.
+static size_t operator_new_calls()
+{
+    return 0;
+}
+#endif
+
+// Once a first pass has filled the plan caches and the buffer pool, passes
+// of transforms on signals of the same sizes allocate nothing.
+static bool prop_steady_state_does_not_allocate()
+{
+    Signal signal = random_signal(1024);
+    RealSignal real_signal = random_real_signal(1024);
+    auto pass = [&] {
+        Signal spectrum = fft(signal);
+        Signal inverse = ifft(spectrum);
+        fft(&spectrum[0], 1024);
+        Signal any_size = fft(Signal(signal.begin(), signal.begin() + 1000));
+        Signal small = fft(Signal(signal.begin(), signal.begin() + 64));
+        Signal naive = dft(small);
+
+        Signal spectra(8*128);
+        fft_batch(&spectra[0], &signal[0], 128, 8);
+        ifft_batch(&spectra[0], &spectra[0], 128, 8);
+
+        Signal half_spectrum(513);
+        rfft(&half_spectrum[0], &real_signal[0], 1024);
+        RealSignal real_inverse(1024);
+        irfft(&real_inverse[0], &half_spectrum[0], 1024);
+        Signal noise = random_signal(100);
+    };
+
+    pass();
+    size_t const news = operator_new_calls();
+    size_t const blocks = BufferPool::system_allocation_count();
+    for (size_t r = 0; r != 10; ++r) {
+        pass();
+    }
+
+    return operator_new_calls() == news && BufferPool::system_allocation_count() == blocks;
+}
+
+// Blocks of a thread that exits serve later allocations on other threads.
+static bool prop_exited_threads_share_blocks()
+{
+    size_t const N = 300000;
+    BufferPool::trim();
+    std::thread([] { Signal signal(N); }).join();
+
+    size_t const blocks = BufferPool::system_allocation_count();
+    Signal signal(N);
+    return BufferPool::system_allocation_count() == blocks;
+}
+
+// Signals of any size start on a 64-byte boundary.
+static bool prop_signals_are_aligned()
+{
+    bool aligned = true;
+    for (size_t N : {1, 3, 100, 1024, 5000}) {
+        Signal signal(N);
+        RealSignal real_signal(N);
+        aligned = aligned
+            && reinterpret_cast<uintptr_t>(&signal[0]) % BufferPool::alignment == 0
+            && reinterpret_cast<uintptr_t>(&real_signal[0]) % BufferPool::alignment == 0;
+    }
+    return aligned;
+}
+
+// Relative to the largest sample, since convolution sums grow with the
+// filter length.
+static Float relative_error(Signal const& expected, Signal const& actual)
+{
+    Float scale = 0;
+    for (auto& x : expected) {
+        scale = std::max(scale, std::abs(x));
+    }
+    return error(expected, actual)/std::max(scale, (Float) 1);
+}
+
+static Float prop_convolver_equals_direct(size_t signal_size, size_t filter_size, BlockMethod method, size_t fft_size = 0)
+{
+    Signal signal = random_signal(signal_size);
+    Signal filter = random_signal(filter_size);
+    FftConvolver convolver(filter, method, fft_size);
+    return relative_error(direct_convolve(signal, filter), convolver.convolve(signal));
+}
+
+static Float prop_fft_convolve_equals_direct(size_t signal_size, size_t filter_size)
+{
+    Signal signal = random_signal(signal_size);
+    Signal filter = random_signal(filter_size);
+    return relative_error(direct_convolve(signal, filter), fft_convolve(signal, filter));
+}
+
+static Float prop_fft_correlate_equals_direct(size_t signal_size, size_t pattern_size)
+{
+    Signal signal = random_signal(signal_size);
+    Signal pattern = random_signal(pattern_size);
+    return relative_error(direct_convolve(signal, correlation_filter(pattern)), fft_correlate(signal, pattern));
+}
+
+// A pattern hidden at offset in noise gives the correlation's largest
+// magnitude at lag offset, which is element offset + pattern.size() - 1.
+static bool prop_fft_correlate_finds_pattern(size_t signal_size, size_t pattern_size, size_t offset)
+{
+    Signal signal = random_signal(signal_size);
+    Signal pattern = random_signal(pattern_size);
+    for (auto& x : signal) {
+        x = (Float) 0.1*(x - Complex(0.5, 0.5));
+    }
+    for (size_t n = 0; n != pattern_size; ++n) {
+        signal[offset + n] += pattern[n];
+    }
+
+    Signal correlation = fft_correlate(signal, pattern);
+    size_t peak = 0;
+    for (size_t j = 0; j != correlation.size(); ++j) {
+        if (std::abs(correlation[j]) > std::abs(correlation[peak])) peak = j;
+    }
+    return peak == offset + pattern_size - 1;
+}
+
+static bool prop_transpose(size_t rows, size_t cols)
+{
+    Signal matrix = random_signal(rows*cols);
+    Signal transposed(rows*cols);
+    transpose(&transposed[0], &matrix[0], rows, cols);
+    for (size_t r = 0; r != rows; ++r) {
+        for (size_t c = 0; c != cols; ++c) {
+            if (transposed[c*rows + r] != matrix[r*cols + c]) return false;
+        }
+    }
+    Signal parallel(rows*cols);
+    transpose(&parallel[0], &matrix[0], rows, cols, default_thread_pool());
+    return parallel == transposed;
+}
+
+static Float prop_fft_nd_equals_strided(std::vector<size_t> const& shape)
+{
+    FftPlanNd plan(shape);
+    Signal signal = random_signal(plan.size());
+    Signal expected = signal;
+    strided_fft_nd(&expected[0], shape);
+    Signal actual(plan.size());
+    plan.fft(&actual[0], &signal[0]);
+    return relative_error(expected, actual);
+}
+
+static Float prop_inverse_fft_2d(size_t rows, size_t cols)
+{
+    Signal signal = random_signal(rows*cols);
+    Signal round_trip(rows*cols);
+    fft_2d(&round_trip[0], &signal[0], rows, cols);
+    ifft_2d(&round_trip[0], &round_trip[0], rows, cols);
+    return relative_error(signal, round_trip);
+}
+
+static Float prop_inverse_fft_3d(size_t d0, size_t d1, size_t d2)
+{
+    Signal signal = random_signal(d0*d1*d2);
+    Signal round_trip(d0*d1*d2);
+    fft_3d(&round_trip[0], &signal[0], d0, d1, d2);
+    ifft_3d(&round_trip[0], &round_trip[0], d0, d1, d2);
+    return relative_error(signal, round_trip);
+}
+
+static void write_samples(std::string const& path, Signal const& samples)
+{
+    std::ofstream f(path, std::ios::binary);
+    f.write(reinterpret_cast<char const*>(&samples[0]), samples.size()*sizeof(Complex));
+    if (!f) fatal("Could not write " + path + ".");
+}
+
+static Signal read_samples(std::string const& path)
+{
+    MappedFile file(path);
+    Complex const* samples = reinterpret_cast<Complex const*>(file.data());
+    return Signal(samples, samples + file.byte_count()/sizeof(Complex));
+}
+
+// An out-of-core transform of N random samples within memory_budget, and
+// its inverse, through files in a temporary directory.
+static Float prop_out_of_core_fft_equals_fft(
+        size_t N,
+        size_t memory_budget,
+        OutOfCoreFft::BatchTransform transform = fft_batch)
+{
+    char dir[] = "/tmp/cfourier-out-of-core-XXXXXX";
+    if (mkdtemp(dir) == NULL) fatal("Could not create temporary directory.");
+    std::string const signal_path = std::string(dir) + "/signal";
+    std::string const spectrum_path = std::string(dir) + "/spectrum";
+    std::string const inverse_path = std::string(dir) + "/inverse";
+
+    Signal signal = random_signal(N);
+    write_samples(signal_path, signal);
+
+    OutOfCoreFft out_of_core(memory_budget, transform);
+    out_of_core.fft(signal_path, spectrum_path);
+    out_of_core.ifft(spectrum_path, inverse_path);
+
+    Float residue = std::max(error(fft(signal), read_samples(spectrum_path)), error(signal, read_samples(inverse_path)));
+
+    std::remove(inverse_path.c_str());
+    std::remove(spectrum_path.c_str());
+    std::remove(signal_path.c_str());
+    rmdir(dir);
+    return residue;
+}
+
+// process_sample_file() on sample_count random samples of options.format,
+// against windowing and transforming each frame with fft().
+static Float prop_process_sample_file_equals_fft(SampleFileOptions const& options, size_t sample_count)
+{
+    char dir[] = "/tmp/cfourier-process-XXXXXX";
+    if (mkdtemp(dir) == NULL) fatal("Could not create temporary directory.");
+    std::string const in_path = std::string(dir) + "/samples";
+    std::string const out_path = std::string(dir) + "/spectra";
+
+    std::mt19937 engine(1);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::vector<char> raw(sample_count*sample_byte_count(options.format));
+    for (char& c : raw) {
+        c = (char) byte(engine);
+    }
+    if (options.format == SampleFormat::ComplexFloat32 || options.format == SampleFormat::RealFloat32) {
+        // Random bytes make poor floats.
+        Signal samples = random_signal(sample_count);
+        for (size_t i = 0; i != raw.size()/sizeof(float); ++i) {
+            float x = i % 2 == 0 ? samples[i/2].real() : samples[i/2].imag();
+            std::memcpy(&raw[i*sizeof(float)], &x, sizeof(x));
+        }
+    }
+    {
+        std::ofstream f(in_path, std::ios::binary);
+        f.write(&raw[0], raw.size());
+    }
+
+    SampleFileStats stats = process_sample_file(options, in_path, out_path);
+
+    size_t const N = options.frame_size;
+    size_t const bin_count = is_complex(options.format) ? N : N/2 + 1;
+    Signal samples(sample_count);
+    convert_samples(&samples[0], &raw[0], sample_count, options.format);
+    RealSignal window = make_window(options.window, N);
+    Signal expected;
+    for (size_t first = 0; first + N <= sample_count; first += options.hop_size) {
+        Signal frame(&samples[first], &samples[first + N]);
+        for (size_t n = 0; n != N; ++n) {
+            frame[n] *= window[n];
+        }
+        Signal spectrum = fft(frame);
+        for (size_t k = 0; k != bin_count; ++k) {
+            expected.push_back(options.magnitude ? std::abs(spectrum[k]) : spectrum[k]);
+        }
+    }
+
+    MappedFile out(out_path);
+    float const* output = reinterpret_cast<float const*>(out.data());
+    size_t const values_per_bin = options.magnitude ? 1 : 2;
+    Float residue = 0;
+    if (stats.bytes_written != out.byte_count() || out.byte_count() != expected.size()*values_per_bin*sizeof(float)) {
+        residue = 1;
+    }
+    else if (!expected.empty()) {
+        Signal actual(expected.size());
+        for (size_t i = 0; i != actual.size(); ++i) {
+            actual[i] = options.magnitude ? Complex(output[i], 0) : Complex(output[2*i], output[2*i + 1]);
+        }
+        residue = error(expected, actual);
+    }
+
+    std::remove(out_path.c_str());
+    std::remove(in_path.c_str());
+    rmdir(dir);
+    return residue;
+}
+
+static bool prop_hann_window()
+{
+    return make_window(Window::Hann, 4) == RealSignal{0, 0.5, 1, 0.5};
+}
+
+// Frames from a StftStream fed in chunks of chunk_size match windowed
+// frames cut from the whole signal and transformed one by one.
+static Float prop_stft_equals_framed_fft(
+        size_t frame_size,
+        size_t hop_size,
+        Window window,
+        size_t chunk_size,
+        size_t max_batch,
+        StftStream::BatchTransform transform = fft_batch)
+{
+    size_t const sample_count = 20*frame_size + 7;
+    RealSignal signal = random_real_signal(sample_count);
+
+    std::vector<Signal> spectra;
+    std::vector<size_t> first_samples;
+    {
+        StftStream stream(frame_size, hop_size, window, [&](StftFrame const& frame) {
+            if (frame.index != spectra.size()) return;
+            spectra.push_back(Signal(frame.spectrum, frame.spectrum + frame.bin_count));
+            first_samples.push_back(frame.first_sample);
+        }, max_batch, transform);
+
+        for (size_t start = 0; start < sample_count; start += chunk_size) {
+            stream.write(&signal[start], std::min(chunk_size, sample_count - start));
+        }
+        stream.close();
+
+        if (stream.stats().frame_count != spectra.size()) return std::numeric_limits<Float>::infinity();
+    }
+
+    size_t const frame_count = (sample_count - frame_size)/hop_size + 1;
+    if (spectra.size() != frame_count) return std::numeric_limits<Float>::infinity();
+
+    RealSignal w = make_window(window, frame_size);
+    Float residue = 0;
+    for (size_t f = 0; f != frame_count; ++f) {
+        if (first_samples[f] != f*hop_size) return std::numeric_limits<Float>::infinity();
+
+        Signal frame(frame_size);
+        for (size_t n = 0; n != frame_size; ++n) {
+            frame[n] = signal[f*hop_size + n]*w[n];
+        }
+        Signal expected = fft(frame);
+        expected.resize(frame_size/2 + 1);
+        residue = std::max(residue, error(expected, spectra[f]));
+    }
+    return residue;
+}
+
+// Writes exactly frame_count frames and closes at once, many times over, so
+// that close() lands in every part of the worker loop.
+static bool prop_stft_close_emits_every_frame(size_t frame_size, size_t hop_size, size_t frame_count, size_t repeat_count)
+{
+    size_t const sample_count = frame_size + (frame_count - 1)*hop_size;
+    RealSignal signal = random_real_signal(sample_count);
+
+    for (size_t i = 0; i != repeat_count; ++i) {
+        size_t emitted = 0;
+        StftStream stream(frame_size, hop_size, Window::Hann, [&](StftFrame const&) {
+            ++emitted;
+        });
+        stream.write(&signal[0], sample_count);
+        stream.close();
+        if (emitted != frame_count) return false;
+    }
+    return true;
+}
+
+static Float prop_rfft_equal_fft(RealSignal const& test_signal)
+{
+    size_t const N = test_signal.size();
+
+    Signal expected = fft(Signal(test_signal.begin(), test_signal.end()));
+    expected.resize(N/2 + 1);
+
+    Signal actual(N/2 + 1);
+    rfft(&actual[0], &test_signal[0], N);
+
+    return error(expected, actual);
+}
+
+static Float prop_inverse_rfft(RealSignal const& test_signal)
+{
+    size_t const N = test_signal.size();
+
+    Signal spectrum(N/2 + 1);
+    rfft(&spectrum[0], &test_signal[0], N);
+
+    RealSignal actual(N);
+    irfft(&actual[0], &spectrum[0], N);
+
+    return error(Signal(test_signal.begin(), test_signal.end()), Signal(actual.begin(), actual.end()));
+}
+
+// Real signals one float past an aligned start, which is not a Complex
+// boundary, both ways.
+static Float prop_rfft_on_unaligned_signal(size_t N)
+{
+    RealSignal signal = random_real_signal(N + 1);
+
+    Signal expected(N/2 + 1);
+    rfft(&expected[0], &RealSignal(signal.begin() + 1, signal.end())[0], N);
+
+    Signal spectrum(N/2 + 1);
+    rfft(&spectrum[0], &signal[1], N);
+
+    RealSignal inverse(N + 1);
+    irfft(&inverse[1], &spectrum[0], N);
+
+    return std::max(
+            error(expected, spectrum),
+            error(Signal(signal.begin() + 1, signal.end()), Signal(inverse.begin() + 1, inverse.end())));
+}
+
+// Batch of signals with gaps between them, transformed into spectra with
+// different gaps.
+static Float prop_fft_batch_equal_fft(size_t N, size_t batch_count)
+{
+    size_t const signal_stride = N + 3;
+    size_t const spectrum_stride = N + 5;
+    Signal signals = random_signal(batch_count*signal_stride);
+
+    Signal spectra(batch_count*spectrum_stride);
+    fft_plan(N).fft_batch(&spectra[0], &signals[0], batch_count, signal_stride, spectrum_stride, default_thread_pool());
+
+    Float residue = 0;
+    for (size_t b = 0; b != batch_count; ++b) {
+        Signal signal(&signals[b*signal_stride], &signals[b*signal_stride + N]);
+        Signal spectrum(&spectra[b*spectrum_stride], &spectra[b*spectrum_stride + N]);
+        residue = std::max(residue, error(fft(signal), spectrum));
+    }
+    return residue;
+}
+
+static Float prop_ifft_batch_inverse_fft_batch(size_t N, size_t batch_count)
+{
+    Signal signals = random_signal(batch_count*N);
+
+    Signal spectra(batch_count*N);
+    fft_batch(&spectra[0], &signals[0], N, batch_count);
+
+    Signal actual(batch_count*N);
+    ifft_batch(&actual[0], &spectra[0], N, batch_count);
+
+    return error(signals, actual);
+}
+
+static void notify(char const* errinfo, void const* private_info, size_t cb, void* user_data) __attribute__((unused));
+static void notify(char const* errinfo, void const* private_info, size_t cb, void* user_data)
+{
+    std::cout << "OpenCL error: " << errinfo << "\n";
+}
+
+static void fatal(std::string const& msg) __attribute__((noreturn));
+static void fatal(std::string const& msg)
+{
+    std::cout << "ERROR: " << msg << "\n";
+    abort();
+}
+
+static std::string error_code_to_string(cl_int ec) __attribute__((unused));
+static std::string error_code_to_string(cl_int ec)
+{
+    switch (ec) {
+        case CL_INVALID_COMMAND_QUEUE: return "CL_INVALID_COMMAND_QUEUE";
+        case CL_INVALID_CONTEXT: return "CL_INVALID_CONTEXT";
+        case CL_INVALID_DEVICE: return "CL_INVALID_DEVICE";
+        case CL_INVALID_EVENT_WAIT_LIST: return "CL_INVALID_EVENT_WAIT_LIST";
+        case CL_INVALID_GLOBAL_OFFSET: return "CL_INVALID_GLOBAL_OFFSET";
+        case CL_INVALID_GLOBAL_WORK_SIZE: return "CL_INVALID_GLOBAL_WORK_SIZE";
+        case CL_INVALID_IMAGE_SIZE: return "CL_INVALID_IMAGE_SIZE";
+        case CL_INVALID_KERNEL_ARGS: return "CL_INVALID_KERNEL_ARGS";
+        case CL_INVALID_KERNEL: return "CL_INVALID_KERNEL";
+        case CL_INVALID_PROGRAM_EXECUTABLE: return "CL_INVALID_PROGRAM_EXECUTABLE";
+        case CL_INVALID_VALUE: return "CL_INVALID_VALUE";
+        case CL_INVALID_WORK_DIMENSION: return "CL_INVALID_WORK_DIMENSION";
+        case CL_INVALID_WORK_GROUP_SIZE: return "CL_INVALID_WORK_GROUP_SIZE";
+        case CL_INVALID_WORK_ITEM_SIZE: return "CL_INVALID_WORK_ITEM_SIZE";
+        case CL_MEM_OBJECT_ALLOCATION_FAILURE: return "CL_MEM_OBJECT_ALLOCATION_FAILURE";
+        case CL_MISALIGNED_SUB_BUFFER_OFFSET: return "CL_MISALIGNED_SUB_BUFFER_OFFSET";
+        case CL_OUT_OF_HOST_MEMORY: return "CL_OUT_OF_HOST_MEMORY";
+        case CL_OUT_OF_RESOURCES: return "CL_OUT_OF_RESOURCES";
+        case CL_SUCCESS: return "CL_SUCCESS";
+        default: return "<UNKNOWN>";
+    }
+}
+
+// CL_PLATFORM_NOT_FOUND_KHR, which the ICD loader returns when no OpenCL
+// implementation is installed.
+static cl_int const platform_not_found = -1001;
+
+static std::map<cl_platform_id, std::pair<std::string, std::string>> get_platforms()
+{
+    std::map<cl_platform_id, std::pair<std::string, std::string>> result;
+
+    std::vector<cl_platform_id> platforms(16);
+    cl_uint platform_count;
+    cl_int ec = clGetPlatformIDs(platforms.size(), &platforms[0], &platform_count);
+    if (ec == platform_not_found) return result;
+    if (ec != CL_SUCCESS) fatal("Could not get platform IDs.");
+    platforms.resize(platform_count);
+
+    for (auto& platform_id : platforms) {
+        std::vector<char> platformName(64);
+        if (clGetPlatformInfo(
+                    platform_id,
+                    CL_PLATFORM_NAME,
+                    platformName.size(),
+                    &platformName[0],
+                    NULL) != CL_SUCCESS) {
+            fatal("Could not get platform name.");
+        }
+
+        std::vector<char> platformVersion(64);
+        if (clGetPlatformInfo(
+                    platform_id,
+                    CL_PLATFORM_VERSION,
+                    platformVersion.size(),
+                    &platformVersion[0],
+                    NULL) != CL_SUCCESS) {
+            fatal("Could not get platform version.");
+        }
+
+        result[platform_id] = std::make_pair(&platformName[0], &platformVersion[0]);
+    }
+
+    return result;
+}
+
+static std::map<cl_device_id, std::string> get_devices(cl_platform_id platform)
+{
+    std::map<cl_device_id, std::string> result;
+
+    std::vector<cl_device_id> devices(16);
+    cl_uint device_count;
+    cl_int ec = clGetDeviceIDs(
+            platform,
+            CL_DEVICE_TYPE_ALL,
+            devices.size(),
+            &devices[0],
+            &device_count);
+    if (ec == CL_DEVICE_NOT_FOUND) return result;
+    if (ec != CL_SUCCESS) fatal("Could not get device IDs.");
+    devices.resize(device_count);
+
+    for (auto& device_id : devices) {
+        std::vector<char> name(64);
+        if (clGetDeviceInfo(
+                device_id,
+                CL_DEVICE_NAME,
+                name.size(),
+                &name[0],
+                NULL) != CL_SUCCESS) {
+            fatal("Could not get device name.");
+        }
+
+        result[device_id] = &name[0];
+    }
+
+    return result;
+}
+
+static std::string get_device_string(cl_device_id device, cl_device_info info)
+{
+    size_t size;
+    if (clGetDeviceInfo(device, info, 0, NULL, &size) != CL_SUCCESS) {
+        fatal("Could not get device info.");
+    }
+
+    std::vector<char> value(size + 1);
+    if (clGetDeviceInfo(device, info, size, &value[0], NULL) != CL_SUCCESS) {
+        fatal("Could not get device info.");
+    }
+
+    return &value[0];
+}
+
+static void print_platforms()
+{
+    for (auto& platform : get_platforms()) {
+        std::cout
+            << platform.first
+            << ": name='" << platform.second.first
+            << "', version='" << platform.second.second
+            << "'\n";
+
+        for (auto& device : get_devices(platform.first)) {
+            std::cout
+                << "  "
+                << device.first
+                << ": name='" << device.second
+                << "'\n";
+        }
+    }
+}
+
+static cl_device_type get_device_type(cl_device_id device)
+{
+    cl_device_type type;
+    if (clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL) != CL_SUCCESS) {
+        fatal("Could not get device type.");
+    }
+    return type;
+}
+
+// Order in which device types are preferred: GPUs, then accelerators, then
+// CPU implementations such as PoCL.
+static int device_type_rank(cl_device_type type)
+{
+    if (type & CL_DEVICE_TYPE_GPU) return 0;
+    if (type & CL_DEVICE_TYPE_ACCELERATOR) return 1;
+    if (type & CL_DEVICE_TYPE_CPU) return 2;
+    return 3;
+}
+
+static cl_device_type parse_device_type(std::string const& name)
+{
+    if (name == "gpu") return CL_DEVICE_TYPE_GPU;
+    if (name == "accelerator") return CL_DEVICE_TYPE_ACCELERATOR;
+    if (name == "cpu") return CL_DEVICE_TYPE_CPU;
+    if (name == "all") return CL_DEVICE_TYPE_ALL;
+    fatal("Unknown device type: " + name);
+}
+
+// Every device Fourier may run on, most preferred first. $FOURIER_PLATFORM
+// and $FOURIER_DEVICE keep the platforms and devices whose names contain
+// them, and $FOURIER_DEVICE_TYPE (gpu, accelerator, cpu or all) keeps one
+// type. Empty when OpenCL is not installed or nothing matches.
+static std::vector<cl_device_id> find_devices()
+{
+    char const* platform_filter = getenv("FOURIER_PLATFORM");
+    char const* device_filter = getenv("FOURIER_DEVICE");
+    char const* type_filter = getenv("FOURIER_DEVICE_TYPE");
+    cl_device_type const types = type_filter != NULL ? parse_device_type(type_filter) : CL_DEVICE_TYPE_ALL;
+
+    std::vector<cl_device_id> result;
+    for (auto& platform : get_platforms()) {
+        if (platform_filter != NULL && platform.second.first.find(platform_filter) == std::string::npos) continue;
+
+        for (auto& device : get_devices(platform.first)) {
+            if (device_filter != NULL && device.second.find(device_filter) == std::string::npos) continue;
+            if ((get_device_type(device.first) & types) == 0) continue;
+            result.push_back(device.first);
+        }
+    }
+
+    std::stable_sort(result.begin(), result.end(), [](cl_device_id a, cl_device_id b) {
+        return device_type_rank(get_device_type(a)) < device_type_rank(get_device_type(b));
+    });
+    return result;
+}
+
+static cl_device_id select_device()
+{
+    std::vector<cl_device_id> devices = find_devices();
+    if (devices.empty()) fatal("Could not find an OpenCL device.");
+    return devices.front();
+}
+
+// Unused when the kernel source is embedded.
+static std::vector<char> read_program(std::string const& name) __attribute__((unused));
+static std::vector<char> read_program(std::string const& name)
+{
+    std::fstream f(name);
+    if (!f) {
+        fatal("Could not read file: " + name);
+    }
+
+    f.seekg(0, std::ios_base::end);
+    size_t size = f.tellg();
+    f.seekg(0, std::ios_base::beg);
+
+    std::vector<char> result(size);
+
+    f.read(&result[0], result.size());
+    result.push_back(0);
+    return result;
+}
+
+// Kernel source: fourier.cl compiled into the executable when Build.hs
+// generates fourier_cl.h and defines FOURIER_EMBED_SOURCE, and read from the
+// working directory otherwise. Either way it ends with a NUL.
+static std::vector<char> program_source()
+{
+#if defined(FOURIER_EMBED_SOURCE)
+    return std::vector<char>(fourier_cl_source, fourier_cl_source + sizeof(fourier_cl_source));
+#else
+    return read_program("fourier.cl");
+#endif
+}
+
+// 64-bit FNV-1a.
+static uint64_t hash_bytes(char const* data, size_t size, uint64_t hash = 0xcbf29ce484222325)
+{
+    for (size_t i = 0; i != size; ++i) {
+        hash ^= (unsigned char) data[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// Creates path and any missing parents. Returns whether it exists afterwards.
+static bool make_directories(std::string const& path)
+{
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    }
+    mkdir(path.c_str(), 0755);
+
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+// Directory for compiled program binaries: $FOURIER_CACHE_DIR, else
+// $XDG_CACHE_HOME/cfourier, else $HOME/.cache/cfourier. Empty when none can
+// be determined, which disables the cache.
+static std::string program_cache_dir()
+{
+    if (char const* dir = getenv("FOURIER_CACHE_DIR")) return dir;
+    if (char const* dir = getenv("XDG_CACHE_HOME")) return std::string(dir) + "/cfourier";
+    if (char const* dir = getenv("HOME")) return std::string(dir) + "/.cache/cfourier";
+    return "";
+}
+
+// Complex is laid out as two floats, like cl_float2, so host signals are
+// copied to and from device buffers as they are.
+static_assert(sizeof(Complex) == sizeof(cl_float2), "Complex must match cl_float2.");
+
+// File the autotuned kernel configurations are kept in: $FOURIER_TUNING_FILE,
+// or fourier.tuning in the working directory.
+static std::string tuning_file_path()
+{
+    char const* path = getenv("FOURIER_TUNING_FILE");
+    return path != NULL ? path : "fourier.tuning";
+}
+
+// Lines of the tuning file at path. Every Fourier constructor looks its line
+// up, so the file is read once and again only when its size or modification
+// time changes, or when reload is set by a writer that may have kept both.
+static std::shared_ptr<std::vector<std::string> const> tuning_file_lines(std::string const& path, bool reload = false)
+{
+    struct Entry
+    {
+        off_t size;
+        time_t mtime;
+        std::shared_ptr<std::vector<std::string> const> lines;
+    };
+    static std::mutex mutex;
+    static std::map<std::string, Entry> cache;
+
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return std::make_shared<std::vector<std::string>>();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = cache.find(path);
+    if (!reload && found != cache.end() && found->second.size == st.st_size && found->second.mtime == st.st_mtime) {
+        return found->second.lines;
+    }
+
+    auto lines = std::make_shared<std::vector<std::string>>();
+    std::ifstream f(path);
+    std::string line;
+    while (std::getline(f, line)) {
+        lines->push_back(line);
+    }
+    cache[path] = Entry{st.st_size, st.st_mtime, lines};
+    return lines;
+}
+
+// Timings of the commands enqueued on a profiling OpenClDevice, from the
+// CL_PROFILING_COMMAND_* times of their events, aggregated per label: the
+// kernel's function name, or "write", "read" or "map" for transfers.
+class ClProfiler : private boost::noncopyable
+{
+public:
+    // Commands of one label. Times are in nanoseconds.
+    struct Stats
+    {
+        // Run times go in power-of-two buckets: bucket b counts commands that
+        // ran for less than 2^(b + 1) ns and, above bucket 0, at least 2^b.
+        static size_t const bucket_count = 40;
+
+        Stats()
+            : count(0)
+            , bytes(0)
+            , submit_ns(0)
+            , wait_ns(0)
+            , run_ns(0)
+            , max_run_ns(0)
+            , run_histogram(bucket_count)
+        {
+        }
+
+        // Upper bound of the bucket holding fraction p of the run times.
+        cl_ulong run_percentile_ns(double p) const
+        {
+            size_t seen = 0;
+            for (size_t b = 0; b != bucket_count; ++b) {
+                seen += run_histogram[b];
+                if (seen >= p*count) return (cl_ulong) 2 << b;
+            }
+            return max_run_ns;
+        }
+
+        size_t count;
+        // Bytes copied, for transfers.
+        size_t bytes;
+        // Queued to submitted to the device.
+        cl_ulong submit_ns;
+        // Submitted to started, behind other commands.
+        cl_ulong wait_ns;
+        // Started to ended.
+        cl_ulong run_ns;
+        cl_ulong max_run_ns;
+        std::vector<size_t> run_histogram;
+    };
+
+    // name identifies the device in dumps.
+    explicit ClProfiler(std::string const& name)
+        : m_name(name)
+        , m_dump_interval(0)
+        , m_dump_out(NULL)
+        , m_last_dump(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~ClProfiler()
+    {
+        for (auto& command : m_pending) {
+            clReleaseEvent(command.event);
+        }
+    }
+
+    // Counts the command of event under label once it completes, with bytes
+    // copied if it is a transfer. Retains event.
+    void add(std::string const& label, cl_event event, size_t bytes = 0)
+    {
+        if (clRetainEvent(event) != CL_SUCCESS) fatal("Could not retain event.");
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back(Command{label, event, bytes});
+        // Bounds the pending list under steady load, and lets a periodic
+        // dump happen without anyone calling stats().
+        if (m_pending.size() >= 256) collect();
+        if (m_dump_out != NULL && std::chrono::steady_clock::now() - m_last_dump >= m_dump_interval) {
+            collect();
+            dump(*m_dump_out, m_name, m_stats);
+            m_last_dump = std::chrono::steady_clock::now();
+        }
+    }
+
+    // The label of kernel's commands: its function name.
+    static std::string kernel_label(cl_kernel kernel)
+    {
+        char name[256];
+        if (clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, NULL) != CL_SUCCESS) {
+            fatal("Could not get kernel name.");
+        }
+        return name;
+    }
+
+    // Stats of every command that has completed, which after a finish() is
+    // every command enqueued before it.
+    std::map<std::string, Stats> stats()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        collect();
+        return m_stats;
+    }
+
+    // Forgets the stats so far, but not the commands still running.
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        collect();
+        m_stats.clear();
+    }
+
+    // Writes the stats to out from add() whenever interval has passed since
+    // the last time. A zero interval writes on every add().
+    void set_dump_interval(std::chrono::milliseconds interval, std::ostream& out)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_dump_interval = interval;
+        m_dump_out = &out;
+    }
+
+    void dump(std::ostream& out)
+    {
+        dump(out, m_name, stats());
+    }
+
+private:
+    struct Command
+    {
+        std::string label;
+        cl_event event;
+        size_t bytes;
+    };
+
+    static void dump(std::ostream& out, std::string const& name, std::map<std::string, Stats> const& stats)
+    {
+        out << "Profile of " << name << ":\n";
+        out << "label, count, mean submit us, mean wait us, mean run us, p50 run us <=, p99 run us <=, max run us, GB/s\n";
+        for (auto const& entry : stats) {
+            Stats const& s = entry.second;
+            out
+                << entry.first << ", " << s.count << ", "
+                << 1e-3*s.submit_ns/s.count << ", "
+                << 1e-3*s.wait_ns/s.count << ", "
+                << 1e-3*s.run_ns/s.count << ", "
+                << 1e-3*s.run_percentile_ns(0.5) << ", "
+                << 1e-3*s.run_percentile_ns(0.99) << ", "
+                << 1e-3*s.max_run_ns << ", "
+                << (s.run_ns == 0 ? 0.0 : (double) s.bytes/s.run_ns) << "\n";
+        }
+    }
+
+    // Moves the completed commands into m_stats.
+    void collect()
+    {
+        auto running = std::remove_if(m_pending.begin(), m_pending.end(), [&](Command const& command) {
+            cl_int status;
+            if (clGetEventInfo(
+                    command.event,
+                    CL_EVENT_COMMAND_EXECUTION_STATUS,
+                    sizeof(status),
+                    &status,
+                    NULL) != CL_SUCCESS) {
+                fatal("Could not get event status.");
+            }
+            if (status != CL_COMPLETE) return false;
+
+            count(command);
+            if (clReleaseEvent(command.event) != CL_SUCCESS) fatal("Could not release event.");
+            return true;
+        });
+        m_pending.erase(running, m_pending.end());
+    }
+
+    void count(Command const& command)
+    {
+        cl_ulong times[4];
+        cl_profiling_info const infos[] = {
+            CL_PROFILING_COMMAND_QUEUED,
+            CL_PROFILING_COMMAND_SUBMIT,
+            CL_PROFILING_COMMAND_START,
+            CL_PROFILING_COMMAND_END,
+        };
+        for (size_t i = 0; i != 4; ++i) {
+            if (clGetEventProfilingInfo(command.event, infos[i], sizeof(times[i]), &times[i], NULL) != CL_SUCCESS) {
+                fatal("Could not get profiling info.");
+            }
+        }
+
+        Stats& s = m_stats[command.label];
+        cl_ulong run = times[3] - times[2];
+        ++s.count;
+        s.bytes += command.bytes;
+        s.submit_ns += times[1] - times[0];
+        s.wait_ns += times[2] - times[1];
+        s.run_ns += run;
+        s.max_run_ns = std::max(s.max_run_ns, run);
+
+        size_t bucket = 0;
+        while (bucket + 1 != Stats::bucket_count && run >> (bucket + 1) != 0) ++bucket;
+        ++s.run_histogram[bucket];
+    }
+
+    std::string m_name;
+    std::mutex m_mutex;
+    std::vector<Command> m_pending;
+    std::map<std::string, Stats> m_stats;
+    std::chrono::milliseconds m_dump_interval;
+    std::ostream* m_dump_out;
+    std::chrono::steady_clock::time_point m_last_dump;
+};
+
+// Whether devices profile their commands by default: when $FOURIER_PROFILE
+// is set. If it is a number of seconds, they also dump their stats to
+// stdout that often.
+static bool profiling_requested()
+{
+    return getenv("FOURIER_PROFILE") != NULL;
+}
+
+// One kernel object per entry point of a program. Arguments are state of
+// the kernel object, so clSetKernelArg and the launch that follows race when
+// two threads share one: every Fourier creates its own set.
+class OpenClKernels : private boost::noncopyable
+{
+public:
+    explicit OpenClKernels(cl_program program)
+        : init(create(program, "fft_init"))
+        , step(create(program, "fft_step"))
+        , rfft_postprocess(create(program, "rfft_postprocess"))
+        , irfft_preprocess(create(program, "irfft_preprocess"))
+        , local(create(program, "fft_local"))
+        , stockham{create(program, "stockham_radix2"), create(program, "stockham_radix4"), create(program, "stockham_radix8")}
+        , overlap_save_scatter(create(program, "overlap_save_scatter"))
+        , multiply_conj(create(program, "multiply_conj"))
+        , overlap_save_gather(create(program, "overlap_save_gather"))
+        , transpose(create(program, "transpose"))
+    {
+    }
+
+    ~OpenClKernels()
+    {
+        for (cl_kernel kernel : {init, step, rfft_postprocess, irfft_preprocess, local, overlap_save_scatter, multiply_conj, overlap_save_gather, transpose}) {
+            if (clReleaseKernel(kernel) != CL_SUCCESS) fatal("Could not release kernel.");
+        }
+        for (cl_kernel kernel : stockham) {
+            if (clReleaseKernel(kernel) != CL_SUCCESS) fatal("Could not release Stockham kernel.");
+        }
+    }
+
+    cl_kernel const init;
+    cl_kernel const step;
+    cl_kernel const rfft_postprocess;
+    cl_kernel const irfft_preprocess;
+    cl_kernel const local;
+    // Radix 2, 4 and 8.
+    cl_kernel const stockham[3];
+    cl_kernel const overlap_save_scatter;
+    cl_kernel const multiply_conj;
+    cl_kernel const overlap_save_gather;
+    cl_kernel const transpose;
+
+private:
+    static cl_kernel create(cl_program program, char const* name)
+    {
+        cl_kernel kernel = clCreateKernel(program, name, NULL);
+        if (kernel == NULL) fatal(std::string("Could not create ") + name + " kernel.");
+        return kernel;
+    }
+};
+
+// The OpenCL context, queues and compiled program of one device, shared by
+// Fourier objects of any size.
+class OpenClDevice : private boost::noncopyable
+{
+public:
+    // The preferred device of find_devices().
+    OpenClDevice()
+        : OpenClDevice(select_device())
+    {
+    }
+
+    // With profiling, every queue records command times, and Fourier objects
+    // on the device report their commands to profiler().
+    explicit OpenClDevice(cl_device_id device, bool profiling = profiling_requested())
+    {
+        cl_platform_id platform;
+        if (clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL) != CL_SUCCESS) {
+            fatal("Could not get device platform.");
+        }
+
+        m_device_name = get_device_string(device, CL_DEVICE_NAME);
+        m_driver_version = get_device_string(device, CL_DRIVER_VERSION);
+
+        cl_bool host_unified_memory;
+        if (clGetDeviceInfo(
+                device,
+                CL_DEVICE_HOST_UNIFIED_MEMORY,
+                sizeof(host_unified_memory),
+                &host_unified_memory,
+                NULL) != CL_SUCCESS) {
+            fatal("Could not get host unified memory.");
+        }
+        m_host_unified_memory = host_unified_memory;
+
+        cl_uint mem_base_addr_align;
+        if (clGetDeviceInfo(
+                device,
+                CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                sizeof(mem_base_addr_align),
+                &mem_base_addr_align,
+                NULL) != CL_SUCCESS) {
+            fatal("Could not get memory base address alignment.");
+        }
+        m_mem_base_addr_align = mem_base_addr_align/8;
+
+        cl_ulong global_mem_size;
+        if (clGetDeviceInfo(
+                device,
+                CL_DEVICE_GLOBAL_MEM_SIZE,
+                sizeof(global_mem_size),
+                &global_mem_size,
+                NULL) != CL_SUCCESS) {
+            fatal("Could not get global memory size.");
+        }
+        m_global_mem_size = global_mem_size;
+
+        cl_context_properties properties[] = { CL_CONTEXT_PLATFORM, (cl_context_properties) platform, 0 };
+        m_context = clCreateContext(properties, 1, &device, notify, NULL, NULL);
+        if (0 == m_context) fatal("Could not create contex.");
+
+        cl_command_queue_properties queue_properties = 0;
+        if (profiling) {
+            queue_properties = CL_QUEUE_PROFILING_ENABLE;
+            m_profiler.reset(new ClProfiler(m_device_name));
+            char const* seconds = getenv("FOURIER_PROFILE");
+            if (seconds != NULL && atof(seconds) > 0) {
+                m_profiler->set_dump_interval(std::chrono::milliseconds((long) (1000*atof(seconds))), std::cout);
+            }
+        }
+
+        m_queue = clCreateCommandQueue(m_context, device, queue_properties, NULL);
+        if (0 == m_queue) fatal("Could not create command queue.");
+
+        m_upload_queue = clCreateCommandQueue(m_context, device, queue_properties, NULL);
+        if (0 == m_upload_queue) fatal("Could not create upload queue.");
+
+        m_download_queue = clCreateCommandQueue(m_context, device, queue_properties, NULL);
+        if (0 == m_download_queue) fatal("Could not create download queue.");
+
+        std::vector<char> source = program_source();
+        m_program_cache_path = program_cache_path(device, &source[0]);
+        m_program_from_cache = load_program_binary(device);
+        if (!m_program_from_cache) {
+            build_program(device, &source[0]);
+            save_program_binary();
+        }
+
+        // Work-group limits are properties of the kernels, not of any one
+        // kernel object, so a throwaway set answers for every Fourier.
+        {
+            OpenClKernels kernels(m_program);
+            m_max_group_size = max_group_size(device, kernels);
+        }
+        m_max_tile_power = max_tile_power(device);
+    }
+
+    ~OpenClDevice()
+    {
+        if (clReleaseProgram(m_program) != CL_SUCCESS) fatal("Could not release program");
+        if (clUnloadCompiler() != CL_SUCCESS) fatal("Could not unload compiler.");
+        m_profiler.reset();
+        if (clReleaseCommandQueue(m_download_queue) != CL_SUCCESS) fatal("Could not release download queue.");
+        if (clReleaseCommandQueue(m_upload_queue) != CL_SUCCESS) fatal("Could not release upload queue.");
+        if (clReleaseCommandQueue(m_queue) != CL_SUCCESS) fatal("Could not release command queue.");
+        if (clReleaseContext(m_context) != CL_SUCCESS) fatal("Could not release context.");
+    }
+
+    cl_context context() const
+    {
+        return m_context;
+    }
+
+    cl_command_queue queue() const
+    {
+        return m_queue;
+    }
+
+    cl_command_queue upload_queue() const
+    {
+        return m_upload_queue;
+    }
+
+    cl_command_queue download_queue() const
+    {
+        return m_download_queue;
+    }
+
+    cl_program program() const
+    {
+        return m_program;
+    }
+
+    std::string const& device_name() const
+    {
+        return m_device_name;
+    }
+
+    std::string const& driver_version() const
+    {
+        return m_driver_version;
+    }
+
+    // Whether the device shares memory with the host.
+    bool host_unified_memory() const
+    {
+        return m_host_unified_memory;
+    }
+
+    // Bytes to which host pointers must be aligned for the device to use
+    // them in place.
+    size_t mem_base_addr_align() const
+    {
+        return m_mem_base_addr_align;
+    }
+
+    size_t global_mem_size() const
+    {
+        return m_global_mem_size;
+    }
+
+    // Largest work-group size that every transform kernel, and the transpose
+    // of FourierNd, can be launched with.
+    size_t max_group_size() const
+    {
+        return m_max_group_size;
+    }
+
+    // Largest tile of 2^max_tile_power() samples that fft_local can process.
+    size_t max_tile_power() const
+    {
+        return m_max_tile_power;
+    }
+
+    // Whether the program was loaded from the binary cache rather than
+    // built from source.
+    bool program_from_cache() const
+    {
+        return m_program_from_cache;
+    }
+
+    // Binary cache file of the program, or empty when caching is disabled.
+    std::string const& program_cache_path() const
+    {
+        return m_program_cache_path;
+    }
+
+    // Command timings of the device's queues, or NULL without profiling.
+    ClProfiler* profiler() const
+    {
+        return m_profiler.get();
+    }
+
+private:
+
+    // Build options of the program, part of the binary cache key.
+    static char const* build_options()
+    {
+        return "";
+    }
+
+    // Binary cache file named by a hash of everything the compiled program
+    // depends on: device, driver version, build options and source.
+    std::string program_cache_path(cl_device_id device, char const* source) const
+    {
+        std::string dir = program_cache_dir();
+        if (dir.empty()) return "";
+
+        // Name and driver alone do not tell apart two boards of one model
+        // with different configurations.
+        cl_uint vendor_id;
+        cl_uint compute_unit_count;
+        if (clGetDeviceInfo(device, CL_DEVICE_VENDOR_ID, sizeof(vendor_id), &vendor_id, NULL) != CL_SUCCESS) {
+            fatal("Could not get device vendor id.");
+        }
+        if (clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_unit_count), &compute_unit_count, NULL) != CL_SUCCESS) {
+            fatal("Could not get compute unit count.");
+        }
+
+        std::string key;
+        key += m_device_name + '\0';
+        key += m_driver_version + '\0';
+        key += std::to_string(vendor_id) + '\0';
+        key += std::to_string(compute_unit_count) + '\0';
+        key += std::to_string(m_global_mem_size) + '\0';
+        key += std::string(build_options()) + '\0';
+        key += source;
+
+        std::ostringstream path;
+        path << dir << "/" << std::hex << std::setw(16) << std::setfill('0')
+             << hash_bytes(key.data(), key.size()) << ".bin";
+        return path.str();
+    }
+
+    void build_program(cl_device_id device, char const* source)
+    {
+        m_program = clCreateProgramWithSource(
+                m_context,
+                1,
+                &source,
+                NULL,
+                NULL);
+        if (m_program == NULL) fatal("Could not create program.");
+
+        if (clBuildProgram(
+                    m_program,
+                    1,
+                    &device,
+                    build_options(),
+                    NULL,
+                    NULL) != CL_SUCCESS) {
+            std::vector<char> build_log(1024);
+            size_t build_log_size;
+            if (clGetProgramBuildInfo(
+                        m_program,
+                        device,
+                        CL_PROGRAM_BUILD_LOG,
+                        build_log.size(),
+                        &build_log[0],
+                        &build_log_size)
+                    != CL_SUCCESS) {
+                fatal("Could not get program build info.");
+            }
+            build_log.resize(build_log_size);
+
+            std::cout << &build_log[0];
+
+            fatal("Could not build program.");
+        }
+    }
+
+    // Creates m_program from the cached binary, if there is one the driver
+    // accepts. Anything else leaves the source build to the caller.
+    bool load_program_binary(cl_device_id device)
+    {
+        if (m_program_cache_path.empty()) return false;
+
+        std::ifstream f(m_program_cache_path, std::ios::binary);
+        if (!f) return false;
+        std::vector<unsigned char> binary((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+        if (binary.empty()) return false;
+
+        size_t size = binary.size();
+        unsigned char const* data = &binary[0];
+        cl_int binary_status;
+        cl_int ec;
+        m_program = clCreateProgramWithBinary(m_context, 1, &device, &size, &data, &binary_status, &ec);
+        if (m_program == NULL || ec != CL_SUCCESS || binary_status != CL_SUCCESS) {
+            if (m_program != NULL) clReleaseProgram(m_program);
+            m_program = NULL;
+            return false;
+        }
+
+        if (clBuildProgram(m_program, 1, &device, build_options(), NULL, NULL) != CL_SUCCESS) {
+            clReleaseProgram(m_program);
+            m_program = NULL;
+            return false;
+        }
+
+        return true;
+    }
+
+    // Stores the binary of the freshly built m_program. The cache is an
+    // optimisation, so failures only mean the next start builds again.
+    // Writing to a temporary file and renaming keeps concurrent processes
+    // from reading a partial binary.
+    void save_program_binary()
+    {
+        if (m_program_cache_path.empty()) return;
+        if (!make_directories(m_program_cache_path.substr(0, m_program_cache_path.rfind('/')))) return;
+
+        size_t size;
+        if (clGetProgramInfo(m_program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0) {
+            return;
+        }
+
+        std::vector<unsigned char> binary(size);
+        unsigned char* data = &binary[0];
+        if (clGetProgramInfo(m_program, CL_PROGRAM_BINARIES, sizeof(data), &data, NULL) != CL_SUCCESS) return;
+
+        std::string temporary = m_program_cache_path + ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream f(temporary, std::ios::binary);
+            f.write(reinterpret_cast<char const*>(data), size);
+            if (!f) {
+                f.close();
+                std::remove(temporary.c_str());
+                return;
+            }
+        }
+        if (std::rename(temporary.c_str(), m_program_cache_path.c_str()) != 0) {
+            std::remove(temporary.c_str());
+        }
+    }
+
+    size_t kernel_group_size(cl_kernel kernel, cl_device_id device)
+    {
+        size_t size;
+        if (clGetKernelWorkGroupInfo(
+                kernel,
+                device,
+                CL_KERNEL_WORK_GROUP_SIZE,
+                sizeof(size),
+                &size,
+                NULL) != CL_SUCCESS) {
+            fatal("Could not get kernel work-group size.");
+        }
+        return size;
+    }
+
+    // Largest work-group size that every transform kernel, and the transpose
+    // of FourierNd, can be launched with.
+    size_t max_group_size(cl_device_id device, OpenClKernels const& kernels)
+    {
+        size_t size;
+        if (clGetDeviceInfo(
+                device,
+                CL_DEVICE_MAX_WORK_GROUP_SIZE,
+                sizeof(size),
+                &size,
+                NULL) != CL_SUCCESS) {
+            fatal("Could not get maximum work-group size.");
+        }
+
+        size = std::min(size, kernel_group_size(kernels.init, device));
+        size = std::min(size, kernel_group_size(kernels.step, device));
+        size = std::min(size, kernel_group_size(kernels.local, device));
+        for (cl_kernel kernel : kernels.stockham) {
+            size = std::min(size, kernel_group_size(kernel, device));
+        }
+        size = std::min(size, kernel_group_size(kernels.transpose, device));
+        return size;
+    }
+
+    // Largest tile of 2^power samples that fft_local can process with one
+    // work-item per sample and the tile in local memory.
+    size_t max_tile_power(cl_device_id device)
+    {
+        cl_ulong local_mem_size;
+        if (clGetDeviceInfo(
+                device,
+                CL_DEVICE_LOCAL_MEM_SIZE,
+                sizeof(local_mem_size),
+                &local_mem_size,
+                NULL) != CL_SUCCESS) {
+            fatal("Could not get local memory size.");
+        }
+
+        size_t limit = std::min<size_t>(m_max_group_size, local_mem_size/sizeof(cl_float2));
+
+        size_t power = 0;
+        while (((size_t) 2 << power) <= limit) ++power;
+        return power;
+    }
+
+    std::string m_device_name;
+    std::string m_driver_version;
+    std::unique_ptr<ClProfiler> m_profiler;
+    bool m_host_unified_memory;
+    size_t m_mem_base_addr_align;
+    size_t m_global_mem_size;
+    std::string m_program_cache_path;
+    bool m_program_from_cache;
+    size_t m_max_group_size;
+    size_t m_max_tile_power;
+    cl_program m_program;
+    cl_command_queue m_download_queue;
+    cl_command_queue m_upload_queue;
+    cl_command_queue m_queue;
+    cl_context m_context;
+};
+
+
+class Fourier : private boost::noncopyable
+{
+public:
+    // How transform() runs the butterfly stages.
+    enum class Variant
+    {
+        // fft_init, then one fft_step launch per stage.
+        Global,
+        // One fft_local launch for the stages that fit a work-group's tile in
+        // local memory, then fft_step for the rest.
+        Local,
+        // Self-sorting radix-8 stages (and one radix-4 or radix-2 stage) with
+        // twiddles read from a per-size table, and no bit-reversal pass.
+        Stockham,
+    };
+
+    // Launch configuration of transform(), chosen by autotune().
+    struct Tuning
+    {
+        Variant variant;
+        // Largest Stockham radix as a power of two, which is also the number
+        // of samples each work-item handles per stage.
+        cl_uint radix_power;
+        // Work-group size of every launch, or 0 to leave it to the driver.
+        // Also the tile size of the Local variant, which is the largest that
+        // fits when 0.
+        size_t group_size;
+    };
+
+    explicit Fourier(size_t sample_power)
+        : Fourier(std::make_shared<OpenClDevice>(), sample_power)
+    {
+    }
+
+    // A transform of 2^sample_power samples on a device that other Fourier
+    // objects may share.
+    Fourier(std::shared_ptr<OpenClDevice> device, size_t sample_power)
+        : m_device(device)
+        , m_sample_power(sample_power)
+        , m_batch_capacity(0)
+        , m_next_slot(0)
+        , m_zero_copy(device->host_unified_memory())
+        , m_tuning{Variant::Local, 3, 0}
+        , m_kernels(device->program())
+        , m_download_queue(device->download_queue())
+        , m_upload_queue(device->upload_queue())
+        , m_queue(device->queue())
+        , m_context(device->context())
+        , m_profiler(device->profiler())
+    {
+        create_buffers(1);
+
+        load_tuning(tuning_file_path());
+    }
+
+    ~Fourier()
+    {
+        release_slots();
+        release_buffers();
+        for (auto& twiddles : m_twiddle_mems) {
+            if (clReleaseMemObject(twiddles.second) != CL_SUCCESS) fatal("Could not release twiddle buffer.");
+        }
+    }
+
+    void init(cl_mem x, cl_uint sample_power, cl_mem y, size_t batch_count = 1)
+    {
+        set_arg(m_kernels.init, 0, x);
+        set_arg(m_kernels.init, 1, sample_power);
+        set_arg(m_kernels.init, 2, y);
+
+        run_kernel(m_kernels.init, (size_t) 1 << sample_power, batch_count);
+    }
+
+    void init(Complex* dst, Complex const* src)
+    {
+        load(m_x_mem, src, sample_count());
+
+        init(m_x_mem, m_sample_power, m_y1_mem);
+
+        store(dst, m_y1_mem, sample_count());
+    }
+
+    void step(cl_mem y, cl_uint B, cl_mem y_, size_t batch_count = 1)
+    {
+        set_arg(m_kernels.step, 0, y);
+        set_arg(m_kernels.step, 1, B);
+        set_arg(m_kernels.step, 2, y_);
+
+        run_kernel(m_kernels.step, sample_count(), batch_count);
+    }
+
+    void step(Complex* dst, Complex const* src, size_t B)
+    {
+        load(m_y1_mem, src, sample_count());
+
+        step(m_y1_mem, B, m_y2_mem);
+
+        store(dst, m_y2_mem, sample_count());
+    }
+
+    void fft(Complex* spectrum, Complex const* signal)
+    {
+        if (uses_zero_copy(spectrum, signal)) {
+            zero_copy_fft(spectrum, signal);
+            return;
+        }
+
+        load(m_x_mem, signal, sample_count());
+
+        cl_mem y = transform(m_x_mem, m_sample_power, 1);
+
+        store(spectrum, y, sample_count());
+    }
+
+    // The device reads signal and writes spectrum in place through
+    // CL_MEM_USE_HOST_PTR buffers, with the last pass of the transform
+    // aimed at spectrum. On devices that share memory with the host there
+    // are no copies at all; elsewhere the driver copies as needed. Both
+    // pointers must meet the device's mem_base_addr_align().
+    void zero_copy_fft(Complex* spectrum, Complex const* signal)
+    {
+        cl_mem x = host_mem(const_cast<Complex*>(signal), CL_MEM_READ_ONLY);
+        cl_mem y = host_mem(spectrum, CL_MEM_READ_WRITE);
+
+        cl_mem result = pass_count(m_sample_power) % 2 == 1
+            ? transform(x, y, m_y2_mem, m_sample_power, 1)
+            : transform(x, m_y1_mem, y, m_sample_power, 1);
+        assert(result == y);
+        (void) result;
+
+        // Mapping makes the device's writes visible in spectrum.
+        void* mapped = map(y, CL_MAP_READ);
+        if (clEnqueueUnmapMemObject(m_queue, y, mapped, 0, NULL, NULL) != CL_SUCCESS) fatal("Could not unmap buffer.");
+        finish();
+
+        if (clReleaseMemObject(y) != CL_SUCCESS) fatal("Could not release host buffer.");
+        if (clReleaseMemObject(x) != CL_SUCCESS) fatal("Could not release host buffer.");
+    }
+
+    // Whether fft() uses zero_copy_fft(). Defaults to whether the device
+    // shares memory with the host.
+    void set_zero_copy(bool zero_copy)
+    {
+        m_zero_copy = zero_copy;
+    }
+
+    bool zero_copy() const
+    {
+        return m_zero_copy;
+    }
+
+    // Whether fft() goes through zero_copy_fft() for these pointers: only
+    // when zero_copy() is on, the transform is out of place and the device
+    // can use both pointers in place. Otherwise it loads and stores.
+    bool uses_zero_copy(Complex const* spectrum, Complex const* signal) const
+    {
+        size_t align = m_device->mem_base_addr_align();
+        return m_zero_copy
+            && spectrum != signal
+            && reinterpret_cast<uintptr_t>(spectrum) % align == 0
+            && reinterpret_cast<uintptr_t>(signal) % align == 0;
+    }
+
+    // batch_count transforms with one launch per stage for the whole batch.
+    // Signal b starts at signals + b*signal_stride and its spectrum at
+    // spectra + b*spectrum_stride; each is copied straight between host and
+    // device, with one wait at the end.
+    void fft_batch(
+            Complex* spectra,
+            Complex const* signals,
+            size_t batch_count,
+            size_t signal_stride,
+            size_t spectrum_stride)
+    {
+        enqueue_fft_batch(spectra, signals, batch_count, signal_stride, spectrum_stride);
+        finish();
+    }
+
+    // fft_batch() without the wait: the spectra are written by the next
+    // finish(), and the signals must stay valid until then.
+    void enqueue_fft_batch(
+            Complex* spectra,
+            Complex const* signals,
+            size_t batch_count,
+            size_t signal_stride,
+            size_t spectrum_stride)
+    {
+        reserve(batch_count);
+
+        for (size_t b = 0; b != batch_count; ++b) {
+            load(m_x_mem, &signals[b*signal_stride], sample_count(), b*sample_count(), CL_FALSE);
+        }
+
+        cl_mem y = transform(m_x_mem, m_sample_power, batch_count);
+
+        for (size_t b = 0; b != batch_count; ++b) {
+            store(&spectra[b*spectrum_stride], y, sample_count(), b*sample_count(), CL_FALSE);
+        }
+        flush();
+    }
+
+    // Asynchronous transforms of one signal each, pipelined over
+    // pipeline_depth sets of device buffers. Uploads go through
+    // m_upload_queue, kernels through m_queue and downloads through
+    // m_download_queue, chained by events, so that signal k + 1 can upload
+    // while signal k transforms and signal k - 1 downloads.
+    //
+    // Starts the transform of signal into spectrum. signal may be reused as
+    // soon as submit() returns. spectrum is written by complete(), or by the
+    // submit() pipeline_depth calls later that reuses the buffer set.
+    void submit(Complex* spectrum, Complex const* signal)
+    {
+        if (m_slots.empty()) create_slots();
+
+        PipelineSlot& slot = m_slots[m_next_slot];
+        m_next_slot = (m_next_slot + 1) % m_slots.size();
+        complete(slot);
+
+        std::copy(signal, signal + sample_count(), slot.x_host);
+        slot.spectrum = spectrum;
+
+        cl_event uploaded;
+        if (clEnqueueWriteBuffer(
+                    m_upload_queue,
+                    slot.x_mem,
+                    CL_FALSE,
+                    0,
+                    byte_count(),
+                    slot.x_host,
+                    0,
+                    NULL,
+                    &uploaded) != CL_SUCCESS) {
+            fatal("Could not write to buffer.");
+        }
+
+        if (clEnqueueBarrierWithWaitList(m_queue, 1, &uploaded, NULL) != CL_SUCCESS) {
+            fatal("Could not enqueue barrier.");
+        }
+        cl_mem y = transform(slot.x_mem, slot.y1_mem, slot.y2_mem, m_sample_power, 1);
+
+        cl_event transformed;
+        if (clEnqueueMarkerWithWaitList(m_queue, 0, NULL, &transformed) != CL_SUCCESS) {
+            fatal("Could not enqueue marker.");
+        }
+
+        if (clEnqueueReadBuffer(
+                    m_download_queue,
+                    y,
+                    CL_FALSE,
+                    0,
+                    byte_count(),
+                    slot.y_host,
+                    1,
+                    &transformed,
+                    &slot.downloaded) != CL_SUCCESS) {
+            fatal("Could not read buffer.");
+        }
+
+        if (m_profiler != NULL) {
+            m_profiler->add("write", uploaded, byte_count());
+            m_profiler->add("read", slot.downloaded, byte_count());
+        }
+
+        if (clReleaseEvent(uploaded) != CL_SUCCESS) fatal("Could not release event.");
+        if (clReleaseEvent(transformed) != CL_SUCCESS) fatal("Could not release event.");
+
+        if (clFlush(m_upload_queue) != CL_SUCCESS) fatal("Could not flush.");
+        flush();
+        if (clFlush(m_download_queue) != CL_SUCCESS) fatal("Could not flush.");
+    }
+
+    // Waits for every submitted transform and writes its spectrum, in
+    // submission order.
+    void complete()
+    {
+        for (size_t i = 0; i != m_slots.size(); ++i) {
+            complete(m_slots[(m_next_slot + i) % m_slots.size()]);
+        }
+    }
+
+    // sample_count() real samples to the sample_count()/2 + 1 non-redundant
+    // bins. The samples are uploaded as they are, as sample_count()/2
+    // complex values, transformed at half length and untangled by
+    // rfft_postprocess.
+    void rfft(Complex* spectrum, Float const* signal)
+    {
+        assert(m_sample_power >= 1);
+        size_t const half_count = sample_count()/2;
+
+        load_raw(m_x_mem, signal, half_count);
+
+        cl_mem z = transform(m_x_mem, m_sample_power - 1, 1);
+        cl_mem x = z == m_y1_mem ? m_y2_mem : m_y1_mem;
+
+        set_arg(m_kernels.rfft_postprocess, 0, z);
+        set_arg(m_kernels.rfft_postprocess, 1, (cl_uint) half_count);
+        set_arg(m_kernels.rfft_postprocess, 2, x);
+        run_kernel(m_kernels.rfft_postprocess, half_count + 1);
+
+        store(spectrum, x, half_count + 1);
+    }
+
+    // sample_count()/2 + 1 bins back to sample_count() real samples, scaled
+    // by 1/sample_count(). irfft_preprocess rebuilds the conjugated
+    // half-length spectrum so that the forward kernels compute the inverse;
+    // the conjugation and scaling are undone in place on the host.
+    void irfft(Float* signal, Complex const* spectrum)
+    {
+        assert(m_sample_power >= 1);
+        size_t const half_count = sample_count()/2;
+
+        load(m_x_mem, spectrum, half_count + 1);
+
+        set_arg(m_kernels.irfft_preprocess, 0, m_x_mem);
+        set_arg(m_kernels.irfft_preprocess, 1, (cl_uint) half_count);
+        set_arg(m_kernels.irfft_preprocess, 2, m_y2_mem);
+        run_kernel(m_kernels.irfft_preprocess, half_count);
+
+        cl_mem z = transform(m_y2_mem, m_sample_power - 1, 1);
+
+        store_raw(signal, z, half_count);
+
+        Float const scale = (Float) 1.0/half_count;
+        for (size_t n = 0; n != half_count; ++n) {
+            signal[2*n] *= scale;
+            signal[2*n + 1] *= -scale;
+        }
+    }
+
+    void flush()
+    {
+        if (clFlush(m_queue) != CL_SUCCESS) fatal("Could not flush.");
+    }
+
+    void finish()
+    {
+        if (clFinish(m_queue) != CL_SUCCESS) fatal("Could not finish.");
+    }
+
+    static char const* variant_name(Variant variant)
+    {
+        switch (variant) {
+        case Variant::Global: return "global";
+        case Variant::Local: return "local";
+        case Variant::Stockham: return "stockham";
+        }
+        fatal("Unknown variant.");
+    }
+
+    static bool parse_variant(std::string const& name, Variant& variant)
+    {
+        for (auto candidate : {Variant::Global, Variant::Local, Variant::Stockham}) {
+            if (name == variant_name(candidate)) {
+                variant = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void set_variant(Variant variant)
+    {
+        m_tuning.variant = variant;
+    }
+
+    Variant variant() const
+    {
+        return m_tuning.variant;
+    }
+
+    void set_tuning(Tuning const& tuning)
+    {
+        m_tuning = tuning;
+    }
+
+    Tuning const& tuning() const
+    {
+        return m_tuning;
+    }
+
+    OpenClDevice& device() const
+    {
+        return *m_device;
+    }
+
+    // Times a transform of sample_count() samples under every variant, radix
+    // and work-group size the device allows, and keeps the fastest.
+    Tuning const& autotune()
+    {
+        std::vector<size_t> group_sizes{0};
+        for (size_t size = 8; size <= std::min(m_device->max_group_size(), sample_count()); size <<= 1) {
+            group_sizes.push_back(size);
+        }
+
+        std::vector<Tuning> candidates;
+        for (size_t group_size : group_sizes) {
+            candidates.push_back(Tuning{Variant::Global, 3, group_size});
+            if (group_size <= ((size_t) 1 << m_device->max_tile_power())) {
+                candidates.push_back(Tuning{Variant::Local, 3, group_size});
+            }
+            for (cl_uint radix_power = 1; radix_power <= 3; ++radix_power) {
+                candidates.push_back(Tuning{Variant::Stockham, radix_power, group_size});
+            }
+        }
+
+        Signal x(sample_count());
+        for (size_t n = 0; n != x.size(); ++n) {
+            x[n] = Complex(n % 7, n % 5);
+        }
+        load(m_x_mem, &x[0], x.size());
+
+        Tuning best = m_tuning;
+        double best_ns = std::numeric_limits<double>::infinity();
+        for (auto& candidate : candidates) {
+            m_tuning = candidate;
+            double ns = time_transform();
+            if (ns < best_ns) {
+                best_ns = ns;
+                best = candidate;
+            }
+        }
+
+        m_tuning = best;
+        return m_tuning;
+    }
+
+    // The tuning file has one line per device, driver version and transform
+    // size: device name, driver version, sample power, variant, radix power
+    // and work-group size, separated by tabs. Applies the line for this
+    // Fourier, if there is one. Lines that do not parse, or whose tuning this
+    // device cannot launch, are skipped.
+    bool load_tuning(std::string const& path)
+    {
+        for (auto& line : *tuning_file_lines(path)) {
+            std::vector<std::string> fields = split_tuning_line(line);
+            if (fields.size() != 6 || !is_own_tuning_line(fields)) continue;
+
+            Tuning tuning;
+            size_t radix_power;
+            if (!parse_variant(fields[3], tuning.variant)) continue;
+            if (!parse_count(fields[4], radix_power) || !parse_count(fields[5], tuning.group_size)) continue;
+            if (radix_power < 1 || radix_power > 3) continue;
+            tuning.radix_power = (cl_uint) radix_power;
+            if (!is_launchable(tuning)) continue;
+
+            m_tuning = tuning;
+            return true;
+        }
+        return false;
+    }
+
+    // Writes the current tuning to path, replacing an earlier line for the
+    // same device, driver version and size.
+    void save_tuning(std::string const& path) const
+    {
+        std::vector<std::string> lines;
+        {
+            std::ifstream f(path);
+            std::string line;
+            while (std::getline(f, line)) {
+                if (!is_own_tuning_line(split_tuning_line(line))) lines.push_back(line);
+            }
+        }
+
+        std::ostringstream own;
+        own << m_device->device_name() << '\t'
+            << m_device->driver_version() << '\t'
+            << m_sample_power << '\t'
+            << variant_name(m_tuning.variant) << '\t'
+            << m_tuning.radix_power << '\t'
+            << m_tuning.group_size;
+        lines.push_back(own.str());
+
+        std::ofstream f(path);
+        for (auto& line : lines) {
+            f << line << '\n';
+        }
+        f.close();
+        if (!f) fatal("Could not write tuning file: " + path);
+        tuning_file_lines(path, true);
+    }
+
+    // work_item_count work-items along dimension 0, one row per transform of
+    // the batch along dimension 1. Work-groups span group_size work-items of
+    // one row, or the whole row if it is shorter, or are left to the
+    // implementation when group_size is 0.
+    void run_kernel(cl_kernel kernel, size_t work_item_count, size_t batch_count = 1, size_t group_size = 0)
+    {
+        cl_int ec;
+
+        size_t global_work_size[] = { work_item_count, batch_count };
+        size_t local_work_size[] = { std::min(group_size, work_item_count), 1 };
+        cl_event event;
+        ec = clEnqueueNDRangeKernel(
+                m_queue,
+                kernel,
+                2,
+                NULL,
+                global_work_size,
+                group_size == 0 ? NULL : local_work_size,
+                0,
+                NULL,
+                profiled(event));
+        if (ec != CL_SUCCESS) {
+            std::cout << error_code_to_string(ec) << "\n";
+            fatal("Could not enqueue kernel.");
+        }
+        if (m_profiler != NULL) profile(ClProfiler::kernel_label(kernel), event);
+    }
+
+    void set_arg(cl_kernel kernel, cl_uint arg_index, cl_uint arg)
+    {
+        if (clSetKernelArg(
+                    kernel,
+                    arg_index,
+                    sizeof(arg),
+                    &arg
+                    ) != CL_SUCCESS) {
+            fatal("Could not set kernel argument.");
+        }
+    }
+
+    void set_arg(cl_kernel kernel, cl_uint arg_index, cl_mem arg)
+    {
+        if (clSetKernelArg(
+                    kernel,
+                    arg_index,
+                    sizeof(arg),
+                    &arg
+                    ) != CL_SUCCESS) {
+            fatal("Could not set kernel argument.");
+        }
+    }
+
+    // Allocates byte_count bytes of local memory for a local pointer argument.
+    void set_local_arg(cl_kernel kernel, cl_uint arg_index, size_t byte_count)
+    {
+        if (clSetKernelArg(
+                    kernel,
+                    arg_index,
+                    byte_count,
+                    NULL
+                    ) != CL_SUCCESS) {
+            fatal("Could not set kernel argument.");
+        }
+    }
+
+    // Copies count values to mem, starting offset values in. Without
+    // blocking, data must stay valid until the next finish().
+    void load(cl_mem mem, Complex const* data, size_t count, size_t offset = 0, cl_bool blocking = CL_TRUE)
+    {
+        load_raw(mem, data, count, offset, blocking);
+    }
+
+    // Copies count values from mem, starting offset values in. Without
+    // blocking, data is only written by the next finish().
+    void store(Complex* data, cl_mem mem, size_t count, size_t offset = 0, cl_bool blocking = CL_TRUE)
+    {
+        store_raw(data, mem, count, offset, blocking);
+    }
+
+    // load() and store() of count cl_float2 values at data, which needs no
+    // more alignment than its bytes, so that real signals go as they are.
+    void load_raw(cl_mem mem, void const* data, size_t count, size_t offset = 0, cl_bool blocking = CL_TRUE)
+    {
+        assert(offset + count <= m_batch_capacity*sample_count());
+
+        cl_event event;
+        if (clEnqueueWriteBuffer(
+                    m_queue,
+                    mem,
+                    blocking,
+                    offset*sizeof(cl_float2),
+                    count*sizeof(cl_float2),
+                    data,
+                    0,
+                    NULL,
+                    profiled(event)) != CL_SUCCESS) {
+            fatal("Coule not write to buffer.");
+        }
+        profile("write", event, count*sizeof(cl_float2));
+    }
+
+    void store_raw(void* data, cl_mem mem, size_t count, size_t offset = 0, cl_bool blocking = CL_TRUE)
+    {
+        assert(offset + count <= m_batch_capacity*sample_count());
+
+        cl_int ec;
+
+        cl_event event;
+        ec = clEnqueueReadBuffer(
+                m_queue,
+                mem,
+                blocking,
+                offset*sizeof(cl_float2),
+                count*sizeof(cl_float2),
+                data,
+                0,
+                NULL,
+                profiled(event));
+        if (ec != CL_SUCCESS) {
+            std::cout << error_code_to_string(ec) << "\n";
+            fatal("Could not read buffer.");
+        }
+        profile("read", event, count*sizeof(cl_float2));
+    }
+
+    // Transforms batch_count signals already in device buffer x, which must
+    // not be one of this Fourier's own, after reserve(batch_count). Returns
+    // the buffer holding the spectra, which stays valid until the next
+    // transform.
+    cl_mem transform(cl_mem x, size_t batch_count)
+    {
+        assert(batch_count <= m_batch_capacity);
+        return transform(x, m_sample_power, batch_count);
+    }
+
+    // Grows the device buffers to hold batch_count transforms.
+    void reserve(size_t batch_count)
+    {
+        if (batch_count <= m_batch_capacity) return;
+
+        release_buffers();
+        create_buffers(batch_count);
+    }
+
+    size_t byte_count() const
+    {
+        return sample_count()*sizeof(cl_float2);
+    }
+
+    // Device memory held by the buffers, twiddle tables and pipeline slots.
+    size_t device_byte_count() const
+    {
+        size_t total = (3*m_batch_capacity + 3*m_slots.size())*byte_count();
+        for (auto& twiddles : m_twiddle_mems) {
+            total += ((size_t) 1 << twiddles.first)*sizeof(cl_float2);
+        }
+        return total;
+    }
+
+    size_t sample_count() const
+    {
+        return 1 << m_sample_power;
+    }
+
+    // Kernels for the chains built on this transform, which set their
+    // arguments through set_arg() on the thread that uses this object.
+    OpenClKernels const& kernels() const
+    {
+        return m_kernels;
+    }
+
+private:
+    cl_mem transform(cl_mem x, cl_uint sample_power, size_t batch_count)
+    {
+        return transform(x, m_y1_mem, m_y2_mem, sample_power, batch_count);
+    }
+
+    // Bit-reversal and all butterfly stages of batch_count transforms of
+    // 2^sample_power samples read from x, ping-ponging between y1 and y2.
+    // Returns the buffer holding the spectra, which is y1 or y2.
+    cl_mem transform(cl_mem x, cl_mem y1, cl_mem y2, cl_uint sample_power, size_t batch_count)
+    {
+        size_t const count = (size_t) 1 << sample_power;
+        size_t const group_size = m_tuning.group_size;
+        cl_uint first_B = 1;
+
+        if (m_tuning.variant == Variant::Stockham && sample_power != 0) {
+            return stockham_transform(x, y1, y2, sample_power, batch_count);
+        }
+
+        if (m_tuning.variant == Variant::Local) {
+            size_t const tile = tile_size(count);
+
+            set_arg(m_kernels.local, 0, x);
+            set_arg(m_kernels.local, 1, sample_power);
+            set_local_arg(m_kernels.local, 2, tile*sizeof(cl_float2));
+            set_arg(m_kernels.local, 3, y1);
+            run_kernel(m_kernels.local, count, batch_count, tile);
+
+            first_B = tile;
+        }
+        else {
+            set_arg(m_kernels.init, 0, x);
+            set_arg(m_kernels.init, 1, sample_power);
+            set_arg(m_kernels.init, 2, y1);
+            run_kernel(m_kernels.init, count, batch_count, group_size);
+        }
+
+        cl_mem y = y1;
+        cl_mem y_ = y2;
+        for (cl_uint B = first_B; B != count; B <<= 1) {
+            set_arg(m_kernels.step, 0, y);
+            set_arg(m_kernels.step, 1, B);
+            set_arg(m_kernels.step, 2, y_);
+            run_kernel(m_kernels.step, count, batch_count, group_size);
+            std::swap(y, y_);
+        }
+
+        return y;
+    }
+
+    // Stages of radix 2^m_tuning.radix_power, then one smaller stage for the
+    // remaining factor. Each stage reads the previous one's output, starting
+    // from x, and the last one writes the returned buffer.
+    cl_mem stockham_transform(cl_mem x, cl_mem y1, cl_mem y2, cl_uint sample_power, size_t batch_count)
+    {
+        size_t const count = (size_t) 1 << sample_power;
+        cl_mem twiddles = twiddle_mem(sample_power);
+
+        cl_mem in = x;
+        cl_mem out = y1;
+        for (cl_uint exponent_s = 0; exponent_s != sample_power; ) {
+            cl_uint radix_power = std::min<cl_uint>(m_tuning.radix_power, sample_power - exponent_s);
+            cl_kernel kernel = m_kernels.stockham[radix_power - 1];
+
+            set_arg(kernel, 0, in);
+            set_arg(kernel, 1, exponent_s);
+            set_arg(kernel, 2, twiddles);
+            set_arg(kernel, 3, out);
+            run_kernel(kernel, count >> radix_power, batch_count, m_tuning.group_size);
+
+            exponent_s += radix_power;
+            in = out;
+            out = out == y1 ? y2 : y1;
+        }
+
+        return in;
+    }
+
+    // W(k, 2^sample_power) for k < 2^sample_power on the device, built on
+    // first use and kept for the lifetime of the Fourier object.
+    cl_mem twiddle_mem(cl_uint sample_power)
+    {
+        cl_mem& mem = m_twiddle_mems[sample_power];
+        if (mem != NULL) return mem;
+
+        size_t const count = (size_t) 1 << sample_power;
+        Signal twiddles(count);
+        for (size_t k = 0; k != count; ++k) {
+            std::complex<double> w = std::polar(1.0, -2.0*M_PI*k/count);
+            twiddles[k] = Complex(w.real(), w.imag());
+        }
+
+        mem = clCreateBuffer(
+                m_context,
+                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                count*sizeof(cl_float2),
+                &twiddles[0],
+                NULL);
+        if (mem == NULL) fatal("Could not create twiddle buffer.");
+
+        return mem;
+    }
+
+    // Best time in nanoseconds of a few transforms of m_x_mem, after one
+    // warm-up run that also builds any twiddle table.
+    double time_transform()
+    {
+        typedef std::chrono::steady_clock Clock;
+
+        transform(m_x_mem, m_sample_power, 1);
+        finish();
+
+        double best = std::numeric_limits<double>::infinity();
+        for (int run = 0; run != 5; ++run) {
+            Clock::time_point start = Clock::now();
+            transform(m_x_mem, m_sample_power, 1);
+            finish();
+            best = std::min(best, std::chrono::duration<double, std::nano>(Clock::now() - start).count());
+        }
+        return best;
+    }
+
+    static std::vector<std::string> split_tuning_line(std::string const& line)
+    {
+        std::vector<std::string> fields;
+        std::istringstream ss(line);
+        std::string field;
+        while (std::getline(ss, field, '\t')) {
+            fields.push_back(field);
+        }
+        return fields;
+    }
+
+    // A decimal count with nothing before or after it.
+    static bool parse_count(std::string const& field, size_t& value)
+    {
+        if (field.empty() || !isdigit((unsigned char) field[0])) return false;
+        char* end;
+        errno = 0;
+        unsigned long long parsed = strtoull(field.c_str(), &end, 10);
+        if (errno != 0 || *end != '\0' || parsed > std::numeric_limits<size_t>::max()) return false;
+        value = (size_t) parsed;
+        return true;
+    }
+
+    // Whether the work-group size of tuning is one that autotune() could
+    // have picked on this device, so that launches with it cannot fail.
+    bool is_launchable(Tuning const& tuning) const
+    {
+        size_t const size = tuning.group_size;
+        if (size == 0) return true;
+        if ((size & (size - 1)) != 0 || size > std::min(m_device->max_group_size(), sample_count())) return false;
+        return tuning.variant != Variant::Local || size <= ((size_t) 1 << m_device->max_tile_power());
+    }
+
+    bool is_own_tuning_line(std::vector<std::string> const& fields) const
+    {
+        return fields.size() >= 3
+            && fields[0] == m_device->device_name()
+            && fields[1] == m_device->driver_version()
+            && fields[2] == std::to_string(m_sample_power);
+    }
+
+    // Device buffers and host staging for one transform in flight. The
+    // staging lives in CL_MEM_ALLOC_HOST_PTR buffers that stay mapped, which
+    // gives pinned memory the device can transfer from directly. downloaded
+    // is NULL when the slot holds no pending transform.
+    struct PipelineSlot
+    {
+        cl_mem x_mem;
+        cl_mem y1_mem;
+        cl_mem y2_mem;
+        cl_mem x_host_mem;
+        cl_mem y_host_mem;
+        Complex* x_host;
+        Complex* y_host;
+        cl_event downloaded;
+        Complex* spectrum;
+    };
+
+    static size_t const pipeline_depth = 3;
+
+    void complete(PipelineSlot& slot)
+    {
+        if (slot.downloaded == NULL) return;
+
+        if (clWaitForEvents(1, &slot.downloaded) != CL_SUCCESS) fatal("Could not wait for download.");
+        if (clReleaseEvent(slot.downloaded) != CL_SUCCESS) fatal("Could not release event.");
+        slot.downloaded = NULL;
+
+        std::copy(slot.y_host, slot.y_host + sample_count(), slot.spectrum);
+    }
+
+    void* map(cl_mem mem, cl_map_flags flags)
+    {
+        cl_int ec;
+        cl_event event;
+        void* mapped = clEnqueueMapBuffer(m_queue, mem, CL_TRUE, flags, 0, byte_count(), 0, NULL, profiled(event), &ec);
+        if (ec != CL_SUCCESS) fatal("Could not map buffer.");
+        profile("map", event, byte_count());
+        return mapped;
+    }
+
+    // Where an enqueue should return its event: into event when profiling,
+    // otherwise nowhere.
+    cl_event* profiled(cl_event& event) const
+    {
+        return m_profiler != NULL ? &event : NULL;
+    }
+
+    // Hands event from profiled() to the profiler under label, and releases
+    // it.
+    void profile(std::string const& label, cl_event event, size_t bytes = 0)
+    {
+        if (m_profiler == NULL) return;
+        m_profiler->add(label, event, bytes);
+        if (clReleaseEvent(event) != CL_SUCCESS) fatal("Could not release event.");
+    }
+
+    // A buffer over sample_count() values at data, for zero_copy_fft().
+    cl_mem host_mem(Complex* data, cl_mem_flags flags)
+    {
+        cl_mem mem = clCreateBuffer(m_context, flags | CL_MEM_USE_HOST_PTR, byte_count(), data, NULL);
+        if (mem == NULL) fatal("Could not create host buffer.");
+        return mem;
+    }
+
+    // Number of kernel launches transform() makes, which decides whether the
+    // result ends up in its first or second ping-pong buffer.
+    size_t pass_count(cl_uint sample_power) const
+    {
+        if (m_tuning.variant == Variant::Stockham && sample_power != 0) {
+            return (sample_power + m_tuning.radix_power - 1)/m_tuning.radix_power;
+        }
+
+        if (m_tuning.variant == Variant::Local) {
+            size_t tile_power = 0;
+            while (((size_t) 2 << tile_power) <= tile_size((size_t) 1 << sample_power)) ++tile_power;
+            return 1 + sample_power - tile_power;
+        }
+
+        return 1 + sample_power;
+    }
+
+    // Samples per fft_local tile for a transform of count samples.
+    size_t tile_size(size_t count) const
+    {
+        size_t size = std::min(count, (size_t) 1 << m_device->max_tile_power());
+        if (m_tuning.group_size != 0) size = std::min(size, m_tuning.group_size);
+        return size;
+    }
+
+    void create_slots()
+    {
+        m_slots.resize(pipeline_depth);
+        for (auto& slot : m_slots) {
+            slot.x_mem = clCreateBuffer(m_context, CL_MEM_READ_ONLY, byte_count(), NULL, NULL);
+            if (slot.x_mem == NULL) fatal("Could not create pipeline X buffer.");
+
+            slot.y1_mem = clCreateBuffer(m_context, CL_MEM_READ_WRITE, byte_count(), NULL, NULL);
+            if (slot.y1_mem == NULL) fatal("Could not create pipeline Y1 buffer.");
+
+            slot.y2_mem = clCreateBuffer(m_context, CL_MEM_READ_WRITE, byte_count(), NULL, NULL);
+            if (slot.y2_mem == NULL) fatal("Could not create pipeline Y2 buffer.");
+
+            slot.x_host_mem = clCreateBuffer(m_context, CL_MEM_ALLOC_HOST_PTR, byte_count(), NULL, NULL);
+            if (slot.x_host_mem == NULL) fatal("Could not create pinned X buffer.");
+            slot.x_host = static_cast<Complex*>(map(slot.x_host_mem, CL_MAP_WRITE));
+
+            slot.y_host_mem = clCreateBuffer(m_context, CL_MEM_ALLOC_HOST_PTR, byte_count(), NULL, NULL);
+            if (slot.y_host_mem == NULL) fatal("Could not create pinned Y buffer.");
+            slot.y_host = static_cast<Complex*>(map(slot.y_host_mem, CL_MAP_READ));
+
+            slot.downloaded = NULL;
+            slot.spectrum = NULL;
+        }
+    }
+
+    // Drops transforms that were never completed.
+    void release_slots()
+    {
+        for (auto& slot : m_slots) {
+            if (slot.downloaded != NULL) {
+                if (clWaitForEvents(1, &slot.downloaded) != CL_SUCCESS) fatal("Could not wait for download.");
+                if (clReleaseEvent(slot.downloaded) != CL_SUCCESS) fatal("Could not release event.");
+            }
+            if (clEnqueueUnmapMemObject(m_queue, slot.y_host_mem, slot.y_host, 0, NULL, NULL) != CL_SUCCESS) fatal("Could not unmap buffer.");
+            if (clEnqueueUnmapMemObject(m_queue, slot.x_host_mem, slot.x_host, 0, NULL, NULL) != CL_SUCCESS) fatal("Could not unmap buffer.");
+            finish();
+            if (clReleaseMemObject(slot.y_host_mem) != CL_SUCCESS) fatal("Could not release pinned Y buffer.");
+            if (clReleaseMemObject(slot.x_host_mem) != CL_SUCCESS) fatal("Could not release pinned X buffer.");
+            if (clReleaseMemObject(slot.y2_mem) != CL_SUCCESS) fatal("Could not release pipeline Y2 buffer.");
+            if (clReleaseMemObject(slot.y1_mem) != CL_SUCCESS) fatal("Could not release pipeline Y1 buffer.");
+            if (clReleaseMemObject(slot.x_mem) != CL_SUCCESS) fatal("Could not release pipeline X buffer.");
+        }
+        m_slots.clear();
+    }
+
+    void create_buffers(size_t batch_count)
+    {
+        m_batch_capacity = batch_count;
+
+        m_x_mem = clCreateBuffer(
+                m_context,
+                CL_MEM_READ_ONLY,
+                batch_count*byte_count(),
+                NULL,
+                NULL);
+        if (m_x_mem == NULL) fatal("Could not create X buffer.");
+
+        m_y1_mem = clCreateBuffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                batch_count*byte_count(),
+                NULL,
+                NULL);
+        if (m_y1_mem == NULL) fatal("Could not create Y1 buffer.");
+
+        m_y2_mem = clCreateBuffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                batch_count*byte_count(),
                 NULL,
                 NULL);
+        if (m_y2_mem == NULL) fatal("Could not create Y2 buffer.");
+    }
+
+    void release_buffers()
+    {
+        if (clReleaseMemObject(m_y2_mem) != CL_SUCCESS) fatal("Could not release Y2 buffer.");
+        if (clReleaseMemObject(m_y1_mem) != CL_SUCCESS) fatal("Could not release Y1 buffer.");
+        if (clReleaseMemObject(m_x_mem) != CL_SUCCESS) fatal("Could not release X buffer.");
+    }
+
+    std::shared_ptr<OpenClDevice> m_device;
+    size_t m_sample_power;
+    size_t m_batch_capacity;
+    std::vector<PipelineSlot> m_slots;
+    size_t m_next_slot;
+    bool m_zero_copy;
+    Tuning m_tuning;
+    cl_mem m_y2_mem;
+    cl_mem m_y1_mem;
+    cl_mem m_x_mem;
+    std::map<cl_uint, cl_mem> m_twiddle_mems;
+    // This object's own, so that Fourier objects sharing m_device can run
+    // on different threads.
+    OpenClKernels m_kernels;
+    cl_command_queue m_download_queue;
+    cl_command_queue m_upload_queue;
+    cl_command_queue m_queue;
+    cl_context m_context;
+    ClProfiler* m_profiler;
+};
+
+// Fourier objects of any size on one shared device, created on first use.
+// Once the device memory of the cached plans exceeds the byte budget, the
+// least recently used plans are dropped, though never the one just
+// requested. A dropped plan lives on while a caller still holds it.
+// plan() is not thread-safe; plans from it may run on different threads,
+// but one plan on one thread at a time.
+class FourierCache : private boost::noncopyable
+{
+public:
+    // byte_budget defaults to a quarter of the device's global memory.
+    explicit FourierCache(std::shared_ptr<OpenClDevice> device, size_t byte_budget = 0)
+        : m_device(device)
+        , m_byte_budget(byte_budget != 0 ? byte_budget : device->global_mem_size()/4)
+        , m_hits(0)
+        , m_misses(0)
+        , m_evictions(0)
+    {
+    }
+
+    // The plan for transforms of 2^sample_power samples.
+    std::shared_ptr<Fourier> plan(size_t sample_power)
+    {
+        auto found = m_index.find(sample_power);
+        if (found != m_index.end()) {
+            ++m_hits;
+            m_plans.splice(m_plans.begin(), m_plans, found->second);
+        }
+        else {
+            ++m_misses;
+            m_plans.emplace_front(sample_power, std::make_shared<Fourier>(m_device, sample_power));
+            m_index[sample_power] = m_plans.begin();
+        }
+
+        std::shared_ptr<Fourier> result = m_plans.front().second;
+        evict();
+        return result;
+    }
+
+    void clear()
+    {
+        m_plans.clear();
+        m_index.clear();
+    }
+
+    // Device memory of the cached plans, which can grow after plan()
+    // returns, as batches and pipelines allocate.
+    size_t byte_count() const
+    {
+        size_t total = 0;
+        for (auto& plan : m_plans) {
+            total += plan.second->device_byte_count();
+        }
+        return total;
+    }
+
+    size_t byte_budget() const
+    {
+        return m_byte_budget;
+    }
+
+    size_t size() const
+    {
+        return m_plans.size();
+    }
+
+    size_t hits() const
+    {
+        return m_hits;
+    }
+
+    size_t misses() const
+    {
+        return m_misses;
+    }
+
+    size_t evictions() const
+    {
+        return m_evictions;
+    }
+
+    OpenClDevice& device() const
+    {
+        return *m_device;
+    }
+
+private:
+    void evict()
+    {
+        size_t total = byte_count();
+        while (m_plans.size() > 1 && total > m_byte_budget) {
+            total -= m_plans.back().second->device_byte_count();
+            m_index.erase(m_plans.back().first);
+            m_plans.pop_back();
+            ++m_evictions;
+        }
+    }
+
+    typedef std::list<std::pair<size_t, std::shared_ptr<Fourier>>> Plans;
+
+    std::shared_ptr<OpenClDevice> m_device;
+    size_t m_byte_budget;
+    // Most recently used first.
+    Plans m_plans;
+    std::map<size_t, Plans::iterator> m_index;
+    size_t m_hits;
+    size_t m_misses;
+    size_t m_evictions;
+};
+
+// Average wall-clock nanoseconds per call of fn.
+template <typename F>
+static double time_per_call_ns(F fn)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    size_t calls = 0;
+    Clock::time_point start = Clock::now();
+    Clock::duration elapsed;
+    do {
+        fn();
+        ++calls;
+        elapsed = Clock::now() - start;
+    } while (elapsed < std::chrono::milliseconds(200));
+
+    return std::chrono::duration<double, std::nano>(elapsed).count()/calls;
+}
+
+// count items split in proportion to weights, rounding so that the parts
+// add up to count and the largest remainders get the leftover items.
+static std::vector<size_t> split_by_weight(std::vector<double> const& weights, size_t count)
+{
+    double total = 0;
+    for (double weight : weights) {
+        total += weight;
+    }
+    assert(total > 0);
+
+    std::vector<size_t> parts(weights.size());
+    std::vector<std::pair<double, size_t>> remainders;
+    size_t assigned = 0;
+    for (size_t i = 0; i != weights.size(); ++i) {
+        double exact = count*weights[i]/total;
+        parts[i] = (size_t) exact;
+        assigned += parts[i];
+        remainders.emplace_back(exact - parts[i], i);
+    }
+
+    std::stable_sort(remainders.begin(), remainders.end(), [](std::pair<double, size_t> const& a, std::pair<double, size_t> const& b) {
+        return a.first > b.first;
+    });
+    for (size_t i = 0; assigned != count; ++i, ++assigned) {
+        ++parts[remainders[i].second];
+    }
+    return parts;
+}
+
+// Batched transforms split across several devices in proportion to their
+// throughput. Every device's share is enqueued before any is waited for, so
+// the devices work concurrently.
+class ShardedFourier : private boost::noncopyable
+{
+public:
+    ShardedFourier(std::vector<std::shared_ptr<OpenClDevice>> const& devices, size_t sample_power)
+        : m_weights(devices.size(), 1.0)
+    {
+        if (devices.empty()) fatal("Sharded transforms need at least one device.");
+        for (auto& device : devices) {
+            m_fouriers.emplace_back(new Fourier(device, sample_power));
+        }
+    }
+
+    // Times batches of batch_count transforms on each device and weights
+    // the devices by the measured throughput.
+    std::vector<double> const& calibrate(size_t batch_count = 16)
+    {
+        for (size_t i = 0; i != m_fouriers.size(); ++i) {
+            Fourier& fourier = *m_fouriers[i];
+            Signal signals(batch_count*fourier.sample_count(), 1);
+            Signal spectra(signals.size());
+            double ns = time_per_call_ns([&] {
+                fourier.fft_batch(&spectra[0], &signals[0], batch_count, fourier.sample_count(), fourier.sample_count());
+            });
+            m_weights[i] = batch_count/ns;
+        }
+        return m_weights;
+    }
+
+    void set_weights(std::vector<double> const& weights)
+    {
+        assert(weights.size() == m_fouriers.size());
+        m_weights = weights;
+    }
+
+    std::vector<double> const& weights() const
+    {
+        return m_weights;
+    }
+
+    // Transforms of a batch of batch_count that each device takes.
+    std::vector<size_t> shard_counts(size_t batch_count) const
+    {
+        return split_by_weight(m_weights, batch_count);
+    }
+
+    // Like Fourier::fft_batch, with consecutive runs of the batch on each
+    // device.
+    void fft_batch(
+            Complex* spectra,
+            Complex const* signals,
+            size_t batch_count,
+            size_t signal_stride,
+            size_t spectrum_stride)
+    {
+        std::vector<size_t> counts = shard_counts(batch_count);
+
+        size_t first = 0;
+        for (size_t i = 0; i != m_fouriers.size(); ++i) {
+            if (counts[i] == 0) continue;
+            m_fouriers[i]->enqueue_fft_batch(
+                    &spectra[first*spectrum_stride],
+                    &signals[first*signal_stride],
+                    counts[i],
+                    signal_stride,
+                    spectrum_stride);
+            first += counts[i];
+        }
+
+        for (size_t i = 0; i != m_fouriers.size(); ++i) {
+            if (counts[i] != 0) m_fouriers[i]->finish();
+        }
+    }
+
+    size_t device_count() const
+    {
+        return m_fouriers.size();
+    }
+
+    Fourier& fourier(size_t index)
+    {
+        return *m_fouriers[index];
+    }
+
+    size_t sample_count() const
+    {
+        return m_fouriers.front()->sample_count();
+    }
+
+private:
+    std::vector<std::unique_ptr<Fourier>> m_fouriers;
+    std::vector<double> m_weights;
+};
+
+// FftConvolver's overlap-save method as a chain of kernels on the device:
+// only the input and the output cross the bus, and the blocks, spectra and
+// products stay in device memory. The inverse transforms reuse the forward
+// kernels, since ifft(X) = conj(fft(conj(X)))/n: multiply_conj conjugates
+// the product and overlap_save_gather conjugates the result back, with the
+// 1/n folded into the filter's spectrum.
+class FourierConvolver : private boost::noncopyable
+{
+public:
+    // fft_size defaults to convolution_fft_size(filter.size()). Each pass of
+    // the chain covers up to batch_count blocks.
+    FourierConvolver(std::shared_ptr<OpenClDevice> device, Signal const& filter, size_t batch_count = 16, size_t fft_size = 0)
+        : m_device(device)
+        , m_filter_size(filter.size())
+        , m_batch_count(batch_count)
+        , m_fourier(device, sample_power(fft_size != 0 ? fft_size : convolution_fft_size(filter.size())))
+    {
+        size_t const N = m_fourier.sample_count();
+        assert(!filter.empty() && N >= filter.size());
+
+        Signal padded(N);
+        std::copy(filter.begin(), filter.end(), padded.begin());
+        Signal spectrum = fft(padded);
+        for (auto& x : spectrum) {
+            x /= (Float) N;
+        }
+
+        m_fourier.reserve(batch_count);
+        m_filter_mem = create_buffer(CL_MEM_READ_ONLY, N);
+        m_input_mem = create_buffer(CL_MEM_READ_ONLY, batch_count*step() + N - step());
+        m_blocks_mem = create_buffer(CL_MEM_READ_WRITE, batch_count*N);
+        m_output_mem = create_buffer(CL_MEM_WRITE_ONLY, batch_count*step());
+        m_fourier.load(m_filter_mem, &spectrum[0], N);
+    }
+
+    ~FourierConvolver()
+    {
+        if (clReleaseMemObject(m_output_mem) != CL_SUCCESS) fatal("Could not release output buffer.");
+        if (clReleaseMemObject(m_blocks_mem) != CL_SUCCESS) fatal("Could not release block buffer.");
+        if (clReleaseMemObject(m_input_mem) != CL_SUCCESS) fatal("Could not release input buffer.");
+        if (clReleaseMemObject(m_filter_mem) != CL_SUCCESS) fatal("Could not release filter buffer.");
+    }
+
+    // Full linear convolution: signal.size() + filter_size() - 1 samples.
+    Signal convolve(Signal const& signal)
+    {
+        size_t const N = m_fourier.sample_count();
+        size_t const L = step();
+        size_t const history = m_filter_size - 1;
+        size_t const output_count = signal.size() + history;
+        size_t const block_count = (output_count + L - 1)/L;
+
+        // The signal behind M - 1 zeros, and zeros up to the end of the last
+        // block.
+        Signal padded(block_count*L + N - L);
+        std::copy(signal.begin(), signal.end(), padded.begin() + history);
+
+        Signal output(block_count*L);
+        for (size_t first = 0; first < block_count; first += m_batch_count) {
+            size_t const batch_count = std::min(m_batch_count, block_count - first);
+
+            m_fourier.load(m_input_mem, &padded[first*L], batch_count*L + N - L, 0, CL_FALSE);
+
+            m_fourier.set_arg(m_fourier.kernels().overlap_save_scatter, 0, m_input_mem);
+            m_fourier.set_arg(m_fourier.kernels().overlap_save_scatter, 1, (cl_uint) L);
+            m_fourier.set_arg(m_fourier.kernels().overlap_save_scatter, 2, m_blocks_mem);
+            m_fourier.run_kernel(m_fourier.kernels().overlap_save_scatter, N, batch_count);
+
+            cl_mem spectra = m_fourier.transform(m_blocks_mem, batch_count);
+
+            m_fourier.set_arg(m_fourier.kernels().multiply_conj, 0, spectra);
+            m_fourier.set_arg(m_fourier.kernels().multiply_conj, 1, m_filter_mem);
+            m_fourier.set_arg(m_fourier.kernels().multiply_conj, 2, m_blocks_mem);
+            m_fourier.run_kernel(m_fourier.kernels().multiply_conj, N, batch_count);
+
+            cl_mem products = m_fourier.transform(m_blocks_mem, batch_count);
+
+            m_fourier.set_arg(m_fourier.kernels().overlap_save_gather, 0, products);
+            m_fourier.set_arg(m_fourier.kernels().overlap_save_gather, 1, (cl_uint) N);
+            m_fourier.set_arg(m_fourier.kernels().overlap_save_gather, 2, m_output_mem);
+            m_fourier.run_kernel(m_fourier.kernels().overlap_save_gather, L, batch_count);
+
+            m_fourier.store(&output[first*L], m_output_mem, batch_count*L, 0, CL_FALSE);
+        }
+        m_fourier.finish();
+
+        output.resize(output_count);
+        return output;
+    }
+
+    size_t filter_size() const
+    {
+        return m_filter_size;
+    }
+
+    size_t fft_size() const
+    {
+        return m_fourier.sample_count();
+    }
+
+    size_t step() const
+    {
+        return fft_size() - m_filter_size + 1;
+    }
+
+    Fourier& fourier()
+    {
+        return m_fourier;
+    }
+
+private:
+    static size_t sample_power(size_t N)
+    {
+        assert(is_power_of_two(N));
+        size_t power = 0;
+        while (((size_t) 2 << power) <= N) ++power;
+        return power;
+    }
+
+    cl_mem create_buffer(cl_mem_flags flags, size_t count)
+    {
+        cl_mem mem = clCreateBuffer(m_device->context(), flags, count*sizeof(cl_float2), NULL, NULL);
+        if (mem == NULL) fatal("Could not create convolution buffer.");
+        return mem;
+    }
+
+    std::shared_ptr<OpenClDevice> m_device;
+    size_t m_filter_size;
+    size_t m_batch_count;
+    Fourier m_fourier;
+    cl_mem m_filter_mem;
+    cl_mem m_input_mem;
+    cl_mem m_blocks_mem;
+    cl_mem m_output_mem;
+};
+
+// FftPlanNd on the device, for shapes whose sides are powers of two: the
+// array stays in device memory between the axes, and the transposes that
+// bring each axis last run as the transpose kernel. Holds a Fourier for each
+// distinct side, reserved to the batch its axis needs.
+class FourierNd : private boost::noncopyable
+{
+public:
+    // An array of 2^sample_powers[0] x 2^sample_powers[1] x ... samples,
+    // every power at least 1.
+    FourierNd(std::shared_ptr<OpenClDevice> device, std::vector<size_t> const& sample_powers)
+        : m_device(device)
+        , m_size(1)
+        , m_tile(16)
+    {
+        assert(!sample_powers.empty());
+        for (size_t power : sample_powers) {
+            assert(power >= 1);
+            m_shape.push_back((size_t) 1 << power);
+            m_size <<= power;
+        }
+        for (size_t power : sample_powers) {
+            std::unique_ptr<Fourier>& fourier = m_fouriers[power];
+            if (!fourier) fourier.reset(new Fourier(device, power));
+            fourier->reserve(m_size >> power);
+        }
+        while (m_tile*m_tile > device->max_group_size()) {
+            m_tile /= 2;
+        }
+
+        m_data_mem = create_buffer();
+        m_work_mem = create_buffer();
+    }
+
+    ~FourierNd()
+    {
+        if (clReleaseMemObject(m_work_mem) != CL_SUCCESS) fatal("Could not release work buffer.");
+        if (clReleaseMemObject(m_data_mem) != CL_SUCCESS) fatal("Could not release data buffer.");
+    }
+
+    void fft(Complex* spectrum, Complex const* signal)
+    {
+        Fourier& any = *m_fouriers.begin()->second;
+        any.load(m_data_mem, signal, m_size);
+
+        cl_mem current = m_data_mem;
+        size_t inner = 1;
+        for (size_t axis = m_shape.size(); axis-- != 0; ) {
+            size_t const n = m_shape[axis];
+            size_t const outer = m_size/(n*inner);
+            Fourier& fourier = *m_fouriers[sample_power(n)];
+
+            if (inner == 1) {
+                current = fourier.transform(current, outer);
+            }
+            else {
+                transpose(m_work_mem, current, n, inner, outer);
+                cl_mem spectra = fourier.transform(m_work_mem, outer*inner);
+                transpose(m_data_mem, spectra, inner, n, outer);
+                current = m_data_mem;
+            }
+            inner *= n;
+        }
+
+        any.store(spectrum, current, m_size);
+    }
+
+    std::vector<size_t> const& shape() const
+    {
+        return m_shape;
+    }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+private:
+    static size_t sample_power(size_t n)
+    {
+        size_t power = 0;
+        while (((size_t) 2 << power) <= n) ++power;
+        return power;
+    }
+
+    // Enqueues the transpose of matrix_count rows x cols matrices from src
+    // into dst.
+    void transpose(cl_mem dst, cl_mem src, size_t rows, size_t cols, size_t matrix_count)
+    {
+        Fourier& any = *m_fouriers.begin()->second;
+        cl_kernel kernel = any.kernels().transpose;
+        any.set_arg(kernel, 0, src);
+        any.set_arg(kernel, 1, (cl_uint) rows);
+        any.set_arg(kernel, 2, (cl_uint) cols);
+        any.set_local_arg(kernel, 3, m_tile*(m_tile + 1)*sizeof(cl_float2));
+        any.set_arg(kernel, 4, dst);
+
+        size_t global_work_size[] = { round_up(cols), round_up(rows), matrix_count };
+        size_t local_work_size[] = { m_tile, m_tile, 1 };
+        ClProfiler* profiler = m_device->profiler();
+        cl_event event;
+        cl_int ec = clEnqueueNDRangeKernel(
+                m_device->queue(),
+                kernel,
+                3,
+                NULL,
+                global_work_size,
+                local_work_size,
+                0,
+                NULL,
+                profiler != NULL ? &event : NULL);
         if (ec != CL_SUCCESS) {
             std::cout << error_code_to_string(ec) << "\n";
-            fatal("Could not read buffer.");
+            fatal("Could not enqueue transpose kernel.");
         }
+        if (profiler != NULL) {
+            profiler->add("transpose", event);
+            if (clReleaseEvent(event) != CL_SUCCESS) fatal("Could not release event.");
+        }
+    }
+
+    size_t round_up(size_t n) const
+    {
+        return (n + m_tile - 1)/m_tile*m_tile;
+    }
+
+    cl_mem create_buffer()
+    {
+        cl_mem mem = clCreateBuffer(m_device->context(), CL_MEM_READ_WRITE, m_size*sizeof(cl_float2), NULL, NULL);
+        if (mem == NULL) fatal("Could not create transform buffer.");
+        return mem;
+    }
+
+    std::shared_ptr<OpenClDevice> m_device;
+    std::vector<size_t> m_shape;
+    size_t m_size;
+    size_t m_tile;
+    std::map<size_t, std::unique_ptr<Fourier>> m_fouriers;
+    cl_mem m_data_mem;
+    cl_mem m_work_mem;
+};
+
+// An OpenClDevice for each of find_devices().
+static std::vector<std::shared_ptr<OpenClDevice>> open_devices()
+{
+    std::vector<std::shared_ptr<OpenClDevice>> result;
+    for (cl_device_id device : find_devices()) {
+        result.push_back(std::make_shared<OpenClDevice>(device));
+    }
+    return result;
+}
+
+// Runs a stream of forward transforms on CPU threads and OpenCL devices at
+// once. Each backend has a queue: one shared by the CPU threads, which run
+// the native fft(), and one per device, run by a thread that owns the
+// device's FourierCache. submit() sends a power-of-two transform to the
+// device with the shortest queue whose crossover it reaches, and everything
+// else to the CPU. A worker whose queue is empty steals from the back of the
+// longest queue it can serve; devices only take power-of-two sizes. Each
+// Fourier has its own kernels, so other Fourier objects on the device may
+// run alongside.
+class HybridScheduler : private boost::noncopyable
+{
+public:
+    // Jobs and busy time of one backend since construction or
+    // reset_utilisation().
+    struct Utilisation
+    {
+        std::string name;
+        size_t worker_count;
+        size_t job_count;
+        size_t stolen_count;
+        double busy_ns;
+    };
+
+    HybridScheduler(size_t cpu_thread_count, std::vector<std::shared_ptr<OpenClDevice>> const& devices)
+        : m_pending(0)
+        , m_stop(false)
+    {
+        assert(cpu_thread_count >= 1);
+
+        m_backends.emplace_back(new Backend("cpu", cpu_thread_count, NULL));
+        for (auto& device : devices) {
+            m_backends.emplace_back(new Backend(device->device_name(), 1, device));
+        }
+        reset_utilisation();
+
+        for (size_t b = 0; b != m_backends.size(); ++b) {
+            for (size_t t = 0; t != m_backends[b]->worker_count; ++t) {
+                m_threads.push_back(std::thread([this, b] { work(b); }));
+            }
+        }
+    }
+
+    ~HybridScheduler()
+    {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+
+        for (auto& thread : m_threads) {
+            thread.join();
+        }
+    }
+
+    // Queues the transform of N samples from signal into spectrum. Both must
+    // stay valid until wait() returns.
+    void submit(Complex* spectrum, Complex const* signal, size_t N)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Backend* target = m_backends[0].get();
+            if (is_power_of_two(N)) {
+                for (size_t b = 1; b != m_backends.size(); ++b) {
+                    Backend& device = *m_backends[b];
+                    if (N >= device.crossover && (target == m_backends[0].get() || device.queue.size() < target->queue.size())) {
+                        target = &device;
+                    }
+                }
+            }
+            target->queue.push_back(Job{spectrum, signal, N});
+            ++m_pending;
+        }
+        m_wake.notify_all();
+    }
+
+    // Blocks until every submitted transform is done.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this] { return m_pending == 0; });
+    }
+
+    // Times single transforms of 2^min_power to 2^max_power samples on one
+    // CPU thread and on each device, and sets each device's crossover to the
+    // smallest size from which the device stays faster. Devices that are
+    // never faster only get work by stealing. Call with no jobs in flight.
+    void calibrate(size_t min_power = 4, size_t max_power = 20)
+    {
+        wait();
+
+        std::vector<double> cpu_ns;
+        for (size_t power = min_power; power <= max_power; ++power) {
+            size_t N = (size_t) 1 << power;
+            Signal signal = random_signal(N);
+            Signal spectrum(N);
+            cpu_ns.push_back(time_per_call_ns([&] { fft_plan(N).fft(&spectrum[0], &signal[0]); }));
+        }
+
+        for (size_t b = 1; b != m_backends.size(); ++b) {
+            Backend& device = *m_backends[b];
+            size_t crossover = std::numeric_limits<size_t>::max();
+            for (size_t power = max_power + 1; power-- > min_power; ) {
+                size_t N = (size_t) 1 << power;
+                Signal signal = random_signal(N);
+                Signal spectrum(N);
+                std::shared_ptr<Fourier> fourier = device.plans->plan(power);
+                double device_ns = time_per_call_ns([&] { fourier->fft(&spectrum[0], &signal[0]); });
+                if (device_ns >= cpu_ns[power - min_power]) break;
+                crossover = N;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            device.crossover = crossover;
+        }
+    }
+
+    // Smallest transform submit() sends to device index, or the maximum
+    // size_t when it sends none.
+    size_t crossover(size_t device) const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_backends[1 + device]->crossover;
+    }
+
+    void set_crossover(size_t device, size_t N)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_backends[1 + device]->crossover = N;
+    }
+
+    size_t device_count() const
+    {
+        return m_backends.size() - 1;
+    }
+
+    // The CPU first, then the devices.
+    std::vector<Utilisation> utilisation() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<Utilisation> result;
+        for (auto& backend : m_backends) {
+            result.push_back(Utilisation{backend->name, backend->worker_count, backend->job_count, backend->stolen_count, backend->busy_ns});
+        }
+        return result;
+    }
+
+    // Wall-clock nanoseconds since construction or reset_utilisation().
+    double elapsed_ns() const
+    {
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - m_start).count();
+    }
+
+    void reset_utilisation()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto& backend : m_backends) {
+            backend->job_count = 0;
+            backend->stolen_count = 0;
+            backend->busy_ns = 0;
+        }
+        m_start = std::chrono::steady_clock::now();
+    }
+
+    // One line per backend: jobs run, jobs stolen and the share of its
+    // workers' time spent transforming.
+    void print_utilisation(std::ostream& out) const
+    {
+        double elapsed = elapsed_ns();
+        for (auto& backend : utilisation()) {
+            out << backend.name << " (" << backend.worker_count << " workers): "
+                << backend.job_count << " jobs, "
+                << backend.stolen_count << " stolen, "
+                << 100*backend.busy_ns/(elapsed*backend.worker_count) << "% busy\n";
+        }
+    }
+
+private:
+    struct Job
+    {
+        Complex* spectrum;
+        Complex const* signal;
+        size_t N;
+    };
+
+    struct Backend
+    {
+        Backend(std::string const& name_, size_t worker_count_, std::shared_ptr<OpenClDevice> device)
+            : name(name_)
+            , worker_count(worker_count_)
+            , crossover(std::numeric_limits<size_t>::max())
+            , plans(device ? new FourierCache(device) : NULL)
+        {
+        }
+
+        std::string name;
+        size_t worker_count;
+        std::deque<Job> queue;
+        size_t crossover;
+        // Used only by the backend's worker, and by calibrate().
+        std::unique_ptr<FourierCache> plans;
+        size_t job_count;
+        size_t stolen_count;
+        double busy_ns;
+    };
+
+    // Pops the next job for backend b, stealing when its own queue is empty.
+    // Called with m_mutex held.
+    bool take(size_t b, Job& job, bool& stolen)
+    {
+        Backend& own = *m_backends[b];
+        if (!own.queue.empty()) {
+            job = own.queue.front();
+            own.queue.pop_front();
+            stolen = false;
+            return true;
+        }
+
+        Backend* victim = NULL;
+        for (auto& other : m_backends) {
+            if (other->queue.empty()) continue;
+            if (own.plans && !is_power_of_two(other->queue.back().N)) continue;
+            if (victim == NULL || other->queue.size() > victim->queue.size()) victim = other.get();
+        }
+        if (victim == NULL) return false;
+
+        job = victim->queue.back();
+        victim->queue.pop_back();
+        stolen = true;
+        return true;
+    }
+
+    void work(size_t b)
+    {
+        typedef std::chrono::steady_clock Clock;
+        Backend& backend = *m_backends[b];
+
+        while (true) {
+            Job job;
+            bool stolen;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                while (!take(b, job, stolen)) {
+                    if (m_stop) return;
+                    m_wake.wait(lock);
+                }
+            }
+
+            Clock::time_point start = Clock::now();
+            if (backend.plans) {
+                size_t power = 0;
+                while (((size_t) 2 << power) <= job.N) ++power;
+                backend.plans->plan(power)->fft(job.spectrum, job.signal);
+            }
+            else if (is_power_of_two(job.N)) {
+                fft_plan(job.N).fft(job.spectrum, job.signal);
+            }
+            else {
+                general_fft_plan(job.N).fft(job.spectrum, job.signal);
+            }
+            double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++backend.job_count;
+            if (stolen) ++backend.stolen_count;
+            backend.busy_ns += ns;
+            if (--m_pending == 0) m_idle.notify_all();
+        }
+    }
+
+    std::vector<std::unique_ptr<Backend>> m_backends;
+    std::vector<std::thread> m_threads;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_idle;
+    size_t m_pending;
+    bool m_stop;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+static void print_reverse_bits_table() __attribute((unused));
+static void print_reverse_bits_table()
+{
+    std::stringstream ss;
+
+    for (size_t row = 0; row != 16; ++row) {
+        for (size_t column = 0; column != 16; ++column) {
+            ss << std::hex << std::setw(2) << std::setfill('0');
+            ss << reverse_bits(row*16+column, 256) << " ";
+        }
+        ss << "\n";
+    }
+
+    std::cout << ss.str();
+}
+
+static Float prop_fftcl_init_equals_fft_init(Fourier& fourier, Signal const& signal)
+{
+    assert(fourier.sample_count() == signal.size());
+
+    Signal expected(signal.size());
+    fft_init(&expected[0], &signal[0], expected.size());
+
+    Signal actual(signal.size());
+    fourier.init(&actual[0], &signal[0]);
+
+    return error(expected, actual);
+}
+
+static Float prop_fftcl_step_equals_fft_step(Fourier& fourier, Signal const& signal)
+{
+    assert(fourier.sample_count() == signal.size());
+
+    size_t B = 128;
+    size_t transform_count = signal.size()/B;
+    assert(B >= 1);
+
+    Signal expected = signal;
+    fft_step(&expected[0], transform_count/2, 2*B);
+
+    Signal actual(signal.size());
+    fourier.step(&actual[0], &signal[0], B);
+
+    return error(expected, actual);
+}
+
+static Float prop_fftcl_nd_equals_fft_nd(std::shared_ptr<OpenClDevice> device, std::vector<size_t> const& sample_powers)
+{
+    FourierNd fourier(device, sample_powers);
+    FftPlanNd plan(fourier.shape());
+    Signal signal = random_signal(fourier.size());
+    Signal expected(fourier.size());
+    plan.fft(&expected[0], &signal[0]);
+    Signal actual(fourier.size());
+    fourier.fft(&actual[0], &signal[0]);
+    return relative_error(expected, actual);
+}
+
+static Float prop_fftcl_convolver_equals_direct(
+        std::shared_ptr<OpenClDevice> device,
+        size_t signal_size,
+        size_t filter_size,
+        size_t batch_count)
+{
+    Signal signal = random_signal(signal_size);
+    Signal filter = random_signal(filter_size);
+    FourierConvolver convolver(device, filter, batch_count);
+    return relative_error(direct_convolve(signal, filter), convolver.convolve(signal));
+}
+
+// For Fourier and ShardedFourier.
+template <typename BatchFourier>
+static Float prop_fftcl_batch_equals_fft(BatchFourier& fourier, size_t batch_count)
+{
+    size_t const N = fourier.sample_count();
+    size_t const signal_stride = N + 1;
+    Signal signals = random_signal(batch_count*signal_stride);
+
+    Signal spectra(batch_count*N);
+    fourier.fft_batch(&spectra[0], &signals[0], batch_count, signal_stride, N);
+
+    Float residue = 0;
+    for (size_t b = 0; b != batch_count; ++b) {
+        Signal signal(&signals[b*signal_stride], &signals[b*signal_stride + N]);
+        Signal spectrum(&spectra[b*N], &spectra[b*N + N]);
+        residue = std::max(residue, error(fft(signal), spectrum));
+    }
+    return residue;
+}
+
+// Transforms of the given sizes submitted together, several of each, in a
+// stream that mixes small and large.
+static Float prop_hybrid_equals_fft(HybridScheduler& scheduler, std::vector<size_t> const& sizes)
+{
+    std::vector<Signal> signals;
+    for (int round = 0; round != 3; ++round) {
+        for (size_t N : sizes) {
+            signals.push_back(random_signal(N));
+        }
+    }
+
+    std::vector<Signal> spectra;
+    for (auto& signal : signals) {
+        spectra.push_back(Signal(signal.size()));
+    }
+    for (size_t k = 0; k != signals.size(); ++k) {
+        scheduler.submit(&spectra[k][0], &signals[k][0], signals[k].size());
+    }
+    scheduler.wait();
+
+    Float residue = 0;
+    for (size_t k = 0; k != signals.size(); ++k) {
+        residue = std::max(residue, error(fft(signals[k]), spectra[k]));
+    }
+    return residue;
+}
+
+// Submits job_count transforms of N samples and waits for them.
+static std::vector<HybridScheduler::Utilisation> run_hybrid_jobs(HybridScheduler& scheduler, size_t N, size_t job_count)
+{
+    scheduler.wait();
+    scheduler.reset_utilisation();
+
+    Signal signal = random_signal(N);
+    std::vector<Signal> spectra(job_count, Signal(N));
+    for (auto& spectrum : spectra) {
+        scheduler.submit(&spectrum[0], &signal[0], N);
+    }
+    scheduler.wait();
+    return scheduler.utilisation();
+}
+
+// Every job is counted by exactly one backend.
+static bool prop_hybrid_counts_every_job(HybridScheduler& scheduler, size_t N, size_t job_count)
+{
+    size_t counted = 0;
+    for (auto& backend : run_hybrid_jobs(scheduler, N, job_count)) {
+        counted += backend.job_count;
+    }
+    return counted == job_count;
+}
+
+// Jobs below the crossover of device 0 go to the CPU queue, so the device
+// only runs what it steals; jobs at or above it go to the device queue, so
+// the CPU only runs what it steals. Assumes a single device.
+static bool prop_hybrid_routes_by_crossover(HybridScheduler& scheduler, size_t job_count)
+{
+    assert(scheduler.device_count() == 1);
+    size_t crossover = scheduler.crossover(0);
+    assert(crossover >= 2 && is_power_of_two(crossover));
+
+    auto below = run_hybrid_jobs(scheduler, crossover/2, job_count);
+    auto above = run_hybrid_jobs(scheduler, crossover, job_count);
+    return below[0].stolen_count == 0
+        && below[1].job_count == below[1].stolen_count
+        && below[0].job_count + below[1].job_count == job_count
+        && above[1].stolen_count == 0
+        && above[0].job_count == above[0].stolen_count
+        && above[0].job_count + above[1].job_count == job_count;
+}
+
+// With every job routed to the device, its queue fills faster than its one
+// worker drains it and the idle CPU workers have to steal from it.
+static bool prop_hybrid_cpu_steals_from_device(HybridScheduler& scheduler, size_t N, size_t job_count)
+{
+    assert(scheduler.device_count() == 1);
+    size_t crossover = scheduler.crossover(0);
+    scheduler.set_crossover(0, 1);
+
+    auto utilisation = run_hybrid_jobs(scheduler, N, job_count);
+    scheduler.set_crossover(0, crossover);
+    return utilisation[0].stolen_count != 0
+        && utilisation[0].job_count + utilisation[1].job_count == job_count;
+}
+
+static bool prop_split_by_weight(std::vector<double> const& weights, size_t count, std::vector<size_t> const& expected)
+{
+    return split_by_weight(weights, count) == expected;
+}
+
+static Float prop_fftcl_rfft_equals_rfft(Fourier& fourier, RealSignal const& signal)
+{
+    assert(fourier.sample_count() == signal.size());
+
+    Signal expected(signal.size()/2 + 1);
+    rfft(&expected[0], &signal[0], signal.size());
+
+    Signal actual(signal.size()/2 + 1);
+    fourier.rfft(&actual[0], &signal[0]);
+
+    return error(expected, actual);
+}
+
+static Float prop_fftcl_irfft_equals_irfft(Fourier& fourier, Signal const& spectrum)
+{
+    size_t const N = fourier.sample_count();
+    assert(spectrum.size() == N/2 + 1);
+
+    RealSignal expected(N);
+    irfft(&expected[0], &spectrum[0], N);
+
+    RealSignal actual(N);
+    fourier.irfft(&actual[0], &spectrum[0]);
+
+    return error(Signal(expected.begin(), expected.end()), Signal(actual.begin(), actual.end()));
+}
+
+static Float prop_fftcl_equals_fft(Fourier& fourier, Signal const& signal)
+{
+    assert(fourier.sample_count() == signal.size());
+
+    Signal expected = fft(signal);
+
+    Signal actual(signal.size());
+    fourier.fft(&actual[0], &signal[0]);
+
+    return error(expected, actual);
+}
+
+// A Global fft() on a profiling device counts as one write, one fft_init
+// launch, some fft_step launches and one read, with every command of a
+// label in its histogram.
+static bool prop_profiler_counts_commands()
+{
+    auto device = std::make_shared<OpenClDevice>(select_device(), true);
+    Fourier fourier(device, 10);
+    fourier.set_variant(Fourier::Variant::Global);
+    fourier.set_zero_copy(false);
+
+    Signal signal = random_signal(1024);
+    Signal spectrum(1024);
+    fourier.fft(&spectrum[0], &signal[0]);
+    fourier.finish();
+
+    std::map<std::string, ClProfiler::Stats> stats = device->profiler()->stats();
+    bool histograms_full = true;
+    for (auto const& entry : stats) {
+        size_t count = 0;
+        for (size_t n : entry.second.run_histogram) {
+            count += n;
+        }
+        histograms_full = histograms_full && count == entry.second.count;
+    }
+
+    device->profiler()->reset();
+
+    return stats.size() == 4
+        && stats["write"].count == 1
+        && stats["write"].bytes == 1024*sizeof(cl_float2)
+        && stats["fft_init"].count == 1
+        && stats["fft_step"].count >= 1
+        && stats["read"].count == 1
+        && histograms_full
+        && device->profiler()->stats().empty();
+}
+
+// Fourier objects on one device set arguments on kernels of their own.
+static bool prop_fouriers_own_their_kernels()
+{
+    auto device = std::make_shared<OpenClDevice>();
+    Fourier a(device, 10);
+    Fourier b(device, 10);
+    return a.kernels().init != b.kernels().init
+        && a.kernels().stockham[2] != b.kernels().stockham[2]
+        && a.kernels().transpose != b.kernels().transpose;
+}
+
+// A second OpenClDevice loads the binary the first one cached, and still
+// transforms correctly.
+static bool prop_fftcl_program_binary_is_cached()
+{
+    char dir[] = "/tmp/cfourier-cache-XXXXXX";
+    if (mkdtemp(dir) == NULL) fatal("Could not create temporary directory.");
+
+    char const* previous = getenv("FOURIER_CACHE_DIR");
+    std::string previous_dir = previous != NULL ? previous : "";
+    setenv("FOURIER_CACHE_DIR", dir, 1);
+
+    bool result;
+    {
+        OpenClDevice built;
+        auto cached = std::make_shared<OpenClDevice>();
+        Fourier fourier(cached, 10);
+
+        result = !built.program_from_cache()
+            && cached->program_from_cache()
+            && cached->program_cache_path() == built.program_cache_path()
+            && prop_fftcl_equals_fft(fourier, random_signal(1024)) < eps;
+
+        std::remove(built.program_cache_path().c_str());
+    }
+    rmdir(dir);
+
+    if (previous != NULL) {
+        setenv("FOURIER_CACHE_DIR", previous_dir.c_str(), 1);
+    }
+    else {
+        unsetenv("FOURIER_CACHE_DIR");
+    }
+
+    return result;
+}
+
+// Zero copy on a signal and spectrum placed at the device's alignment, and
+// the load/store fallback one value past it.
+static Float prop_fftcl_zero_copy_equals_fft(Fourier& fourier, std::shared_ptr<OpenClDevice> device, Signal const& signal)
+{
+    assert(fourier.sample_count() == signal.size());
+
+    size_t const N = signal.size();
+    size_t const pad = device->mem_base_addr_align()/sizeof(Complex) + 1;
+    std::vector<Complex> x(N + 2*pad);
+    std::vector<Complex> y(N + 2*pad);
+    size_t x_offset = 0;
+    size_t y_offset = 0;
+    while (reinterpret_cast<uintptr_t>(&x[x_offset]) % device->mem_base_addr_align() != 0) ++x_offset;
+    while (reinterpret_cast<uintptr_t>(&y[y_offset]) % device->mem_base_addr_align() != 0) ++y_offset;
+
+    Signal expected = fft(signal);
+
+    bool previous = fourier.zero_copy();
+    fourier.set_zero_copy(true);
+    Float residue = 0;
+    for (size_t shift = 0; shift != 2; ++shift) {
+        Complex* spectrum = &y[y_offset + shift];
+        Complex* in = &x[x_offset + shift];
+        std::copy(signal.begin(), signal.end(), in);
+        if (fourier.uses_zero_copy(spectrum, in) != (shift == 0)) residue = 1;
+
+        fourier.fft(spectrum, in);
+        residue = std::max(residue, error(expected, Signal(spectrum, spectrum + N)));
+    }
+    fourier.set_zero_copy(previous);
+    return residue;
+}
+
+// More signals than buffer sets, so submit() has to recycle them.
+static Float prop_fftcl_pipeline_equals_fft(Fourier& fourier, size_t signal_count)
+{
+    size_t const N = fourier.sample_count();
+    Signal signals = random_signal(signal_count*N);
+    Signal spectra(signal_count*N);
+
+    for (size_t k = 0; k != signal_count; ++k) {
+        fourier.submit(&spectra[k*N], &signals[k*N]);
+    }
+    fourier.complete();
+
+    Float residue = 0;
+    for (size_t k = 0; k != signal_count; ++k) {
+        Signal signal(&signals[k*N], &signals[k*N + N]);
+        Signal spectrum(&spectra[k*N], &spectra[k*N + N]);
+        residue = std::max(residue, error(fft(signal), spectrum));
+    }
+    return residue;
+}
+
+static Float prop_fftcl_tuning_equals_fft(
+        Fourier& fourier,
+        Fourier::Variant variant,
+        cl_uint radix_power,
+        size_t group_size,
+        Signal const& signal)
+{
+    Fourier::Tuning previous = fourier.tuning();
+    fourier.set_tuning(Fourier::Tuning{variant, radix_power, group_size});
+    Float residue = prop_fftcl_equals_fft(fourier, signal);
+    fourier.set_tuning(previous);
+    return residue;
+}
+
+static Float prop_fftcl_autotuned_equals_fft(Fourier& fourier, Signal const& signal)
+{
+    Fourier::Tuning previous = fourier.tuning();
+    fourier.autotune();
+    Float residue = prop_fftcl_equals_fft(fourier, signal);
+    fourier.set_tuning(previous);
+    return residue;
+}
+
+// Lines that do not parse or that the device cannot launch are skipped
+// rather than fatal.
+static bool prop_fftcl_tuning_file_skips_bad_lines(Fourier& fourier)
+{
+    std::string const path = "_test.tuning";
+    Fourier::Tuning previous = fourier.tuning();
+
+    // The device, driver and size fields of this Fourier's own line.
+    fourier.save_tuning(path);
+    std::string key;
+    {
+        std::ifstream f(path);
+        std::getline(f, key);
     }
+    for (int i = 0; i != 3; ++i) {
+        key = key.substr(0, key.rfind('\t'));
+    }
+    key += '\t';
 
-    size_t byte_count() const
     {
-        return sample_count()*sizeof(cl_float2);
+        std::ofstream f(path);
+        f << key << "stockham\tx\t64\n"
+          << key << "stockham\t2\t-1\n"
+          << key << "stockham\t2\t64junk\n"
+          << key << "stockham\t2\t99999999999999999999999\n"
+          << key << "global\t3\t" << 2*fourier.sample_count() << "\n"
+          << key << "global\t3\t48\n";
     }
+    bool loaded_bad = fourier.load_tuning(path);
+    Fourier::Tuning unchanged = fourier.tuning();
 
-    size_t sample_count() const
     {
-        return 1 << m_sample_power;
+        std::ofstream f(path, std::ios::app);
+        f << key << "stockham\t2\t8\n";
     }
+    bool loaded_good = fourier.load_tuning(path);
+    Fourier::Tuning tuning = fourier.tuning();
+
+    std::remove(path.c_str());
+    fourier.set_tuning(previous);
+
+    return !loaded_bad
+        && unchanged.variant == previous.variant
+        && unchanged.group_size == previous.group_size
+        && loaded_good
+        && tuning.variant == Fourier::Variant::Stockham
+        && tuning.radix_power == 2
+        && tuning.group_size == 8;
+}
 
-private:
-    size_t m_sample_power;
-    cl_mem m_y2_mem;
-    cl_mem m_y1_mem;
-    cl_mem m_x_mem;
-    cl_kernel m_step_kernel;
-    cl_kernel m_init_kernel;
-    cl_program m_program;
-    cl_command_queue m_queue;
-    cl_context m_context;
-};
+static bool prop_fftcl_tuning_file_round_trips(Fourier& fourier)
+{
+    std::string const path = "_test.tuning";
+    Fourier::Tuning previous = fourier.tuning();
+    std::remove(path.c_str());
+
+    // Saving twice must replace the first line rather than add another.
+    fourier.set_tuning(Fourier::Tuning{Fourier::Variant::Global, 3, 0});
+    fourier.save_tuning(path);
+    fourier.set_tuning(Fourier::Tuning{Fourier::Variant::Stockham, 2, 64});
+    fourier.save_tuning(path);
+
+    fourier.set_tuning(Fourier::Tuning{Fourier::Variant::Local, 3, 0});
+    bool loaded = fourier.load_tuning(path);
+    Fourier::Tuning tuning = fourier.tuning();
+
+    std::ifstream f(path);
+    size_t line_count = std::count(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>(), '\n');
+
+    std::remove(path.c_str());
+    fourier.set_tuning(previous);
+
+    return loaded
+        && tuning.variant == Fourier::Variant::Stockham
+        && tuning.radix_power == 2
+        && tuning.group_size == 64
+        && line_count == 1;
+}
 
-static void print_reverse_bits_table() __attribute((unused));
-static void print_reverse_bits_table()
+static bool prop_fourier_cache_counts_hits_and_misses(std::shared_ptr<OpenClDevice> device)
 {
-    std::stringstream ss;
+    FourierCache cache(device);
+    std::shared_ptr<Fourier> first = cache.plan(10);
+    cache.plan(12);
+    std::shared_ptr<Fourier> again = cache.plan(10);
+
+    return first == again
+        && cache.hits() == 1
+        && cache.misses() == 2
+        && cache.evictions() == 0
+        && cache.size() == 2;
+}
 
-    for (size_t row = 0; row != 16; ++row) {
-        for (size_t column = 0; column != 16; ++column) {
-            ss << std::hex << std::setw(2) << std::setfill('0');
-            ss << reverse_bits(row*16+column, 256) << " ";
+// A fresh plan holds three buffers of its size, so the 2^10, 2^11 and 2^12
+// plans take 1, 2 and 4 units. With room for 5, requesting 2^12 drops 2^11,
+// which was used less recently than 2^10.
+static bool prop_fourier_cache_evicts_least_recently_used(std::shared_ptr<OpenClDevice> device)
+{
+    size_t const unit = 3*(1 << 10)*sizeof(cl_float2);
+    FourierCache cache(device, 5*unit);
+    cache.plan(10);
+    cache.plan(11);
+    cache.plan(10);
+    cache.plan(12);
+
+    bool evicted = cache.evictions() == 1 && cache.size() == 2 && cache.byte_count() <= cache.byte_budget();
+    size_t misses = cache.misses();
+    cache.plan(10);
+    bool kept_10 = cache.misses() == misses;
+    cache.plan(11);
+    bool dropped_11 = cache.misses() == misses + 1;
+
+    return evicted && kept_10 && dropped_11;
+}
+
+// Plans of several sizes from one cache transform correctly when used in
+// turn.
+static Float prop_fourier_cache_equals_fft(std::shared_ptr<OpenClDevice> device)
+{
+    FourierCache cache(device);
+    Float residue = 0;
+    for (size_t power : {4, 10, 7, 10, 4}) {
+        residue = std::max(residue, prop_fftcl_equals_fft(*cache.plan(power), random_signal((size_t) 1 << power)));
+    }
+    return residue;
+}
+
+static void benchmark_plan()
+{
+    std::cout << "N, fft_radix2() ns, FftPlan ns, speedup\n";
+
+    for (size_t power = 10; power <= 20; ++power) {
+        size_t N = 1 << power;
+        Signal signal = random_signal(N);
+        Signal spectrum(N);
+        FftPlan plan(N);
+
+        double before = time_per_call_ns([&] { spectrum = fft_radix2(signal); });
+        double after = time_per_call_ns([&] { plan.fft(&spectrum[0], &signal[0]); });
+
+        std::cout << N << ", " << before << ", " << after << ", " << before/after << "\n";
+    }
+}
+
+// FftPlan with and without codelets: alone up to max_codelet_size, then as
+// the leaves of the passes.
+static void benchmark_codelets()
+{
+    std::cout << "N, fft_radix2() ns, passes ns, codelets ns, speedup\n";
+
+    for (size_t N = 2; N <= 4096; N *= 2) {
+        Signal signal = random_signal(N);
+        Signal spectrum(N);
+        FftPlan passes(N, best_radix4_kernel(), false);
+        FftPlan codelets(N);
+        // Enough calls per clock reading that the clock does not dominate.
+        size_t const repeat = std::max((size_t) 1, 4096/N);
+
+        double radix2_ns = time_per_call_ns([&] { spectrum = fft_radix2(signal); });
+        double passes_ns = time_per_call_ns([&] {
+            for (size_t r = 0; r != repeat; ++r) passes.fft(&spectrum[0], &signal[0]);
+        })/repeat;
+        double codelets_ns = time_per_call_ns([&] {
+            for (size_t r = 0; r != repeat; ++r) codelets.fft(&spectrum[0], &signal[0]);
+        })/repeat;
+
+        std::cout << N << ", " << radix2_ns << ", " << passes_ns << ", " << codelets_ns << ", " << passes_ns/codelets_ns << "\n";
+    }
+}
+
+static void benchmark_kernels()
+{
+    std::cout << "N";
+    for (auto& kernel : radix4_kernels()) {
+        std::cout << ", " << kernel.name << " ns";
+    }
+    std::cout << "\n";
+
+    for (size_t power = 10; power <= 20; ++power) {
+        size_t N = 1 << power;
+        Signal signal = random_signal(N);
+        Signal spectrum(N);
+
+        std::cout << N;
+        for (auto& kernel : radix4_kernels()) {
+            FftPlan plan(N, kernel);
+            std::cout << ", " << time_per_call_ns([&] { plan.fft(&spectrum[0], &signal[0]); });
         }
-        ss << "\n";
+        std::cout << "\n";
     }
+}
 
-    std::cout << ss.str();
+static void benchmark_threads()
+{
+    size_t const max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<size_t> thread_counts;
+    for (size_t threads = 1; threads < max_threads; threads <<= 1) {
+        thread_counts.push_back(threads);
+    }
+    thread_counts.push_back(max_threads);
+
+    std::cout << "N, threads, ns, speedup\n";
+
+    for (size_t power = 18; power <= 22; power += 2) {
+        size_t N = 1 << power;
+        Signal signal = random_signal(N);
+        Signal spectrum(N);
+        FftPlan plan(N);
+
+        double serial = time_per_call_ns([&] { plan.fft(&spectrum[0], &signal[0]); });
+
+        for (size_t threads : thread_counts) {
+            ThreadPool pool(threads);
+            double parallel = time_per_call_ns([&] { plan.fft(&spectrum[0], &signal[0], pool); });
+
+            std::cout << N << ", " << threads << ", " << parallel << ", " << serial/parallel << "\n";
+        }
+    }
 }
 
-static Float prop_fftcl_init_equals_fft_init(Fourier& fourier, Signal const& signal)
+static void benchmark_batch()
 {
-    assert(fourier.sample_count() == signal.size());
+    size_t const N = 1024;
+    size_t const batch_count = 1000;
+    Signal signals = random_signal(batch_count*N);
+    Signal spectra(batch_count*N);
+
+    double single = time_per_call_ns([&] {
+        for (size_t b = 0; b != batch_count; ++b) {
+            fft(&spectra[b*N], &signals[b*N], N);
+        }
+    });
+    double batched = time_per_call_ns([&] { fft_batch(&spectra[0], &signals[0], N, batch_count); });
 
-    Signal expected(signal.size());
-    fft_init(&expected[0], &signal[0], expected.size());
+    std::cout << "N, batch, per-call ns/transform, fft_batch ns/transform\n";
+    std::cout << N << ", " << batch_count << ", " << single/batch_count << ", " << batched/batch_count << "\n";
+}
 
-    Signal actual(signal.size());
-    fourier.init(&actual[0], &signal[0]);
+static void benchmark_real()
+{
+    std::cout << "N, fft ns, rfft ns, speedup\n";
 
-    return error(expected, actual);
+    for (size_t power = 10; power <= 20; ++power) {
+        size_t N = 1 << power;
+        RealSignal signal = random_real_signal(N);
+        Signal widened(signal.begin(), signal.end());
+        Signal spectrum(N);
+
+        double complex = time_per_call_ns([&] { fft(&spectrum[0], &widened[0], N); });
+        double real = time_per_call_ns([&] { rfft(&spectrum[0], &signal[0], N); });
+
+        std::cout << N << ", " << complex << ", " << real << ", " << complex/real << "\n";
+    }
 }
 
-static Float prop_fftcl_step_equals_fft_step(Fourier& fourier, Signal const& signal)
+// Lengths that are not powers of two, against the O(N^2) dft(). 1009 and
+// 4099 are prime and take the Bluestein path.
+static void benchmark_any_size()
 {
-    assert(fourier.sample_count() == signal.size());
+    std::cout << "N, bluestein, dft() ns, GeneralFftPlan ns, speedup\n";
 
-    size_t B = 128;
-    size_t transform_count = signal.size()/B;
-    assert(B >= 1);
+    for (size_t N : {360, 1000, 1009, 3000, 4099}) {
+        Signal signal = random_signal(N);
+        Signal spectrum(N);
+        GeneralFftPlan plan(N);
 
-    Signal expected = signal;
-    fft_step(&expected[0], transform_count/2, 2*B);
+        double naive = time_per_call_ns([&] { spectrum = dft(signal); });
+        double planned = time_per_call_ns([&] { plan.fft(&spectrum[0], &signal[0]); });
 
-    Signal actual(signal.size());
-    fourier.step(&actual[0], &signal[0], B);
+        std::cout << N << ", " << plan.uses_bluestein() << ", " << naive << ", " << planned << ", " << naive/planned << "\n";
+    }
+}
 
-    return error(expected, actual);
+// Fourier::fft per kernel variant, including the transfers.
+static void benchmark_opencl()
+{
+    auto variants = {Fourier::Variant::Global, Fourier::Variant::Local, Fourier::Variant::Stockham};
+
+    std::cout << "N";
+    for (auto variant : variants) {
+        std::cout << ", " << Fourier::variant_name(variant) << " ns";
+    }
+    std::cout << "\n";
+
+    for (size_t power = 10; power <= 20; power += 2) {
+        size_t N = 1 << power;
+        Signal signal = random_signal(N);
+        Signal spectrum(N);
+        Fourier fourier(power);
+
+        std::cout << N;
+        for (auto variant : variants) {
+            fourier.set_variant(variant);
+            std::cout << ", " << time_per_call_ns([&] { fourier.fft(&spectrum[0], &signal[0]); });
+        }
+        std::cout << "\n";
+    }
 }
 
-static Float prop_fftcl_equals_fft(Fourier& fourier, Signal const& signal)
+// Fourier::fft_batch on the preferred device against ShardedFourier over
+// every device, weighted by calibrate().
+static void benchmark_sharded()
 {
-    assert(fourier.sample_count() == signal.size());
+    size_t const batch_count = 64;
 
-    Signal expected = fft(signal);
+    std::vector<std::shared_ptr<OpenClDevice>> devices = open_devices();
+    for (size_t i = 0; i != devices.size(); ++i) {
+        std::cout << "device " << i << ": " << devices[i]->device_name() << "\n";
+    }
 
-    Signal actual(signal.size());
-    fourier.fft(&actual[0], &signal[0]);
+    std::cout << "N, batch, one device ns, sharded ns, speedup, shards\n";
+
+    for (size_t power = 10; power <= 20; power += 2) {
+        size_t N = 1 << power;
+        Signal signals = random_signal(batch_count*N);
+        Signal spectra(batch_count*N);
+        ShardedFourier sharded(devices, power);
+        sharded.calibrate();
+
+        Fourier& single = sharded.fourier(0);
+        double one_device = time_per_call_ns([&] {
+            single.fft_batch(&spectra[0], &signals[0], batch_count, N, N);
+        });
+        double all_devices = time_per_call_ns([&] {
+            sharded.fft_batch(&spectra[0], &signals[0], batch_count, N, N);
+        });
+
+        std::cout << N << ", " << batch_count << ", " << one_device << ", " << all_devices << ", " << one_device/all_devices << ",";
+        for (size_t count : sharded.shard_counts(batch_count)) {
+            std::cout << " " << count;
+        }
+        std::cout << "\n";
+    }
+}
 
-    return error(expected, actual);
+// Direct convolution against FftConvolver's two methods and the device
+// chain, per filter length, on one long signal.
+static void benchmark_convolution()
+{
+    size_t const signal_size = 1 << 16;
+    Signal signal = random_signal(signal_size);
+    std::shared_ptr<OpenClDevice> device;
+    if (!find_devices().empty()) device = std::make_shared<OpenClDevice>();
+
+    std::cout << "signal, filter, direct ns, overlap-save ns, overlap-add ns, device ns, speedup\n";
+
+    for (size_t filter_size = 16; filter_size <= 4096; filter_size *= 4) {
+        Signal filter = random_signal(filter_size);
+        FftConvolver overlap_save(filter, BlockMethod::OverlapSave);
+        FftConvolver overlap_add(filter, BlockMethod::OverlapAdd);
+
+        double direct_ns = time_per_call_ns([&] { direct_convolve(signal, filter); });
+        double save_ns = time_per_call_ns([&] { overlap_save.convolve(signal); });
+        double add_ns = time_per_call_ns([&] { overlap_add.convolve(signal); });
+        double device_ns = 0;
+        if (device) {
+            FourierConvolver device_convolver(device, filter);
+            device_ns = time_per_call_ns([&] { device_convolver.convolve(signal); });
+        }
+
+        std::cout
+            << signal_size << ", " << filter_size << ", "
+            << direct_ns << ", " << save_ns << ", " << add_ns << ", " << device_ns << ", "
+            << direct_ns/std::min(save_ns, add_ns) << "\n";
+    }
+}
+
+// Multidimensional transforms of square and non-square shapes: the
+// gather-scatter row-column method against FftPlanNd's blocked transposes,
+// and FourierNd including the copies to and from the device.
+static void benchmark_nd()
+{
+    std::shared_ptr<OpenClDevice> device;
+    if (!find_devices().empty()) device = std::make_shared<OpenClDevice>();
+
+    std::cout << "shape, strided ns, blocked ns, device ns, speedup\n";
+
+    std::vector<std::vector<size_t>> const shapes = {
+        {256, 256}, {1024, 1024}, {4096, 4096}, {1024, 4096}, {4096, 256},
+        {64, 64, 64}, {128, 128, 128}, {256, 256, 64},
+    };
+    for (auto& shape : shapes) {
+        FftPlanNd plan(shape);
+        Signal signal = random_signal(plan.size());
+        Signal spectrum(plan.size());
+
+        double strided_ns = time_per_call_ns([&] {
+            std::copy(signal.begin(), signal.end(), spectrum.begin());
+            strided_fft_nd(&spectrum[0], shape);
+        });
+        double blocked_ns = time_per_call_ns([&] { plan.fft(&spectrum[0], &signal[0]); });
+        double device_ns = 0;
+        if (device) {
+            std::vector<size_t> sample_powers;
+            for (size_t n : shape) {
+                sample_powers.push_back((size_t) std::log2(n));
+            }
+            FourierNd fourier(device, sample_powers);
+            device_ns = time_per_call_ns([&] { fourier.fft(&spectrum[0], &signal[0]); });
+        }
+
+        for (size_t axis = 0; axis != shape.size(); ++axis) {
+            std::cout << (axis == 0 ? "" : "x") << shape[axis];
+        }
+        std::cout << ", " << strided_ns << ", " << blocked_ns << ", " << device_ns << ", " << strided_ns/blocked_ns << "\n";
+    }
+}
+
+// A StftStream fed in chunks as fast as it accepts them, per frame size and
+// batch size.
+static void benchmark_stft()
+{
+    size_t const sample_count = 1 << 22;
+    size_t const chunk_size = 4096;
+    RealSignal signal = random_real_signal(sample_count);
+
+    std::cout << "frame, hop, batch, frames/s, mean latency ns, max latency ns, transform ns/frame\n";
+
+    for (size_t frame_size : {256, 1024, 4096}) {
+        for (size_t max_batch : {1, 16}) {
+            size_t const hop_size = frame_size/4;
+            typedef std::chrono::steady_clock Clock;
+
+            Clock::time_point start = Clock::now();
+            StftStream stream(frame_size, hop_size, Window::Hann, [](StftFrame const&) {}, max_batch);
+            for (size_t offset = 0; offset < sample_count; offset += chunk_size) {
+                stream.write(&signal[offset], chunk_size);
+            }
+            stream.close();
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+            StftStream::Stats stats = stream.stats();
+            std::cout
+                << frame_size << ", " << hop_size << ", " << max_batch << ", "
+                << stats.frame_count/seconds << ", "
+                << stats.mean_latency_ns << ", " << stats.max_latency_ns << ", "
+                << stats.mean_transform_ns << "\n";
+        }
+    }
+}
+
+// A stream of transforms of mixed sizes on the CPU threads alone, then on
+// the CPU threads and every device with measured crossovers.
+static void benchmark_hybrid()
+{
+    size_t const thread_count = default_thread_pool().thread_count();
+    std::vector<Signal> signals;
+    for (int round = 0; round != 8; ++round) {
+        for (size_t power = 6; power <= 18; power += 2) {
+            signals.push_back(random_signal((size_t) 1 << power));
+        }
+    }
+    std::vector<Signal> spectra;
+    for (auto& signal : signals) {
+        spectra.push_back(Signal(signal.size()));
+    }
+
+    auto run = [&](HybridScheduler& scheduler) {
+        for (size_t k = 0; k != signals.size(); ++k) {
+            scheduler.submit(&spectra[k][0], &signals[k][0], signals[k].size());
+        }
+        scheduler.wait();
+    };
+
+    HybridScheduler cpu_only(thread_count, {});
+    double cpu_ns = time_per_call_ns([&] { run(cpu_only); });
+    std::cout << "CPU only: " << cpu_ns << " ns per stream\n";
+    cpu_only.print_utilisation(std::cout);
+
+    HybridScheduler hybrid(thread_count, open_devices());
+    hybrid.calibrate();
+    for (size_t d = 0; d != hybrid.device_count(); ++d) {
+        std::cout << "device " << d << " crossover: " << hybrid.crossover(d) << "\n";
+    }
+    hybrid.reset_utilisation();
+    double hybrid_ns = time_per_call_ns([&] { run(hybrid); });
+    std::cout << "CPU and devices: " << hybrid_ns << " ns per stream, speedup " << cpu_ns/hybrid_ns << "\n";
+    hybrid.print_utilisation(std::cout);
+}
+
+// OutOfCoreFft between files, with a budget of 1/16 of the signal, against
+// fft() in memory.
+static void benchmark_out_of_core()
+{
+    char dir[] = "/tmp/cfourier-out-of-core-XXXXXX";
+    if (mkdtemp(dir) == NULL) fatal("Could not create temporary directory.");
+    std::string const signal_path = std::string(dir) + "/signal";
+    std::string const spectrum_path = std::string(dir) + "/spectrum";
+
+    std::cout << "N, budget bytes, panel width, in memory ns, out of core ns, slowdown\n";
+
+    for (size_t power = 16; power <= 22; power += 2) {
+        size_t N = 1 << power;
+        size_t budget = N*sizeof(Complex)/16;
+        Signal signal = random_signal(N);
+        Signal spectrum(N);
+        write_samples(signal_path, signal);
+        OutOfCoreFft out_of_core(budget);
+
+        double in_memory = time_per_call_ns([&] { fft(&spectrum[0], &signal[0], N); });
+        double on_disk = time_per_call_ns([&] { out_of_core.fft(signal_path, spectrum_path); });
+
+        std::cout
+            << N << ", " << budget << ", " << out_of_core.panel_width(N) << ", "
+            << in_memory << ", " << on_disk << ", " << on_disk/in_memory << "\n";
+    }
+
+    std::remove(spectrum_path.c_str());
+    std::remove(signal_path.c_str());
+    rmdir(dir);
+}
+
+// Blocking Fourier::fft calls against the submit()/complete() pipeline.
+static void benchmark_pipeline()
+{
+    size_t const signal_count = 64;
+
+    std::cout << "N, signals, blocking ns/signal, pipelined ns/signal, speedup\n";
+
+    for (size_t power = 10; power <= 20; power += 2) {
+        size_t N = 1 << power;
+        Signal signals = random_signal(signal_count*N);
+        Signal spectra(signal_count*N);
+        Fourier fourier(power);
+
+        double blocking = time_per_call_ns([&] {
+            for (size_t k = 0; k != signal_count; ++k) {
+                fourier.fft(&spectra[k*N], &signals[k*N]);
+            }
+        });
+        double pipelined = time_per_call_ns([&] {
+            for (size_t k = 0; k != signal_count; ++k) {
+                fourier.submit(&spectra[k*N], &signals[k*N]);
+            }
+            fourier.complete();
+        });
+
+        std::cout
+            << N << ", " << signal_count << ", "
+            << blocking/signal_count << ", " << pipelined/signal_count << ", "
+            << blocking/pipelined << "\n";
+    }
+}
+
+// One row of the benchmark suite: batch_count transforms of N samples by
+// name, taking ns nanoseconds per transform.
+struct SuiteResult
+{
+    std::string name;
+    size_t N;
+    size_t batch_count;
+    double ns;
+
+    // Nominal 5 N log2(N) flops per transform, the usual FFT convention, so
+    // that dft() is comparable with the fast paths.
+    double gflops() const
+    {
+        return 5*N*std::log2((double) N)/ns;
+    }
+
+    // The signal read and the spectrum written per transform.
+    double bytes_per_second() const
+    {
+        return 2*N*sizeof(Complex)*1e9/ns;
+    }
+};
+
+// Best of three time_per_call_ns() readings for fn, which runs repeat
+// transforms.
+template <typename F>
+static double suite_ns(size_t repeat, F fn)
+{
+    double best = std::numeric_limits<double>::infinity();
+    for (size_t sample = 0; sample != 3; ++sample) {
+        best = std::min(best, time_per_call_ns(fn)/repeat);
+    }
+    return best;
+}
+
+static void write_suite_csv_header(std::ostream& out)
+{
+    out << "name,N,batch,ns_per_transform,gflops,bytes_per_second\n";
+}
+
+static void write_suite_csv_row(std::ostream& out, SuiteResult const& result)
+{
+    out
+        << result.name << "," << result.N << "," << result.batch_count << ","
+        << result.ns << "," << result.gflops() << "," << result.bytes_per_second() << "\n";
+}
+
+static void write_suite_json(std::ostream& out, std::vector<SuiteResult> const& results)
+{
+    out << "[\n";
+    for (size_t i = 0; i != results.size(); ++i) {
+        SuiteResult const& result = results[i];
+        out
+            << "  {\"name\": \"" << result.name << "\""
+            << ", \"N\": " << result.N
+            << ", \"batch\": " << result.batch_count
+            << ", \"ns_per_transform\": " << result.ns
+            << ", \"gflops\": " << result.gflops()
+            << ", \"bytes_per_second\": " << result.bytes_per_second()
+            << "}" << (i + 1 == results.size() ? "\n" : ",\n");
+    }
+    out << "]\n";
+}
+
+// dft(), fft(), ifft() and fft_batch() on the CPU, and Fourier::fft and
+// Fourier::fft_batch when there is a device, for N = 2^4 to 2^max_power and
+// batches of up to 2^max_power samples. Rows are echoed to stdout as they
+// are measured.
+static std::vector<SuiteResult> run_benchmark_suite(size_t max_power)
+{
+    size_t const max_dft_power = 12;
+    size_t const max_sample_count = (size_t) 1 << max_power;
+    std::shared_ptr<OpenClDevice> device;
+    if (!find_devices().empty()) device = std::make_shared<OpenClDevice>();
+
+    std::vector<SuiteResult> results;
+    auto add = [&](char const* name, size_t N, size_t batch_count, double ns) {
+        results.push_back(SuiteResult{name, N, batch_count, ns});
+        write_suite_csv_row(std::cout, results.back());
+    };
+
+    write_suite_csv_header(std::cout);
+    for (size_t power = 4; power <= max_power; ++power) {
+        size_t N = (size_t) 1 << power;
+        Signal signal = random_signal(N);
+        Signal spectrum(N);
+        // Enough transforms per clock reading that the clock does not
+        // dominate at small N.
+        size_t const repeat = std::max((size_t) 1, ((size_t) 1 << 16)/N);
+
+        if (power <= max_dft_power) {
+            add("dft", N, 1, suite_ns(1, [&] { spectrum = dft(signal); }));
+        }
+        add("fft", N, 1, suite_ns(repeat, [&] {
+            for (size_t r = 0; r != repeat; ++r) fft(&spectrum[0], &signal[0], N);
+        }));
+        add("ifft", N, 1, suite_ns(repeat, [&] {
+            for (size_t r = 0; r != repeat; ++r) ifft(&spectrum[0], &signal[0], N);
+        }));
+
+        std::unique_ptr<Fourier> fourier;
+        if (device) {
+            fourier.reset(new Fourier(device, power));
+            add("Fourier::fft", N, 1, suite_ns(1, [&] { fourier->fft(&spectrum[0], &signal[0]); }));
+        }
+
+        for (size_t batch_count : {16, 256}) {
+            if (N*batch_count > max_sample_count) break;
+
+            Signal signals = random_signal(batch_count*N);
+            Signal spectra(batch_count*N);
+            add("fft_batch", N, batch_count, suite_ns(batch_count, [&] {
+                fft_batch(&spectra[0], &signals[0], N, batch_count);
+            }));
+            if (fourier) {
+                add("Fourier::fft_batch", N, batch_count, suite_ns(batch_count, [&] {
+                    fourier->fft_batch(&spectra[0], &signals[0], batch_count, N, N);
+                }));
+            }
+        }
+    }
+    return results;
+}
+
+// Rows of a file written by write_suite_csv_row(), after its header.
+static std::vector<SuiteResult> read_suite_csv(std::string const& path)
+{
+    std::ifstream in(path);
+    if (!in) fatal("Could not open " + path + ".");
+
+    std::vector<SuiteResult> results;
+    std::string line;
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string name, N, batch_count, ns;
+        if (!std::getline(fields, name, ',')
+                || !std::getline(fields, N, ',')
+                || !std::getline(fields, batch_count, ',')
+                || !std::getline(fields, ns, ',')) {
+            fatal("Malformed line in " + path + ": " + line);
+        }
+        results.push_back(SuiteResult{name, std::stoul(N), std::stoul(batch_count), std::stod(ns)});
+    }
+    return results;
+}
+
+// Prints each row of current that is more than tolerance slower per
+// transform than the same row of baseline, and returns how many there are.
+// Rows in only one of the two are skipped.
+static size_t compare_suites(
+        std::vector<SuiteResult> const& baseline,
+        std::vector<SuiteResult> const& current,
+        double tolerance)
+{
+    std::map<std::tuple<std::string, size_t, size_t>, double> baseline_ns;
+    for (SuiteResult const& result : baseline) {
+        baseline_ns[std::make_tuple(result.name, result.N, result.batch_count)] = result.ns;
+    }
+
+    size_t regressions = 0;
+    for (SuiteResult const& result : current) {
+        auto found = baseline_ns.find(std::make_tuple(result.name, result.N, result.batch_count));
+        if (found == baseline_ns.end() || result.ns <= found->second*(1 + tolerance)) continue;
+
+        ++regressions;
+        std::cout
+            << result.name << " N=" << result.N << " batch=" << result.batch_count
+            << ": " << found->second << " ns -> " << result.ns << " ns ("
+            << result.ns/found->second << "x)\n";
+    }
+    std::cout << regressions << " regressions beyond " << 100*tolerance << "%\n";
+    return regressions;
+}
+
+static int process_usage()
+{
+    std::cout
+        << "usage: cfourier process [options] <input> <output>\n"
+        << "  --format=cf32|ci16|f32|i16  interleaved I/Q or real samples (cf32)\n"
+        << "  --frame=N                   samples per frame (1024)\n"
+        << "  --hop=N                     samples between frame starts (frame)\n"
+        << "  --batch=N                   frames per transform call (64)\n"
+        << "  --window=rect|hann|hamming|blackman  (rect)\n"
+        << "  --magnitude                 write float32 |X| instead of complex X\n"
+        << "  --device                    transform on the preferred OpenCL device\n";
+    return 1;
+}
+
+// cfourier process: process_sample_file() from the command line, on the CPU
+// or, with --device, through Fourier::fft_batch.
+static int process_command(int argc, char** argv)
+{
+    SampleFileOptions options{SampleFormat::ComplexFloat32, 1024, 0, 64, Window::Rectangular, false};
+    bool use_device = false;
+    std::vector<std::string> paths;
+
+    for (int i = 0; i != argc; ++i) {
+        std::string arg = argv[i];
+        size_t equals = arg.find('=');
+        std::string name = arg.substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : arg.substr(equals + 1);
+
+        if (name == "--format") {
+            if (value == "cf32") options.format = SampleFormat::ComplexFloat32;
+            else if (value == "ci16") options.format = SampleFormat::ComplexInt16;
+            else if (value == "f32") options.format = SampleFormat::RealFloat32;
+            else if (value == "i16") options.format = SampleFormat::RealInt16;
+            else return process_usage();
+        }
+        else if (name == "--window") {
+            if (value == "rect") options.window = Window::Rectangular;
+            else if (value == "hann") options.window = Window::Hann;
+            else if (value == "hamming") options.window = Window::Hamming;
+            else if (value == "blackman") options.window = Window::Blackman;
+            else return process_usage();
+        }
+        else if (name == "--frame") options.frame_size = std::strtoul(value.c_str(), NULL, 10);
+        else if (name == "--hop") options.hop_size = std::strtoul(value.c_str(), NULL, 10);
+        else if (name == "--batch") options.batch_size = std::strtoul(value.c_str(), NULL, 10);
+        else if (arg == "--magnitude") options.magnitude = true;
+        else if (arg == "--device") use_device = true;
+        else if (arg.compare(0, 2, "--") == 0) return process_usage();
+        else paths.push_back(arg);
+    }
+    if (options.hop_size == 0) options.hop_size = options.frame_size;
+    if (paths.size() != 2 || options.frame_size == 0 || options.hop_size == 0 || options.batch_size == 0) {
+        return process_usage();
+    }
+
+    std::unique_ptr<Fourier> fourier;
+    StftStream::BatchTransform transform = fft_batch;
+    if (use_device) {
+        if (!is_power_of_two(options.frame_size)) fatal("The device needs a power of two frame size.");
+        size_t power = 0;
+        while (((size_t) 1 << power) < options.frame_size) ++power;
+        fourier.reset(new Fourier(power));
+        transform = [&](Complex* spectra, Complex const* signals, size_t N, size_t batch_count) {
+            fourier->fft_batch(spectra, signals, batch_count, N, N);
+        };
+    }
+
+    SampleFileStats stats = process_sample_file(options, paths[0], paths[1], transform);
+    std::cout
+        << stats.frame_count << " frames, "
+        << stats.bytes_read << " bytes read, "
+        << stats.bytes_written << " bytes written in "
+        << stats.seconds << " s: "
+        << 1e-6*stats.bytes_read/stats.seconds << " MB/s in, "
+        << 1e-6*stats.bytes_written/stats.seconds << " MB/s out\n";
+    return 0;
 }
 
-int main()
+int main(int argc, char** argv)
 {
-    Fourier fourier(10);
+    if (argc > 1 && std::string(argv[1]) == "list") {
+        print_platforms();
+        return 0;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "tune") {
+        for (size_t power = 10; power <= 20; ++power) {
+            Fourier fourier(power);
+            Fourier::Tuning const& tuning = fourier.autotune();
+            fourier.save_tuning(tuning_file_path());
+
+            std::cout
+                << ((size_t) 1 << power)
+                << ": variant=" << Fourier::variant_name(tuning.variant)
+                << ", radix=" << (1 << tuning.radix_power)
+                << ", group_size=" << tuning.group_size
+                << "\n";
+        }
+        return 0;
+    }
+
+    // suite <prefix> [max_power] writes <prefix>.csv and <prefix>.json.
+    if (argc > 2 && std::string(argv[1]) == "suite") {
+        std::string prefix = argv[2];
+        size_t max_power = argc > 3 ? std::stoul(argv[3]) : 24;
+        std::vector<SuiteResult> results = run_benchmark_suite(max_power);
+
+        std::ofstream csv(prefix + ".csv");
+        write_suite_csv_header(csv);
+        for (SuiteResult const& result : results) {
+            write_suite_csv_row(csv, result);
+        }
+        std::ofstream json(prefix + ".json");
+        write_suite_json(json, results);
+        if (!csv || !json) fatal("Could not write " + prefix + ".csv and " + prefix + ".json.");
+        return 0;
+    }
+
+    // compare <baseline.csv> <current.csv> [tolerance] fails when any row
+    // got slower by more than tolerance, 0.1 by default.
+    if (argc > 3 && std::string(argv[1]) == "compare") {
+        double tolerance = argc > 4 ? std::stod(argv[4]) : 0.1;
+        return compare_suites(read_suite_csv(argv[2]), read_suite_csv(argv[3]), tolerance) == 0 ? 0 : 1;
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "process") {
+        return process_command(argc - 2, argv + 2);
+    }
+
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        std::string name = argc > 2 ? argv[2] : "";
+        if (name.empty() || name == "plan") benchmark_plan();
+        if (name.empty() || name == "simd") benchmark_kernels();
+        if (name.empty() || name == "codelets") benchmark_codelets();
+        if (name.empty() || name == "threads") benchmark_threads();
+        if (name.empty() || name == "batch") benchmark_batch();
+        if (name.empty() || name == "real") benchmark_real();
+        if (name.empty() || name == "any") benchmark_any_size();
+        if (name.empty() || name == "stft") benchmark_stft();
+        if (name.empty() || name == "convolution") benchmark_convolution();
+        if (name.empty() || name == "nd") benchmark_nd();
+        if (name.empty() || name == "ooc") benchmark_out_of_core();
+        if (name.empty() || name == "cl") benchmark_opencl();
+        if (name.empty() || name == "pipeline") benchmark_pipeline();
+        if (name.empty() || name == "sharded") benchmark_sharded();
+        if (name.empty() || name == "hybrid") benchmark_hybrid();
+        return 0;
+    }
 
     TEST_RESIDUE(prop_inverse_dft(Signal(1024, 1)));
     TEST_RESIDUE(prop_inverse_dft(random_signal(1024)));
     TEST_RESIDUE(prop_inverse_fft(Signal(2, 1)));
     TEST_RESIDUE(prop_inverse_fft(Signal(1024, 1)));
     TEST_RESIDUE(prop_inverse_fft(random_signal(1024)));
+    TEST_RESIDUE(prop_inverse_fft(random_signal(2048)));
     TEST_RESIDUE(prop_dft_equal_fft(Signal(1024, 1)));
     TEST_RESIDUE(prop_dft_equal_fft(random_signal(4)));
     TEST_RESIDUE(prop_dft_equal_fft(random_signal(1024)));
+    TEST_RESIDUE(prop_dft_equal_fft(random_signal(2048)));
     TEST_RESIDUE(prop_dft_equal_fft(Signal{7,6,5,4,3,2,i,0}));
+    TEST_RESIDUE(prop_dft_equal_fft(random_signal(1)));
+    TEST_RESIDUE(prop_dft_equal_fft(random_signal(6)));
+    TEST_RESIDUE(prop_dft_equal_fft(random_signal(360)));
+    TEST_RESIDUE(prop_dft_equal_fft(random_signal(1000)));
+    TEST_RESIDUE(prop_dft_equal_fft(random_signal(2401)));
+    TEST_RESIDUE(prop_dft_equal_fft(random_signal(3000)));
+    TEST_RESIDUE(prop_dft_equal_fft(random_signal(13)));
+    TEST_RESIDUE(prop_dft_equal_fft(random_signal(1009)));
+    TEST_RESIDUE(prop_dft_equal_fft(random_signal(1001)));
+    TEST_RESIDUE(prop_inverse_fft(random_signal(1000)));
+    TEST_RESIDUE(prop_inverse_fft(random_signal(1009)));
+    TEST_RESIDUE(prop_inverse_fft(random_signal(48000)));
     TEST_RESIDUE(prop_idft_equal_ifft(random_signal(1024)));
     TEST_RESIDUE(prop_idft_equal_ifft(Signal{1.1,i,2.1,3}));
+    TEST_RESIDUE(prop_plan_equal_fft(Signal(1, 1)));
+    TEST_RESIDUE(prop_plan_equal_fft(random_signal(2)));
+    TEST_RESIDUE(prop_plan_equal_fft(random_signal(1024)));
+    TEST_RESIDUE(prop_plan_equal_fft(random_signal(2048)));
+    TEST_RESIDUE(prop_plan_equal_ifft(random_signal(1024)));
+    TEST_RESIDUE(prop_plan_equal_ifft(random_signal(2048)));
+    TEST_RESIDUE(prop_inplace_fft_equal_fft(random_signal(4096)));
+    TEST_RESIDUE(prop_inplace_inverse_fft(random_signal(8192)));
+    for (auto& kernel : radix4_kernels()) {
+        for (size_t N : {2048, 4096}) {
+            std::string args = std::string("(") + kernel.name + ", random_signal(" + std::to_string(N) + "))";
+            test_residue(("prop_kernel_fft_equal_scalar_fft" + args).c_str(), prop_kernel_fft_equal_scalar_fft(kernel, random_signal(N)));
+            test_residue(("prop_kernel_ifft_equal_scalar_ifft" + args).c_str(), prop_kernel_ifft_equal_scalar_ifft(kernel, random_signal(N)));
+        }
+    }
+    for (size_t N = 1; N <= max_codelet_size; N *= 2) {
+        std::string args = "(random_signal(" + std::to_string(N) + "))";
+        test_residue(("prop_codelet_equal_dft" + args).c_str(), prop_codelet_equal_dft(random_signal(N)));
+        test_residue(("prop_codelet_equal_idft" + args).c_str(), prop_codelet_equal_idft(random_signal(N)));
+    }
+    TEST_RESIDUE(prop_codelet_plan_equal_plan(random_signal(64)));
+    TEST_RESIDUE(prop_codelet_plan_equal_plan(random_signal(128)));
+    TEST_RESIDUE(prop_codelet_plan_equal_plan(random_signal(512)));
+    TEST_RESIDUE(prop_codelet_plan_equal_plan(random_signal(4096)));
+    ThreadPool pool(4);
+    TEST_RESIDUE(prop_parallel_fft_equal_fft(pool, random_signal(4096)));
+    TEST_RESIDUE(prop_parallel_fft_equal_fft(pool, random_signal(1 << 18)));
+    TEST_RESIDUE(prop_parallel_inplace_inverse_fft(pool, random_signal(1 << 17)));
+    TEST_RESIDUE(prop_fft_batch_equal_fft(1024, 3));
+    TEST_RESIDUE(prop_fft_batch_equal_fft(1024, 100));
+    TEST_RESIDUE(prop_ifft_batch_inverse_fft_batch(512, 600));
+    TEST_RESIDUE(prop_rfft_equal_fft(random_real_signal(2)));
+    TEST_RESIDUE(prop_rfft_equal_fft(random_real_signal(4)));
+    TEST_RESIDUE(prop_rfft_equal_fft(random_real_signal(1024)));
+    TEST_RESIDUE(prop_rfft_equal_fft(random_real_signal(2048)));
+    TEST_RESIDUE(prop_rfft_on_unaligned_signal(64));
+    TEST_RESIDUE(prop_rfft_on_unaligned_signal(1024));
+    TEST_RESIDUE(prop_inverse_rfft(random_real_signal(2)));
+    TEST_RESIDUE(prop_inverse_rfft(random_real_signal(8)));
+    TEST_RESIDUE(prop_inverse_rfft(random_real_signal(4096)));
     TEST_RESIDUE(prop_fft_is_decomposed_dft(Signal{7,6,5,4,3,2,i,0}));
     TEST_RESIDUE(prop_fft_is_decomposed_dft(random_signal(1024)));
     TEST(prop_reverse_bits(0xAA, 0x100, 0x55));
     TEST(prop_reverse_bits(0xA5, 0x100, 0xA5));
+    TEST(prop_signals_are_aligned());
+    TEST(prop_steady_state_does_not_allocate());
+    TEST(prop_exited_threads_share_blocks());
+    TEST_RESIDUE(prop_convolver_equals_direct(1000, 1, BlockMethod::OverlapSave));
+    TEST_RESIDUE(prop_convolver_equals_direct(1000, 37, BlockMethod::OverlapSave));
+    TEST_RESIDUE(prop_convolver_equals_direct(1000, 37, BlockMethod::OverlapAdd));
+    TEST_RESIDUE(prop_convolver_equals_direct(5000, 300, BlockMethod::OverlapSave));
+    TEST_RESIDUE(prop_convolver_equals_direct(5000, 300, BlockMethod::OverlapAdd));
+    TEST_RESIDUE(prop_convolver_equals_direct(10, 64, BlockMethod::OverlapSave));
+    TEST_RESIDUE(prop_convolver_equals_direct(10, 64, BlockMethod::OverlapAdd));
+    TEST_RESIDUE(prop_convolver_equals_direct(3000, 64, BlockMethod::OverlapAdd, 64));
+    TEST_RESIDUE(prop_fft_convolve_equals_direct(1, 1));
+    TEST_RESIDUE(prop_fft_convolve_equals_direct(4096, 1000));
+    TEST_RESIDUE(prop_fft_correlate_equals_direct(2000, 100));
+    TEST(prop_fft_correlate_finds_pattern(4000, 128, 1234));
+    TEST(prop_transpose(1, 1));
+    TEST(prop_transpose(33, 70));
+    TEST(prop_transpose(512, 256));
+    TEST_RESIDUE(prop_fft_nd_equals_strided({8, 16}));
+    TEST_RESIDUE(prop_fft_nd_equals_strided({33, 20}));
+    TEST_RESIDUE(prop_fft_nd_equals_strided({4, 8, 16}));
+    TEST_RESIDUE(prop_fft_nd_equals_strided({5, 6, 7}));
+    TEST_RESIDUE(prop_fft_nd_equals_strided({1, 64, 1}));
+    TEST_RESIDUE(prop_inverse_fft_2d(256, 512));
+    TEST_RESIDUE(prop_inverse_fft_3d(12, 10, 9));
+    TEST_RESIDUE(prop_out_of_core_fft_equals_fft(1, 0));
+    TEST_RESIDUE(prop_out_of_core_fft_equals_fft(2, 0));
+    TEST_RESIDUE(prop_out_of_core_fft_equals_fft(1 << 12, 16 << 10));
+    TEST_RESIDUE(prop_out_of_core_fft_equals_fft(1 << 13, 1 << 20));
+    TEST_RESIDUE(prop_out_of_core_fft_equals_fft(1 << 15, 0));
+    TEST_RESIDUE(prop_process_sample_file_equals_fft({SampleFormat::ComplexInt16, 64, 64, 4, Window::Rectangular, false}, 1000));
+    TEST_RESIDUE(prop_process_sample_file_equals_fft({SampleFormat::ComplexFloat32, 256, 100, 3, Window::Hann, true}, 5000));
+    TEST_RESIDUE(prop_process_sample_file_equals_fft({SampleFormat::RealFloat32, 48, 16, 64, Window::Hamming, false}, 3000));
+    TEST_RESIDUE(prop_process_sample_file_equals_fft({SampleFormat::RealInt16, 1024, 512, 2, Window::Blackman, true}, 10000));
+    TEST_RESIDUE(prop_process_sample_file_equals_fft({SampleFormat::RealInt16, 1024, 512, 2, Window::Rectangular, false}, 1000));
+    TEST(prop_hann_window());
+    TEST_RESIDUE(prop_stft_equals_framed_fft(256, 64, Window::Hann, 100, 16));
+    TEST_RESIDUE(prop_stft_equals_framed_fft(256, 300, Window::Hamming, 7, 4));
+    TEST_RESIDUE(prop_stft_equals_framed_fft(1000, 250, Window::Blackman, 4096, 8));
+    TEST_RESIDUE(prop_stft_equals_framed_fft(64, 64, Window::Rectangular, 1, 1));
+    TEST(prop_stft_close_emits_every_frame(64, 16, 5, 200));
+    TEST(prop_stft_close_emits_every_frame(32, 32, 1, 200));
+    TEST(prop_split_by_weight({3, 1}, 8, {6, 2}));
+    TEST(prop_split_by_weight({1, 1, 1}, 10, {4, 3, 3}));
+    TEST(prop_split_by_weight({1, 0}, 5, {5, 0}));
+    TEST(prop_split_by_weight({2, 1}, 1, {1, 0}));
+    {
+        HybridScheduler cpu_only(2, {});
+        TEST_RESIDUE(prop_hybrid_equals_fft(cpu_only, {16, 1000, 4096}));
+        TEST(prop_hybrid_counts_every_job(cpu_only, 1024, 20));
+    }
+
+    if (find_devices().empty()) {
+        std::cout << "No OpenCL device found, skipping the OpenCL tests.\n";
+        return 0;
+    }
+
+    print_platforms();
+    auto device = std::make_shared<OpenClDevice>();
+    Fourier fourier(device, 10);
+
     TEST_RESIDUE(prop_fftcl_init_equals_fft_init(fourier, random_signal(1024)));
     TEST_RESIDUE(prop_fftcl_step_equals_fft_step(fourier, random_signal(1024)));
-    TEST_RESIDUE(prop_fftcl_equals_fft(fourier, random_signal(1024)));
+
+    // 2^14 samples is larger than one work-group's tile on most devices, so
+    // fft_local is followed by fft_step launches, and it takes a radix-4
+    // Stockham stage where 1024 takes a radix-2 one.
+    Fourier large_fourier(device, 14);
+
+    for (auto variant : {Fourier::Variant::Global, Fourier::Variant::Local, Fourier::Variant::Stockham}) {
+        fourier.set_variant(variant);
+        large_fourier.set_variant(variant);
+
+        std::string tag = std::string(" [") + Fourier::variant_name(variant) + "]";
+        test_residue(("prop_fftcl_equals_fft(fourier, random_signal(1024))" + tag).c_str(), prop_fftcl_equals_fft(fourier, random_signal(1024)));
+        test_residue(("prop_fftcl_equals_fft(large_fourier, random_signal(1 << 14))" + tag).c_str(), prop_fftcl_equals_fft(large_fourier, random_signal(1 << 14)));
+        test_residue(("prop_fftcl_batch_equals_fft(fourier, 1)" + tag).c_str(), prop_fftcl_batch_equals_fft(fourier, 1));
+        test_residue(("prop_fftcl_batch_equals_fft(fourier, 16)" + tag).c_str(), prop_fftcl_batch_equals_fft(fourier, 16));
+        test_residue(("prop_fftcl_rfft_equals_rfft(fourier, random_real_signal(1024))" + tag).c_str(), prop_fftcl_rfft_equals_rfft(fourier, random_real_signal(1024)));
+        test_residue(("prop_fftcl_irfft_equals_irfft(fourier, random_signal(513))" + tag).c_str(), prop_fftcl_irfft_equals_irfft(fourier, random_signal(513)));
+        test_residue(("prop_fftcl_pipeline_equals_fft(fourier, 10)" + tag).c_str(), prop_fftcl_pipeline_equals_fft(fourier, 10));
+        test_residue(("prop_fftcl_zero_copy_equals_fft(fourier, device, random_signal(1024))" + tag).c_str(), prop_fftcl_zero_copy_equals_fft(fourier, device, random_signal(1024)));
+        test_residue(("prop_fftcl_zero_copy_equals_fft(large_fourier, device, random_signal(1 << 14))" + tag).c_str(), prop_fftcl_zero_copy_equals_fft(large_fourier, device, random_signal(1 << 14)));
+    }
+
+    TEST_RESIDUE(prop_fftcl_tuning_equals_fft(fourier, Fourier::Variant::Global, 3, 64, random_signal(1024)));
+    TEST_RESIDUE(prop_fftcl_tuning_equals_fft(fourier, Fourier::Variant::Local, 3, 128, random_signal(1024)));
+    TEST_RESIDUE(prop_fftcl_tuning_equals_fft(large_fourier, Fourier::Variant::Local, 3, 256, random_signal(1 << 14)));
+    TEST_RESIDUE(prop_fftcl_tuning_equals_fft(fourier, Fourier::Variant::Stockham, 1, 32, random_signal(1024)));
+    TEST_RESIDUE(prop_fftcl_tuning_equals_fft(fourier, Fourier::Variant::Stockham, 2, 1024, random_signal(1024)));
+    TEST_RESIDUE(prop_fftcl_autotuned_equals_fft(fourier, random_signal(1024)));
+    TEST(prop_fftcl_tuning_file_round_trips(fourier));
+    TEST(prop_fftcl_tuning_file_skips_bad_lines(fourier));
+    TEST(prop_fftcl_program_binary_is_cached());
+    TEST(prop_profiler_counts_commands());
+    TEST(prop_fouriers_own_their_kernels());
+    TEST(prop_fourier_cache_counts_hits_and_misses(device));
+    TEST(prop_fourier_cache_evicts_least_recently_used(device));
+    TEST_RESIDUE(prop_fourier_cache_equals_fft(device));
+
+    // Two shards on one device exercise the split where only one device is
+    // available; open_devices() covers whatever is installed.
+    ShardedFourier uneven_shards({device, device}, 10);
+    uneven_shards.set_weights({3, 1});
+    TEST_RESIDUE(prop_fftcl_batch_equals_fft(uneven_shards, 16));
+    ShardedFourier device_shards(open_devices(), 10);
+    device_shards.calibrate(4);
+    TEST_RESIDUE(prop_fftcl_batch_equals_fft(device_shards, 16));
+
+    TEST_RESIDUE(prop_fftcl_nd_equals_fft_nd(device, {4, 5}));
+    TEST_RESIDUE(prop_fftcl_nd_equals_fft_nd(device, {5, 1}));
+    TEST_RESIDUE(prop_fftcl_nd_equals_fft_nd(device, {11, 5}));
+    TEST_RESIDUE(prop_fftcl_nd_equals_fft_nd(device, {3, 4, 2}));
+    TEST_RESIDUE(prop_fftcl_convolver_equals_direct(device, 5000, 300, 4));
+    TEST_RESIDUE(prop_fftcl_convolver_equals_direct(device, 100, 64, 16));
+
+    {
+        FourierCache cache(device);
+        auto device_batch = [&](Complex* spectra, Complex const* signals, size_t N, size_t batch_count) {
+            size_t power = 0;
+            while (((size_t) 1 << power) < N) ++power;
+            cache.plan(power)->fft_batch(spectra, signals, batch_count, N, N);
+        };
+        TEST_RESIDUE(prop_out_of_core_fft_equals_fft(1 << 10, 4 << 10, device_batch));
+    }
+
+    Fourier stft_fourier(device, 9);
+    auto stft_fourier_batch = [&](Complex* spectra, Complex const* signals, size_t N, size_t batch_count) {
+        assert(N == stft_fourier.sample_count());
+        stft_fourier.fft_batch(spectra, signals, batch_count, N, N);
+    };
+    TEST_RESIDUE(prop_stft_equals_framed_fft(512, 128, Window::Hann, 1000, 8, stft_fourier_batch));
+
+    {
+        HybridScheduler scheduler(2, {device});
+        scheduler.set_crossover(0, 256);
+        TEST_RESIDUE(prop_hybrid_equals_fft(scheduler, {16, 1000, 256, 1024, 64, 4096, 48, 2048}));
+        TEST(prop_hybrid_counts_every_job(scheduler, 1024, 20));
+        TEST(prop_hybrid_routes_by_crossover(scheduler, 20));
+        TEST(prop_hybrid_cpu_steals_from_device(scheduler, 4096, 64));
+        scheduler.calibrate(4, 8);
+        TEST_RESIDUE(prop_hybrid_equals_fft(scheduler, {16, 32, 256, 100}));
+    }
 
     return 0;
 }
@@ -57,18 +57,283 @@ static Complex mult(Complex a, Complex b)
     return (Complex)(a.x*b.x - a.y*b.y, a.x*b.y + a.y*b.x);
 }
 
+// These kernels run one work-item per sample along dimension 0. Dimension 1,
+// when present, selects one of a batch of transforms stored back to back.
+
 kernel void fft_init(Complex global const* X, uint exponent_n, Complex global* Y)
 {
     uint i = get_global_id(0);
-    Y[i] = X[reverse_bits_uint(i, exponent_n)];
+    uint offset = get_global_id(1) << exponent_n;
+    Y[offset + i] = X[offset + reverse_bits_uint(i, exponent_n)];
 }
 
 kernel void fft_step(Complex global const* Y, uint B, Complex global* Y_)
 {
     uint i = get_global_id(0);
+    uint offset = get_global_id(1)*get_global_size(0);
     uint B_ = B*2;
     uint n_ = i/B_;
     uint k_ = i%B_;
 
+    Y += offset;
+    Y_ += offset;
     Y_[index(n_, B_, k_)] = Y[index(n_*2, B, k_%B)] + mult(W(k_, B_), Y[index(n_*2+1, B, k_%B)]);
 }
+
+// fft_init followed by the first exponent_tile stages, on tiles of
+// 2^exponent_tile samples held in local memory. The work-group size must be
+// 2^exponent_tile: every block the first stages combine lies inside one
+// tile, so only the later stages need fft_step and global memory.
+kernel void fft_local(Complex global const* X, uint exponent_n, Complex local* tile, Complex global* Y)
+{
+    uint i = get_global_id(0);
+    uint l = get_local_id(0);
+    uint tile_size = get_local_size(0);
+    uint offset = get_global_id(1) << exponent_n;
+
+    tile[l] = X[offset + reverse_bits_uint(i, exponent_n)];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint B = 1; B != tile_size; B <<= 1) {
+        uint B_ = B*2;
+        uint n_ = l/B_;
+        uint k_ = l%B_;
+
+        Complex y = tile[index(n_*2, B, k_%B)] + mult(W(k_, B_), tile[index(n_*2+1, B, k_%B)]);
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        tile[l] = y;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    Y[offset + i] = tile[l];
+}
+
+// Self-sorting Stockham stages. A transform of n = 2^exponent_n samples is a
+// sequence of radix-R stages; entering a stage there are s = 2^exponent_s
+// interleaved sub-transforms of length n/s, and each work-item takes R
+// inputs m = n/(R*s) apart and writes R outputs s apart:
+//
+//   Y[q + s*(R*p + u)] = W(p*u*s, n) * sum_j X[q + s*(p + j*m)]*W(j*u, R)
+//
+// for q < s and p < m. The output of the last stage is in natural order, so
+// no bit-reversal pass is needed. W(k, n) is read from twiddles[k], which
+// holds W(k, n) for k < n. One work-item per R samples along dimension 0;
+// dimension 1 selects a transform of the batch as for the kernels above.
+
+static Complex mult_minus_i(Complex a)
+{
+    return (Complex)(a.y, -a.x);
+}
+
+static void dft2(Complex* a0, Complex* a1)
+{
+    Complex t = *a0;
+    *a0 = t + *a1;
+    *a1 = t - *a1;
+}
+
+static void dft4(Complex* a0, Complex* a1, Complex* a2, Complex* a3)
+{
+    Complex t0 = *a0 + *a2;
+    Complex t1 = *a0 - *a2;
+    Complex t2 = *a1 + *a3;
+    Complex t3 = mult_minus_i(*a1 - *a3);
+
+    *a0 = t0 + t2;
+    *a1 = t1 + t3;
+    *a2 = t0 - t2;
+    *a3 = t1 - t3;
+}
+
+static void dft8(Complex* a)
+{
+    // Even and odd inputs, then one radix-2 step with W(u, 8).
+    Complex e[4] = { a[0], a[2], a[4], a[6] };
+    Complex o[4] = { a[1], a[3], a[5], a[7] };
+    dft4(&e[0], &e[1], &e[2], &e[3]);
+    dft4(&o[0], &o[1], &o[2], &o[3]);
+
+    float const r = 0.70710678118654752f;
+    o[1] = (Complex)(r*(o[1].x + o[1].y), r*(o[1].y - o[1].x));
+    o[2] = mult_minus_i(o[2]);
+    o[3] = (Complex)(r*(o[3].y - o[3].x), -r*(o[3].x + o[3].y));
+
+    for (uint u = 0; u != 4; ++u) {
+        a[u] = e[u] + o[u];
+        a[u + 4] = e[u] - o[u];
+    }
+}
+
+kernel void stockham_radix2(Complex global const* X, uint exponent_s, Complex global const* twiddles, Complex global* Y)
+{
+    uint g = get_global_id(0);
+    uint n = get_global_size(0)*2;
+    uint offset = get_global_id(1)*n;
+    uint s = 1 << exponent_s;
+    uint m = n >> (exponent_s + 1);
+    uint q = g & (s - 1);
+    uint p = g >> exponent_s;
+
+    X += offset;
+    Y += offset;
+
+    Complex a0 = X[q + s*p];
+    Complex a1 = X[q + s*(p + m)];
+    dft2(&a0, &a1);
+
+    Y[q + s*2*p] = a0;
+    Y[q + s*(2*p + 1)] = mult(a1, twiddles[p*s]);
+}
+
+kernel void stockham_radix4(Complex global const* X, uint exponent_s, Complex global const* twiddles, Complex global* Y)
+{
+    uint g = get_global_id(0);
+    uint n = get_global_size(0)*4;
+    uint offset = get_global_id(1)*n;
+    uint s = 1 << exponent_s;
+    uint m = n >> (exponent_s + 2);
+    uint q = g & (s - 1);
+    uint p = g >> exponent_s;
+
+    X += offset;
+    Y += offset;
+
+    Complex a0 = X[q + s*p];
+    Complex a1 = X[q + s*(p + m)];
+    Complex a2 = X[q + s*(p + 2*m)];
+    Complex a3 = X[q + s*(p + 3*m)];
+    dft4(&a0, &a1, &a2, &a3);
+
+    Y[q + s*4*p] = a0;
+    Y[q + s*(4*p + 1)] = mult(a1, twiddles[p*s]);
+    Y[q + s*(4*p + 2)] = mult(a2, twiddles[2*p*s]);
+    Y[q + s*(4*p + 3)] = mult(a3, twiddles[3*p*s]);
+}
+
+kernel void stockham_radix8(Complex global const* X, uint exponent_s, Complex global const* twiddles, Complex global* Y)
+{
+    uint g = get_global_id(0);
+    uint n = get_global_size(0)*8;
+    uint offset = get_global_id(1)*n;
+    uint s = 1 << exponent_s;
+    uint m = n >> (exponent_s + 3);
+    uint q = g & (s - 1);
+    uint p = g >> exponent_s;
+
+    X += offset;
+    Y += offset;
+
+    Complex a[8];
+    for (uint j = 0; j != 8; ++j) {
+        a[j] = X[q + s*(p + j*m)];
+    }
+    dft8(a);
+
+    Y[q + s*8*p] = a[0];
+    for (uint u = 1; u != 8; ++u) {
+        Y[q + s*(8*p + u)] = mult(a[u], twiddles[u*p*s]);
+    }
+}
+
+// Real transforms of n = 2*half_n samples go through a complex transform of
+// the half_n values z[m] = x[2m] + i*x[2m+1].
+
+// One work-item per output bin k <= half_n: splits Z = FFT(z) into the
+// spectra of the even and odd samples and combines them into bin k.
+kernel void rfft_postprocess(Complex global const* Z, uint half_n, Complex global* X)
+{
+    uint k = get_global_id(0);
+
+    Complex a = Z[k % half_n];
+    Complex b = Z[(half_n - k) % half_n];
+    b.y = -b.y;
+
+    Complex even = 0.5f*(a + b);
+    Complex d = 0.5f*(a - b);
+    Complex odd = (Complex)(d.y, -d.x);
+
+    X[k] = even + mult(W(k, 2*half_n), odd);
+}
+
+// One work-item per k < half_n: rebuilds bin k of Z from bins k and
+// half_n - k of X, conjugated so that the forward transform inverts it.
+kernel void irfft_preprocess(Complex global const* X, uint half_n, Complex global* Z)
+{
+    uint k = get_global_id(0);
+
+    Complex a = X[k];
+    Complex b = X[half_n - k];
+    b.y = -b.y;
+
+    Complex even = 0.5f*(a + b);
+    Complex w = W(k, 2*half_n);
+    w.y = -w.y;
+    Complex odd = mult(0.5f*(a - b), w);
+
+    // conj(even + i*odd)
+    Z[k] = (Complex)(even.x - odd.y, -(even.y + odd.x));
+}
+
+// Overlap-save convolution with n-point transforms. Block b of a batch
+// starts step*b samples into the input and overlaps the previous block by
+// n - step samples, which the transform of the filter wraps into.
+
+// One work-item per sample of block get_global_id(1).
+kernel void overlap_save_scatter(Complex global const* input, uint step, Complex global* X)
+{
+    uint i = get_global_id(0);
+    uint b = get_global_id(1);
+    X[b*get_global_size(0) + i] = input[b*step + i];
+}
+
+// One work-item per bin: conj(X*H), so that a forward transform computes
+// the inverse transform of X*H, conjugated. H is the filter's spectrum
+// scaled by 1/n.
+kernel void multiply_conj(Complex global const* X, Complex global const* H, Complex global* Y)
+{
+    uint k = get_global_id(0);
+    uint offset = get_global_id(1)*get_global_size(0);
+    Complex y = mult(X[offset + k], H[k]);
+    Y[offset + k] = (Complex)(y.x, -y.y);
+}
+
+// One work-item per output sample of block get_global_id(1): the last step
+// samples of each block, conjugated back, stored back to back.
+kernel void overlap_save_gather(Complex global const* Y, uint n, Complex global* output)
+{
+    uint j = get_global_id(0);
+    uint b = get_global_id(1);
+    uint step = get_global_size(0);
+    Complex y = Y[b*n + n - step + j];
+    output[b*step + j] = (Complex)(y.x, -y.y);
+}
+
+// Transposes get_global_size(2) rows x cols matrices stored back to back,
+// a tile at a time: a work-group reads a tile of X a row at a time into
+// local memory and writes it to Y a row at a time, so that both sides stay
+// coalesced. Work-groups are tile x tile, tile being get_local_size(0), and
+// tile holds tile*(tile + 1) values: the padding keeps the column reads off
+// a single bank.
+kernel void transpose(Complex global const* X, uint rows, uint cols, Complex local* tile, Complex global* Y)
+{
+    uint t = get_local_size(0);
+    uint lx = get_local_id(0);
+    uint ly = get_local_id(1);
+    uint offset = get_global_id(2)*rows*cols;
+
+    uint r = get_group_id(1)*t + ly;
+    uint c = get_group_id(0)*t + lx;
+    if (r < rows && c < cols) {
+        tile[ly*(t + 1) + lx] = X[offset + r*cols + c];
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Row c_ of Y is column c_ of X.
+    uint c_ = get_group_id(0)*t + ly;
+    uint r_ = get_group_id(1)*t + lx;
+    if (c_ < cols && r_ < rows) {
+        Y[offset + c_*rows + r_] = tile[lx*(t + 1) + ly];
+    }
+}